@@ -0,0 +1,242 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Double-buffered, CRC-checked configuration records in flash.
+ *
+ * N.B. Core 1 executes from flash, so it must have called
+ * multicore_lockout_victim_init() before anything is written here.
+ */
+
+/* Pico SDK headers */
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+
+/* Standard headers */
+#include <string.h>
+
+/* Local headers */
+#include "flash_store.h"
+
+#define	FLASH_STORE_MAGIC	(('N' << 24) | ('K' << 16) | ('B' << 8) | 'S')
+
+struct flash_store_hdr {
+	uint32_t	magic;
+	uint16_t	area;
+	uint16_t	version;	/* payload format version */
+	uint32_t	generation;
+	uint32_t	len;		/* payload length */
+	uint32_t	crc;		/* CRC-32 of payload */
+};
+
+_Static_assert(sizeof(struct flash_store_hdr) == FLASH_STORE_HDR_SIZE,
+    "FLASH_STORE_HDR_SIZE is wrong");
+_Static_assert(FLASH_STORE_HDR_SIZE + FLASH_STORE_MAXLEN == FLASH_SECTOR_SIZE,
+    "FLASH_STORE_MAXLEN is wrong");
+_Static_assert(FLASH_STORE_SIZE == FLASH_STORE_NAREAS * 2 * FLASH_SECTOR_SIZE,
+    "FLASH_STORE_SIZE is wrong");
+_Static_assert(FLASH_STORE_SIZE < PICO_FLASH_SIZE_BYTES,
+    "FLASH_STORE_SIZE is larger than the flash");
+
+/*
+ * Nothing but convention keeps a large enough firmware image from
+ * running into the store at the end of flash, so give the linker the
+ * size of the store, and flash_store.ld fails the link if they overlap.
+ */
+#define	FLASH_STORE_STR1(x)	#x
+#define	FLASH_STORE_STR(x)	FLASH_STORE_STR1(x)
+
+__asm__(".global __flash_store_size\n"
+	".set __flash_store_size, " FLASH_STORE_STR(FLASH_STORE_SIZE) "\n");
+
+/*
+ * 2 slots per area, at the very end of flash.  Areas are allocated
+ * working down from the end, so that adding an area doesn't move the
+ * existing ones.
+ */
+#define	FLASH_STORE_SLOT_OFFSET(area, slot)				\
+	(PICO_FLASH_SIZE_BYTES - ((((area) + 1) * 2) * FLASH_SECTOR_SIZE) + \
+	 ((slot) * FLASH_SECTOR_SIZE))
+#define	FLASH_STORE_SLOT_HDR(area, slot)				\
+	((const struct flash_store_hdr *)				\
+	 (XIP_BASE + FLASH_STORE_SLOT_OFFSET((area), (slot))))
+
+/* Staging buffer for programming a slot; must be in RAM. */
+static uint8_t flash_store_buf[FLASH_SECTOR_SIZE];
+
+static uint32_t
+flash_store_crc32(const void *buf, size_t len)
+{
+	const uint8_t *cp = buf;
+	uint32_t crc = 0xffffffff;
+
+	while (len--) {
+		crc ^= *cp++;
+		for (int i = 0; i < 8; i++) {
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+static bool
+flash_store_slot_valid(unsigned int area, unsigned int slot)
+{
+	const struct flash_store_hdr *hdr = FLASH_STORE_SLOT_HDR(area, slot);
+
+	return hdr->magic == FLASH_STORE_MAGIC &&
+	       hdr->area == area &&
+	       hdr->len <= FLASH_STORE_MAXLEN &&
+	       hdr->crc == flash_store_crc32(hdr + 1, hdr->len);
+}
+
+/*
+ * Returns the slot holding the newest valid record for the area,
+ * or -1 if there isn't one.
+ */
+static int
+flash_store_newest(unsigned int area)
+{
+	bool valid0 = flash_store_slot_valid(area, 0);
+	bool valid1 = flash_store_slot_valid(area, 1);
+
+	if (valid0 && valid1) {
+		/* Serial number arithmetic, in case we ever wrap. */
+		int32_t delta = (int32_t)
+		    (FLASH_STORE_SLOT_HDR(area, 1)->generation -
+		     FLASH_STORE_SLOT_HDR(area, 0)->generation);
+		return delta > 0 ? 1 : 0;
+	}
+	if (valid0) {
+		return 0;
+	}
+	if (valid1) {
+		return 1;
+	}
+	return -1;
+}
+
+/*
+ * Returns a pointer to the payload of the current record (directly
+ * in XIP flash), or NULL if there isn't one of the specified version.
+ */
+const void *
+flash_store_load(unsigned int area, uint16_t version, size_t *lenp)
+{
+	const struct flash_store_hdr *hdr;
+	int slot;
+
+	if (area >= FLASH_STORE_NAREAS ||
+	    (slot = flash_store_newest(area)) < 0) {
+		return NULL;
+	}
+
+	hdr = FLASH_STORE_SLOT_HDR(area, slot);
+	if (hdr->version != version) {
+		return NULL;
+	}
+
+	*lenp = hdr->len;
+	return hdr + 1;
+}
+
+static void
+flash_store_program(uint32_t offset, const uint8_t *data, size_t len)
+{
+	uint32_t ints;
+
+	/*
+	 * Core 1 can't be fetching instructions from flash while
+	 * we're doing this, and neither can any interrupt handler
+	 * on this core.
+	 */
+	multicore_lockout_start_blocking();
+	ints = save_and_disable_interrupts();
+
+	flash_range_erase(offset, FLASH_SECTOR_SIZE);
+	if (len != 0) {
+		flash_range_program(offset, data, len);
+	}
+
+	restore_interrupts(ints);
+	multicore_lockout_end_blocking();
+}
+
+bool
+flash_store_save(unsigned int area, uint16_t version, const void *data,
+    size_t len)
+{
+	struct flash_store_hdr hdr;
+	uint32_t generation = 0;
+	int slot;
+
+	if (area >= FLASH_STORE_NAREAS || len > FLASH_STORE_MAXLEN) {
+		return false;
+	}
+
+	/* Write into whichever slot doesn't hold the current record. */
+	if ((slot = flash_store_newest(area)) >= 0) {
+		generation = FLASH_STORE_SLOT_HDR(area, slot)->generation + 1;
+		slot ^= 1;
+	} else {
+		slot = 0;
+	}
+
+	hdr.magic = FLASH_STORE_MAGIC;
+	hdr.area = area;
+	hdr.version = version;
+	hdr.generation = generation;
+	hdr.len = len;
+	hdr.crc = flash_store_crc32(data, len);
+
+	memset(flash_store_buf, 0xff, sizeof(flash_store_buf));
+	memcpy(flash_store_buf, &hdr, sizeof(hdr));
+	memcpy(flash_store_buf + sizeof(hdr), data, len);
+
+	flash_store_program(FLASH_STORE_SLOT_OFFSET(area, slot),
+	    flash_store_buf,
+	    (sizeof(hdr) + len + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1));
+
+	/* Read it back to make sure it stuck. */
+	return flash_store_newest(area) == slot;
+}
+
+void
+flash_store_erase(unsigned int area)
+{
+	if (area >= FLASH_STORE_NAREAS) {
+		return;
+	}
+
+	for (unsigned int slot = 0; slot < 2; slot++) {
+		if (FLASH_STORE_SLOT_HDR(area, slot)->magic != 0xffffffff) {
+			flash_store_program(FLASH_STORE_SLOT_OFFSET(area, slot),
+			    NULL, 0);
+		}
+	}
+}
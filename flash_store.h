@@ -0,0 +1,66 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _FLASH_STORE_H_
+#define	_FLASH_STORE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Persistent storage for run-time configuration, kept in reserved
+ * sectors at the very end of the Pico's flash.
+ *
+ * Each storage area consists of 2 sectors ("slots").  A record is
+ * written to whichever slot does not hold the current record, and
+ * carries a generation number and a CRC-32 of the payload.  At load
+ * time, the valid record with the newest generation wins.  If we lose
+ * power while writing a record, the CRC on the new slot won't match
+ * and the previous record is used instead.
+ */
+
+#define	FLASH_STORE_AREA_KEYMAP		0
+#define	FLASH_STORE_AREA_MACROS		1
+#define	FLASH_STORE_AREA_SETTINGS	2
+#define	FLASH_STORE_NAREAS		3
+
+/*
+ * Flash reserved for the store (2 sectors per area), as a plain number
+ * so that it can be handed to the linker; see flash_store.ld.
+ */
+#define	FLASH_STORE_SIZE		24576
+
+#define	FLASH_STORE_HDR_SIZE		20
+#define	FLASH_STORE_MAXLEN		(4096 - FLASH_STORE_HDR_SIZE)
+
+const void *	flash_store_load(unsigned int area, uint16_t version,
+		    size_t *lenp);
+bool		flash_store_save(unsigned int area, uint16_t version,
+		    const void *data, size_t len);
+void		flash_store_erase(unsigned int area);
+
+#endif /* _FLASH_STORE_H_ */
@@ -0,0 +1,68 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * With a single interface, only one report can go out per interval, so
+ * pick which one based on the order the data arrived in.  That order
+ * can't be followed while the keyboard is in the middle of a sequence,
+ * macro or Unicode entry, though: the byte that started it is already
+ * gone from the order, and the keyboard's next byte may be at the head,
+ * where it stays until the whole thing is done.  A long macro would
+ * hold up any joystick behind it, so while the keyboard is busy the
+ * keyboard and the joysticks take turns instead.
+ */
+
+/* Local headers */
+#include "hid_sched.h"
+
+void
+hid_sched_init(struct hid_sched *hs)
+{
+	hs->kbd_turn = false;
+}
+
+/*
+ * Returns the source to send a report for next, given the oldest
+ * entry in the order, the oldest joystick entry in the order (either
+ * can be HID_SRC_NONE), and whether the keyboard is busy.
+ */
+uint8_t
+hid_sched_pick(struct hid_sched *hs, uint8_t head, uint8_t joy, bool busy)
+{
+	if (busy && joy != HID_SRC_NONE) {
+		hs->kbd_turn = !hs->kbd_turn;
+		return hs->kbd_turn ? joy : HID_SRC_KBD;
+	}
+
+	hs->kbd_turn = false;
+	if (busy) {
+		return HID_SRC_KBD;
+	}
+	if (head != HID_SRC_NONE && head != HID_SRC_KBD) {
+		return head;
+	}
+	return HID_SRC_KBD;
+}
@@ -0,0 +1,49 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _HID_SCHED_H_
+#define	_HID_SCHED_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Choosing which report goes out next when everything shares one
+ * interface; see hid_sched.c.
+ */
+#define	HID_SRC_KBD		0
+#define	HID_SRC_JOY0		1
+#define	HID_SRC_JOY1		2
+#define	HID_SRC_NONE		0xff
+
+struct hid_sched {
+	bool		kbd_turn;	/* keyboard goes next while busy */
+};
+
+void		hid_sched_init(struct hid_sched *);
+uint8_t		hid_sched_pick(struct hid_sched *, uint8_t, uint8_t, bool);
+
+#endif /* _HID_SCHED_H_ */
@@ -0,0 +1,826 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Map NABU keycodes to HID key codes.
+ *
+ * The HID Report array sends a report for each modifier key, in the
+ * seqence they are pressed / released.  So, an 'A' is:
+ *
+ *	Shift, Shift + A, Shift, none
+ *
+ * Almost every key follows that pattern, so the keymap only stores the
+ * HID key code along with the modifiers to wrap around it, and the
+ * sequence is generated by keymap_expand() when the key is processed.
+ * Modifiers are pressed in the order Ctrl, Shift, Alt, Meta, AltGr, and
+ * are released in the reverse order.  The final code in each sequence
+ * is always 0.  For keys where we get individual Down/Up events from
+ * the NABU keyboard, we don't use sequences, we just send the individual
+ * event (those keys aren't affected by modifiers).
+ *
+ * The few odd-balls that don't fit the pattern are M_EXCEPTION entries,
+ * which index a short list of literal sequences.
+ *
+ * Unassigned entries get 0, which conveniently is HID_KEY_NONE.  N.B.
+ * the NABU keyboard reader thread won't even enqueue keystroke events
+ * for these unassigned keys.
+ *
+ * The keymap depends on the host's keyboard layout; on a German host,
+ * '@' is AltGr + Q, not Shift + 2.  So keymaps are generated from a
+ * description of what character each NABU code stands for, plus a
+ * table for each host layout that says how to type each character.
+ */
+
+/* Pico SDK headers */
+#include "pico/stdlib.h"
+
+/* TinyUSB SDK headers */
+#include "bsp/board.h"
+#include "tusb.h"
+
+/* Standard headers */
+#include <string.h>
+
+/* Local headers */
+#include "keymap.h"
+
+/*
+ * What each NABU code means, independent of the host's keyboard layout.
+ * Most codes are characters, which are looked up in the host layout
+ * when the keymap is built.  The rest are codes that are the same no
+ * matter what the host layout is.
+ */
+struct nabu_desc {
+	uint16_t	code;	/* layout-independent code, if ch == 0 */
+	uint8_t		ch;	/* character to type */
+	uint8_t		flags;	/* NC_* */
+};
+
+#define	NC_CTRL		0x01	/* type it with Ctrl held */
+#define	NC_HOLD		0x02	/* key-down; hold it until NC_RELEASE */
+#define	NC_RELEASE	0x04	/* key-up for an NC_HOLD character */
+
+#define	KEY(m)		{ .code = (m) }
+#define	CH(c)		{ .ch = (c) }
+#define	CTRL(c)		{ .ch = (c), .flags = NC_CTRL }
+#define	HOLD(c)		{ .ch = (c), .flags = NC_HOLD }
+#define	RELEASE(c)	{ .ch = (c), .flags = NC_RELEASE }
+#define	ASCII(c)	[(c)] = CH(c)
+
+static const struct nabu_desc nabu_desc[256] = {
+/*
+ * CTRL just lops off the 2 upper bits of the keycode
+ * on the NABU keyboard (except for C-'<' ??), but we
+ * simplify to C-a, C-c, etc.
+ */
+[0x00]		=	CTRL('@'),
+[0x01]		=	CTRL('a'),
+[0x02]		=	CTRL('b'),
+[0x03]		=	CTRL('c'),
+[0x04]		=	CTRL('d'),
+[0x05]		=	CTRL('e'),
+[0x06]		=	CTRL('f'),
+[0x07]		=	CTRL('g'),
+[0x08]		=	KEY(HID_KEY_BACKSPACE),		/* Backspace */
+[0x09]		=	KEY(HID_KEY_TAB),		/* Tab */
+[0x0a]		=	KEY(HID_KEY_ENTER),		/* LF */
+[0x0b]		=	CTRL('k'),
+[0x0c]		=	CTRL('l'),
+[0x0d]		=	KEY(HID_KEY_ENTER),		/* CR */
+[0x0e]		=	CTRL('n'),
+[0x0f]		=	CTRL('o'),
+[0x10]		=	CTRL('p'),
+[0x11]		=	CTRL('q'),
+[0x12]		=	CTRL('r'),
+[0x13]		=	CTRL('s'),
+[0x14]		=	CTRL('t'),
+[0x15]		=	CTRL('u'),
+[0x16]		=	CTRL('v'),
+[0x17]		=	CTRL('w'),
+[0x18]		=	CTRL('x'),
+[0x19]		=	CTRL('y'),
+[0x1a]		=	CTRL('z'),
+[0x1b]		=	KEY(HID_KEY_ESCAPE),		/* ESC */
+[0x1c]		=	CTRL('<'),
+[0x1d]		=	CTRL(']'),
+[0x1e]		=	CTRL('^'),
+[0x1f]		=	CTRL('_'),
+
+	ASCII(' '), ASCII('!'), ASCII('"'), ASCII('#'),
+	ASCII('$'), ASCII('%'), ASCII('&'), ASCII('\''),
+	ASCII('('), ASCII(')'), ASCII('*'), ASCII('+'),
+	ASCII(','), ASCII('-'), ASCII('.'), ASCII('/'),
+	ASCII('0'), ASCII('1'), ASCII('2'), ASCII('3'),
+	ASCII('4'), ASCII('5'), ASCII('6'), ASCII('7'),
+	ASCII('8'), ASCII('9'), ASCII(':'), ASCII(';'),
+	ASCII('<'), ASCII('='), ASCII('>'), ASCII('?'),
+
+	ASCII('@'), ASCII('A'), ASCII('B'), ASCII('C'),
+	ASCII('D'), ASCII('E'), ASCII('F'), ASCII('G'),
+	ASCII('H'), ASCII('I'), ASCII('J'), ASCII('K'),
+	ASCII('L'), ASCII('M'), ASCII('N'), ASCII('O'),
+	ASCII('P'), ASCII('Q'), ASCII('R'), ASCII('S'),
+	ASCII('T'), ASCII('U'), ASCII('V'), ASCII('W'),
+	ASCII('X'), ASCII('Y'), ASCII('Z'), ASCII('['),
+	/* 0x5c */  ASCII(']'), ASCII('^'), ASCII('_'),
+
+	/* 0x60 */  ASCII('a'), ASCII('b'), ASCII('c'),
+	ASCII('d'), ASCII('e'), ASCII('f'), ASCII('g'),
+	ASCII('h'), ASCII('i'), ASCII('j'), ASCII('k'),
+	ASCII('l'), ASCII('m'), ASCII('n'), ASCII('o'),
+	ASCII('p'), ASCII('q'), ASCII('r'), ASCII('s'),
+	ASCII('t'), ASCII('u'), ASCII('v'), ASCII('w'),
+	ASCII('x'), ASCII('y'), ASCII('z'), ASCII('{'),
+	/* 0x7c */  ASCII('}'), /* 0x7e */
+
+[0x7f]		=	KEY(HID_KEY_BACKSPACE),		/* DEL */
+
+/* 0x80 - 0x9f */
+
+/* 0xa0 - 0xbf */
+
+/* 0xc0 - 0xdf */
+
+[0xe0]		=	KEY(M_DOWN | HID_KEY_ARROW_RIGHT),
+[0xe1]		=	KEY(M_DOWN | HID_KEY_ARROW_LEFT),
+[0xe2]		=	KEY(M_DOWN | HID_KEY_ARROW_UP),
+[0xe3]		=	KEY(M_DOWN | HID_KEY_ARROW_DOWN),
+[0xe4]		=	KEY(M_DOWN | HID_KEY_PAGE_DOWN),	/* |||> */
+[0xe5]		=	KEY(M_DOWN | HID_KEY_PAGE_UP),		/* <||| */
+	/*
+	 * There isn't really a good alternative for \ and |, so we steal
+	 * the NO and YES keys, respectively.  Because these keys don't
+	 * self-repeat, we end their key-down sequences without unwinding
+	 * to HID_KEY_NONE, and let the USB host do the key repeat itself.
+	 * We do this by ending the sequence with whatever HID key code
+	 * is present with M_ENDSEQ.
+	 */
+[0xe6]		=	HOLD('\\'),			/* NO */
+[0xe7]		=	HOLD('|'),			/* YES */
+[0xe8]		=	KEY(M_DOWN | M_META),		/* SYM */
+[0xe9]		=	KEY(M_DOWN | HID_KEY_PAUSE),	/* PAUSE */
+[0xea]		=	KEY(M_DOWN | M_ALT),		/* TV/NABU */
+/* 0xeb - 0xef */
+[0xf0]		=	KEY(M_UP | HID_KEY_ARROW_RIGHT),
+[0xf1]		=	KEY(M_UP | HID_KEY_ARROW_LEFT),
+[0xf2]		=	KEY(M_UP | HID_KEY_ARROW_UP),
+[0xf3]		=	KEY(M_UP | HID_KEY_ARROW_DOWN),
+[0xf4]		=	KEY(M_UP | HID_KEY_PAGE_DOWN),		/* |||> */
+[0xf5]		=	KEY(M_UP | HID_KEY_PAGE_UP),		/* <||| */
+[0xf6]		=	RELEASE('\\'),			/* NO */
+[0xf7]		=	RELEASE('|'),			/* YES */
+[0xf8]		=	KEY(M_UP | M_META),		/* SYM */
+[0xf9]		=	KEY(M_UP | HID_KEY_PAUSE),	/* PAUSE */
+[0xfa]		=	KEY(M_UP | M_ALT),		/* TV/NABU */
+/* 0xfb - 0xff */
+};
+
+/*
+ * How to type each character on a given host layout.  Letters are
+ * handled separately, since there are only a few ways to arrange them.
+ * Characters typed with a dead key are flagged with L_DEAD; we follow
+ * them with a space to get the character on its own.  Where Windows
+ * and other systems disagree about a layout, we follow Windows.
+ */
+#define	L_DEAD		M_DOWN		/* never used in a layout table */
+
+#define	DIGITS(m)							\
+	['0'] = (m) | HID_KEY_0, ['1'] = (m) | HID_KEY_1,		\
+	['2'] = (m) | HID_KEY_2, ['3'] = (m) | HID_KEY_3,		\
+	['4'] = (m) | HID_KEY_4, ['5'] = (m) | HID_KEY_5,		\
+	['6'] = (m) | HID_KEY_6, ['7'] = (m) | HID_KEY_7,		\
+	['8'] = (m) | HID_KEY_8, ['9'] = (m) | HID_KEY_9
+
+struct layout {
+	const char	*name;
+	const uint8_t	*letters;	/* HID keys for 'a' - 'z' */
+	uint16_t	chars[128];	/* everything else */
+};
+
+static const uint8_t letters_qwerty[26] = {
+	HID_KEY_A, HID_KEY_B, HID_KEY_C, HID_KEY_D, HID_KEY_E, HID_KEY_F,
+	HID_KEY_G, HID_KEY_H, HID_KEY_I, HID_KEY_J, HID_KEY_K, HID_KEY_L,
+	HID_KEY_M, HID_KEY_N, HID_KEY_O, HID_KEY_P, HID_KEY_Q, HID_KEY_R,
+	HID_KEY_S, HID_KEY_T, HID_KEY_U, HID_KEY_V, HID_KEY_W, HID_KEY_X,
+	HID_KEY_Y, HID_KEY_Z,
+};
+
+static const uint8_t letters_qwertz[26] = {
+	HID_KEY_A, HID_KEY_B, HID_KEY_C, HID_KEY_D, HID_KEY_E, HID_KEY_F,
+	HID_KEY_G, HID_KEY_H, HID_KEY_I, HID_KEY_J, HID_KEY_K, HID_KEY_L,
+	HID_KEY_M, HID_KEY_N, HID_KEY_O, HID_KEY_P, HID_KEY_Q, HID_KEY_R,
+	HID_KEY_S, HID_KEY_T, HID_KEY_U, HID_KEY_V, HID_KEY_W, HID_KEY_X,
+	HID_KEY_Z, HID_KEY_Y,
+};
+
+static const uint8_t letters_azerty[26] = {
+	HID_KEY_Q, HID_KEY_B, HID_KEY_C, HID_KEY_D, HID_KEY_E, HID_KEY_F,
+	HID_KEY_G, HID_KEY_H, HID_KEY_I, HID_KEY_J, HID_KEY_K, HID_KEY_L,
+	HID_KEY_SEMICOLON, HID_KEY_N, HID_KEY_O, HID_KEY_P, HID_KEY_A,
+	HID_KEY_R, HID_KEY_S, HID_KEY_T, HID_KEY_U, HID_KEY_V, HID_KEY_Z,
+	HID_KEY_X, HID_KEY_Y, HID_KEY_W,
+};
+
+static const struct layout layouts[LAYOUT_COUNT] = {
+[LAYOUT_US] = {
+	.name = "US",
+	.letters = letters_qwerty,
+	.chars = {
+	[' ']	=	HID_KEY_SPACE,
+	['!']	=	M_SHIFT | HID_KEY_1,
+	['"']	=	M_SHIFT | HID_KEY_APOSTROPHE,
+	['#']	=	M_SHIFT | HID_KEY_3,
+	['$']	=	M_SHIFT | HID_KEY_4,
+	['%']	=	M_SHIFT | HID_KEY_5,
+	['&']	=	M_SHIFT | HID_KEY_7,
+	['\'']	=	HID_KEY_APOSTROPHE,
+	['(']	=	M_SHIFT | HID_KEY_9,
+	[')']	=	M_SHIFT | HID_KEY_0,
+	['*']	=	M_SHIFT | HID_KEY_8,
+	['+']	=	M_SHIFT | HID_KEY_EQUAL,
+	[',']	=	HID_KEY_COMMA,
+	['-']	=	HID_KEY_MINUS,
+	['.']	=	HID_KEY_PERIOD,
+	['/']	=	HID_KEY_SLASH,
+	DIGITS(0),
+	[':']	=	M_SHIFT | HID_KEY_SEMICOLON,
+	[';']	=	HID_KEY_SEMICOLON,
+	['<']	=	M_SHIFT | HID_KEY_COMMA,
+	['=']	=	HID_KEY_EQUAL,
+	['>']	=	M_SHIFT | HID_KEY_PERIOD,
+	['?']	=	M_SHIFT | HID_KEY_SLASH,
+	['@']	=	M_SHIFT | HID_KEY_2,
+	['[']	=	HID_KEY_BRACKET_LEFT,
+	['\\']	=	HID_KEY_BACKSLASH,
+	[']']	=	HID_KEY_BRACKET_RIGHT,
+	['^']	=	M_SHIFT | HID_KEY_6,
+	['_']	=	M_SHIFT | HID_KEY_MINUS,
+	['`']	=	HID_KEY_GRAVE,
+	['{']	=	M_SHIFT | HID_KEY_BRACKET_LEFT,
+	['|']	=	M_SHIFT | HID_KEY_BACKSLASH,
+	['}']	=	M_SHIFT | HID_KEY_BRACKET_RIGHT,
+	['~']	=	M_SHIFT | HID_KEY_GRAVE,
+	},
+},
+[LAYOUT_UK] = {
+	.name = "UK",
+	.letters = letters_qwerty,
+	.chars = {
+	[' ']	=	HID_KEY_SPACE,
+	['!']	=	M_SHIFT | HID_KEY_1,
+	['"']	=	M_SHIFT | HID_KEY_2,
+	['#']	=	HID_KEY_EUROPE_1,
+	['$']	=	M_SHIFT | HID_KEY_4,
+	['%']	=	M_SHIFT | HID_KEY_5,
+	['&']	=	M_SHIFT | HID_KEY_7,
+	['\'']	=	HID_KEY_APOSTROPHE,
+	['(']	=	M_SHIFT | HID_KEY_9,
+	[')']	=	M_SHIFT | HID_KEY_0,
+	['*']	=	M_SHIFT | HID_KEY_8,
+	['+']	=	M_SHIFT | HID_KEY_EQUAL,
+	[',']	=	HID_KEY_COMMA,
+	['-']	=	HID_KEY_MINUS,
+	['.']	=	HID_KEY_PERIOD,
+	['/']	=	HID_KEY_SLASH,
+	DIGITS(0),
+	[':']	=	M_SHIFT | HID_KEY_SEMICOLON,
+	[';']	=	HID_KEY_SEMICOLON,
+	['<']	=	M_SHIFT | HID_KEY_COMMA,
+	['=']	=	HID_KEY_EQUAL,
+	['>']	=	M_SHIFT | HID_KEY_PERIOD,
+	['?']	=	M_SHIFT | HID_KEY_SLASH,
+	['@']	=	M_SHIFT | HID_KEY_APOSTROPHE,
+	['[']	=	HID_KEY_BRACKET_LEFT,
+	['\\']	=	HID_KEY_EUROPE_2,
+	[']']	=	HID_KEY_BRACKET_RIGHT,
+	['^']	=	M_SHIFT | HID_KEY_6,
+	['_']	=	M_SHIFT | HID_KEY_MINUS,
+	['`']	=	HID_KEY_GRAVE,
+	['{']	=	M_SHIFT | HID_KEY_BRACKET_LEFT,
+	['|']	=	M_SHIFT | HID_KEY_EUROPE_2,
+	['}']	=	M_SHIFT | HID_KEY_BRACKET_RIGHT,
+	['~']	=	M_SHIFT | HID_KEY_EUROPE_1,
+	},
+},
+[LAYOUT_DE] = {
+	.name = "DE",
+	.letters = letters_qwertz,
+	.chars = {
+	[' ']	=	HID_KEY_SPACE,
+	['!']	=	M_SHIFT | HID_KEY_1,
+	['"']	=	M_SHIFT | HID_KEY_2,
+	['#']	=	HID_KEY_EUROPE_1,
+	['$']	=	M_SHIFT | HID_KEY_4,
+	['%']	=	M_SHIFT | HID_KEY_5,
+	['&']	=	M_SHIFT | HID_KEY_6,
+	['\'']	=	M_SHIFT | HID_KEY_EUROPE_1,
+	['(']	=	M_SHIFT | HID_KEY_8,
+	[')']	=	M_SHIFT | HID_KEY_9,
+	['*']	=	M_SHIFT | HID_KEY_BRACKET_RIGHT,
+	['+']	=	HID_KEY_BRACKET_RIGHT,
+	[',']	=	HID_KEY_COMMA,
+	['-']	=	HID_KEY_SLASH,
+	['.']	=	HID_KEY_PERIOD,
+	['/']	=	M_SHIFT | HID_KEY_7,
+	DIGITS(0),
+	[':']	=	M_SHIFT | HID_KEY_PERIOD,
+	[';']	=	M_SHIFT | HID_KEY_COMMA,
+	['<']	=	HID_KEY_EUROPE_2,
+	['=']	=	M_SHIFT | HID_KEY_0,
+	['>']	=	M_SHIFT | HID_KEY_EUROPE_2,
+	['?']	=	M_SHIFT | HID_KEY_MINUS,
+	['@']	=	M_ALTGR | HID_KEY_Q,
+	['[']	=	M_ALTGR | HID_KEY_8,
+	['\\']	=	M_ALTGR | HID_KEY_MINUS,
+	[']']	=	M_ALTGR | HID_KEY_9,
+	['^']	=	L_DEAD | HID_KEY_GRAVE,
+	['_']	=	M_SHIFT | HID_KEY_SLASH,
+	['`']	=	L_DEAD | M_SHIFT | HID_KEY_EQUAL,
+	['{']	=	M_ALTGR | HID_KEY_7,
+	['|']	=	M_ALTGR | HID_KEY_EUROPE_2,
+	['}']	=	M_ALTGR | HID_KEY_0,
+	['~']	=	M_ALTGR | HID_KEY_BRACKET_RIGHT,
+	},
+},
+[LAYOUT_FR] = {
+	.name = "FR",
+	.letters = letters_azerty,
+	.chars = {
+	[' ']	=	HID_KEY_SPACE,
+	['!']	=	HID_KEY_SLASH,
+	['"']	=	HID_KEY_3,
+	['#']	=	M_ALTGR | HID_KEY_3,
+	['$']	=	HID_KEY_BRACKET_RIGHT,
+	['%']	=	M_SHIFT | HID_KEY_APOSTROPHE,
+	['&']	=	HID_KEY_1,
+	['\'']	=	HID_KEY_4,
+	['(']	=	HID_KEY_5,
+	[')']	=	HID_KEY_MINUS,
+	['*']	=	HID_KEY_EUROPE_1,
+	['+']	=	M_SHIFT | HID_KEY_EQUAL,
+	[',']	=	HID_KEY_M,
+	['-']	=	HID_KEY_6,
+	['.']	=	M_SHIFT | HID_KEY_COMMA,
+	['/']	=	M_SHIFT | HID_KEY_PERIOD,
+	DIGITS(M_SHIFT),
+	[':']	=	HID_KEY_PERIOD,
+	[';']	=	HID_KEY_COMMA,
+	['<']	=	HID_KEY_EUROPE_2,
+	['=']	=	HID_KEY_EQUAL,
+	['>']	=	M_SHIFT | HID_KEY_EUROPE_2,
+	['?']	=	M_SHIFT | HID_KEY_M,
+	['@']	=	M_ALTGR | HID_KEY_0,
+	['[']	=	M_ALTGR | HID_KEY_5,
+	['\\']	=	M_ALTGR | HID_KEY_8,
+	[']']	=	M_ALTGR | HID_KEY_MINUS,
+	['^']	=	M_ALTGR | HID_KEY_9,
+	['_']	=	HID_KEY_8,
+	['`']	=	L_DEAD | M_ALTGR | HID_KEY_7,
+	['{']	=	M_ALTGR | HID_KEY_4,
+	['|']	=	M_ALTGR | HID_KEY_6,
+	['}']	=	M_ALTGR | HID_KEY_EQUAL,
+	['~']	=	L_DEAD | M_ALTGR | HID_KEY_2,
+	},
+},
+[LAYOUT_JP] = {
+	.name = "JP",
+	.letters = letters_qwerty,
+	.chars = {
+	[' ']	=	HID_KEY_SPACE,
+	['!']	=	M_SHIFT | HID_KEY_1,
+	['"']	=	M_SHIFT | HID_KEY_2,
+	['#']	=	M_SHIFT | HID_KEY_3,
+	['$']	=	M_SHIFT | HID_KEY_4,
+	['%']	=	M_SHIFT | HID_KEY_5,
+	['&']	=	M_SHIFT | HID_KEY_6,
+	['\'']	=	M_SHIFT | HID_KEY_7,
+	['(']	=	M_SHIFT | HID_KEY_8,
+	[')']	=	M_SHIFT | HID_KEY_9,
+	['*']	=	M_SHIFT | HID_KEY_APOSTROPHE,
+	['+']	=	M_SHIFT | HID_KEY_SEMICOLON,
+	[',']	=	HID_KEY_COMMA,
+	['-']	=	HID_KEY_MINUS,
+	['.']	=	HID_KEY_PERIOD,
+	['/']	=	HID_KEY_SLASH,
+	DIGITS(0),
+	[':']	=	HID_KEY_APOSTROPHE,
+	[';']	=	HID_KEY_SEMICOLON,
+	['<']	=	M_SHIFT | HID_KEY_COMMA,
+	['=']	=	M_SHIFT | HID_KEY_MINUS,
+	['>']	=	M_SHIFT | HID_KEY_PERIOD,
+	['?']	=	M_SHIFT | HID_KEY_SLASH,
+	['@']	=	HID_KEY_BRACKET_LEFT,
+	['[']	=	HID_KEY_BRACKET_RIGHT,
+	['\\']	=	HID_KEY_KANJI3,		/* Yen key */
+	[']']	=	HID_KEY_EUROPE_1,
+	['^']	=	HID_KEY_EQUAL,
+	['_']	=	M_SHIFT | HID_KEY_KANJI1,	/* Ro key */
+	['`']	=	M_SHIFT | HID_KEY_BRACKET_LEFT,
+	['{']	=	M_SHIFT | HID_KEY_BRACKET_RIGHT,
+	['|']	=	M_SHIFT | HID_KEY_KANJI3,
+	['}']	=	M_SHIFT | HID_KEY_EUROPE_1,
+	['~']	=	M_SHIFT | HID_KEY_EQUAL,
+	},
+},
+};
+
+#ifndef KEYMAP_LAYERS
+#define	KEYMAP_LAYERS		1
+#endif
+
+#if KEYMAP_LAYERS
+/*
+ * The SYM layer gives us the keys the NABU keyboard doesn't have.
+ * These are the same on every host layout.
+ */
+static const uint16_t keymap_sym_layer[256] = {
+['1']		=	HID_KEY_F1,
+['2']		=	HID_KEY_F2,
+['3']		=	HID_KEY_F3,
+['4']		=	HID_KEY_F4,
+['5']		=	HID_KEY_F5,
+['6']		=	HID_KEY_F6,
+['7']		=	HID_KEY_F7,
+['8']		=	HID_KEY_F8,
+['9']		=	HID_KEY_F9,
+['0']		=	HID_KEY_F10,
+['-']		=	HID_KEY_F11,
+['=']		=	HID_KEY_F12,
+
+[0xe0]		=	M_DOWN | HID_KEY_END,		/* Right */
+[0xe1]		=	M_DOWN | HID_KEY_HOME,		/* Left */
+[0xe9]		=	M_DOWN | HID_KEY_PRINT_SCREEN,	/* PAUSE */
+[0xf0]		=	M_UP | HID_KEY_END,		/* Right */
+[0xf1]		=	M_UP | HID_KEY_HOME,		/* Left */
+[0xf9]		=	M_UP | HID_KEY_PRINT_SCREEN,	/* PAUSE */
+};
+#endif /* KEYMAP_LAYERS */
+
+const char *
+keymap_layout_name(unsigned int layout)
+{
+	if (layout < LAYOUT_COUNT) {
+		return layouts[layout].name;
+	}
+	return layout == LAYOUT_CUSTOM ? "custom" : "unknown";
+}
+
+/* The order in which modifiers are pressed. */
+static const uint16_t keymap_modorder[] = {
+	M_CTRL, M_SHIFT, M_ALT, M_META, M_ALTGR,
+};
+#define	KEYMAP_NMODS	(sizeof(keymap_modorder) / sizeof(keymap_modorder[0]))
+
+static int
+keymap_nmods(uint16_t ent)
+{
+	int i, n = 0;
+
+	for (i = 0; i < KEYMAP_NMODS; i++) {
+		if (ent & keymap_modorder[i]) {
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+ * Append the codes that press the modifiers in ent one at a time.
+ */
+static int
+keymap_press(struct codeseq *seq, int i, uint16_t ent)
+{
+	uint16_t mods = 0;
+	int m;
+
+	for (m = 0; m < KEYMAP_NMODS; m++) {
+		if (ent & keymap_modorder[m]) {
+			mods |= keymap_modorder[m];
+			seq->codes[i++] = mods;
+		}
+	}
+	return i;
+}
+
+/*
+ * Append the codes that let go of the key, and then the modifiers
+ * one at a time.  The final "none" is left to the caller.
+ */
+static int
+keymap_release(struct codeseq *seq, int i, uint16_t ent)
+{
+	uint16_t mods = M_MODS(ent);
+	int m;
+
+	if (mods != 0) {
+		seq->codes[i++] = mods;
+	}
+	for (m = KEYMAP_NMODS - 1; m >= 0; m--) {
+		if (mods & keymap_modorder[m]) {
+			mods &= ~keymap_modorder[m];
+			if (mods != 0) {
+				seq->codes[i++] = mods;
+			}
+		}
+	}
+	return i;
+}
+
+/*
+ * Expand a keymap entry into the sequence of codes to send to the host.
+ * Returns the layer the entry actually came from.
+ */
+unsigned int
+keymap_expand(const struct keymap *km, unsigned int layer, uint8_t c,
+    struct codeseq *seq)
+{
+	uint16_t ent;
+	int i;
+
+	if (layer >= KEYMAP_NLAYERS || km->map[layer][c] == 0) {
+		layer = 0;
+	}
+	ent = km->map[layer][c];
+
+	if (M_EXCEPTION_P(ent)) {
+		*seq = km->exceptions[M_HIDKEY(ent)];
+		return layer;
+	}
+
+	memset(seq, 0, sizeof(*seq));
+
+	/* UP/DOWN keys don't use a sequence. */
+	if (ent & (M_DOWN | M_UP)) {
+		seq->codes[0] = ent;
+		return layer;
+	}
+
+	i = keymap_press(seq, 0, ent);
+	seq->codes[i++] = ent;
+	if ((ent & M_ENDSEQ) == 0) {
+		keymap_release(seq, i, ent);
+	}
+	return layer;
+}
+
+/*
+ * Is the code assigned in any layer?
+ */
+bool
+keymap_assigned_p(const struct keymap *km, uint8_t c)
+{
+	unsigned int layer;
+
+	for (layer = 0; layer < KEYMAP_NLAYERS; layer++) {
+		if (km->map[layer][c] != 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Returns the KEYMAP_LAYER_* bits for the layer keys that actually
+ * select something in this keymap.
+ */
+unsigned int
+keymap_layer_keys(const struct keymap *km)
+{
+	unsigned int layer, keys = 0;
+	int c;
+
+	for (layer = 1; layer < KEYMAP_NLAYERS; layer++) {
+		for (c = 0; c < 256; c++) {
+			if (km->map[layer][c] != 0) {
+				keys |= layer;
+				break;
+			}
+		}
+	}
+	return keys;
+}
+
+static bool
+keymap_validate_exception(const struct codeseq *seq)
+{
+	int i;
+
+	for (i = 0; i < 6; i++) {
+		if (seq->codes[i] & (M_DOWN | M_UP)) {
+			return false;
+		}
+		if (seq->codes[i] == 0 || (seq->codes[i] & M_ENDSEQ) != 0) {
+			return i != 0;
+		}
+	}
+	return false;
+}
+
+/*
+ * Make sure that a keymap won't send the sequencer off into the weeds:
+ * every sequence must fit in a struct codeseq and terminate, and the
+ * codes that the reader thread never passes along as keystrokes must
+ * be unassigned.
+ */
+static bool
+keymap_validate_layer(const struct keymap *km, unsigned int layer)
+{
+	uint16_t ent;
+	int c;
+
+	for (c = 0; c < 256; c++) {
+		ent = km->map[layer][c];
+
+		if (c == NABU_CODE_JOY0 || c == NABU_CODE_JOY1 ||
+		    NABU_CODE_ERR_P(c) || NABU_CODE_JOYDAT_P(c)) {
+			if (ent != 0) {
+				goto bad;
+			}
+			continue;
+		}
+
+		if (M_EXCEPTION_P(ent)) {
+			if (M_HIDKEY(ent) >= KEYMAP_NEXCEPTIONS ||
+			    (ent & ~(M_EXCEPTION | 0x00ff)) != 0 ||
+			    ! keymap_validate_exception(
+					&km->exceptions[M_HIDKEY(ent)])) {
+				goto bad;
+			}
+			continue;
+		}
+
+		if (ent & (M_DOWN | M_UP)) {
+			if (ent & M_ENDSEQ) {
+				goto bad;
+			}
+			continue;
+		}
+
+		/* Press, key, and release have to fit in 6 codes. */
+		if ((ent & M_ENDSEQ) == 0 && keymap_nmods(ent) > 2) {
+			goto bad;
+		}
+	}
+	return true;
+
+ bad:
+	printf("[%10u] WARNING: invalid keymap entry for code 0x%02x "
+	    "(layer %u).\n", board_millis(), c, layer);
+	return false;
+}
+
+bool
+keymap_validate(const struct keymap *km)
+{
+	unsigned int layer;
+
+	for (layer = 0; layer < KEYMAP_NLAYERS; layer++) {
+		if (! keymap_validate_layer(km, layer)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Add a literal sequence to the keymap's exception list, returning
+ * the keymap entry that refers to it, or 0 if the list is full.
+ */
+static uint16_t
+keymap_add_exception(struct keymap *km, unsigned int *nexcp,
+    const struct codeseq *seq)
+{
+	unsigned int i;
+
+	for (i = 0; i < *nexcp; i++) {
+		if (memcmp(&km->exceptions[i], seq, sizeof(*seq)) == 0) {
+			return M_EXCEPTION | i;
+		}
+	}
+	if (i == KEYMAP_NEXCEPTIONS) {
+		return 0;
+	}
+	km->exceptions[i] = *seq;
+	(*nexcp)++;
+	return M_EXCEPTION | i;
+}
+
+static uint16_t
+layout_lookup(const struct layout *lo, uint8_t ch)
+{
+	if (ch >= 'a' && ch <= 'z') {
+		return lo->letters[ch - 'a'];
+	}
+	if (ch >= 'A' && ch <= 'Z') {
+		return M_SHIFT | lo->letters[ch - 'A'];
+	}
+	return ch < 128 ? lo->chars[ch] : 0;
+}
+
+/*
+ * Build the keymap for the specified host layout.
+ */
+bool
+keymap_build(struct keymap *km, unsigned int layout)
+{
+	const struct layout *lo;
+	const struct nabu_desc *d;
+	struct codeseq seq;
+	unsigned int nexc = 0;
+	uint16_t ent;
+	int c, i;
+
+	if (layout >= LAYOUT_COUNT) {
+		return false;
+	}
+	lo = &layouts[layout];
+
+	memset(km, 0, sizeof(*km));
+	km->layout = layout;
+
+	for (c = 0; c < 256; c++) {
+		d = &nabu_desc[c];
+		if (d->ch == 0) {
+			km->map[0][c] = d->code;
+			continue;
+		}
+
+		if ((ent = layout_lookup(lo, d->ch)) == 0) {
+			/* Can't type it on this layout. */
+			continue;
+		}
+
+		switch (d->flags) {
+		case NC_CTRL:
+			ent = (ent & ~L_DEAD) | M_CTRL;
+			if (keymap_nmods(ent) > 2) {
+				ent = 0;
+			}
+			break;
+
+		case NC_HOLD:
+			ent = (ent & ~L_DEAD) | M_ENDSEQ;
+			break;
+
+		case NC_RELEASE:
+			if (M_MODS(ent) == 0) {
+				ent = M_ENDSEQ;
+				break;
+			}
+			memset(&seq, 0, sizeof(seq));
+			keymap_release(&seq, 0, ent);
+			ent = keymap_add_exception(km, &nexc, &seq);
+			break;
+
+		default:
+			if (ent & L_DEAD) {
+				/* Dead key, then space. */
+				ent &= ~L_DEAD;
+				if (keymap_nmods(ent) > 1) {
+					ent = 0;
+					break;
+				}
+				memset(&seq, 0, sizeof(seq));
+				i = keymap_press(&seq, 0, ent);
+				seq.codes[i++] = ent;
+				i = keymap_release(&seq, i, ent);
+				seq.codes[i] = HID_KEY_SPACE;
+				ent = keymap_add_exception(km, &nexc, &seq);
+			} else if (keymap_nmods(ent) > 2) {
+				ent = 0;
+			}
+			break;
+		}
+		km->map[0][c] = ent;
+	}
+
+#if KEYMAP_LAYERS
+	memcpy(km->map[KEYMAP_LAYER_SYM], keymap_sym_layer,
+	    sizeof(keymap_sym_layer));
+#endif
+
+	return true;
+}
@@ -0,0 +1,162 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KEYMAP_H_
+#define	_KEYMAP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Codes sent by the NABU keyboard that aren't keystrokes.
+ */
+#define	NABU_CODE_JOY0		0x80
+#define	NABU_CODE_JOY1		0x81
+#define	NABU_CODE_ERR_FIRST	0x90
+#define	NABU_CODE_ERR_LAST	0x95
+#define	NABU_CODE_JOYDAT_FIRST	0xa0
+#define	NABU_CODE_JOYDAT_LAST	0xbf
+
+#define	NABU_CODE_JOYDAT_P(c)	((c) >= NABU_CODE_JOYDAT_FIRST &&	\
+				 (c) <= NABU_CODE_JOYDAT_LAST)
+
+#define	NABU_CODE_ERR_P(c)	((c) >= NABU_CODE_ERR_FIRST &&		\
+				 (c) <= NABU_CODE_ERR_LAST)
+
+#define	NABU_CODE_ERR_MKEY	0x90	/* multiple keys pressed */
+#define	NABU_CODE_ERR_RAM	0x91	/* faulty keyboard RAM */
+#define	NABU_CODE_ERR_ROM	0x92	/* faulty keyboard ROM */
+#define	NABU_CODE_ERR_ISR	0x93	/* illegal ISR (?) */
+#define	NABU_CODE_ERR_PING	0x94	/* periodic no-load ping */
+#define	NABU_CODE_ERR_RESET	0x95	/* keyboard power-up/reset */
+
+/*
+ * Special keys send a key-down code when pressed and the matching
+ * key-up code (0x10 higher) when released.
+ */
+#define	NABU_CODE_DOWN_FIRST	0xe0
+#define	NABU_CODE_DOWN_LAST	0xef
+#define	NABU_CODE_UP_FIRST	0xf0
+#define	NABU_CODE_UP_LAST	0xff
+
+#define	NABU_CODE_DOWN_P(c)	((c) >= NABU_CODE_DOWN_FIRST &&		\
+				 (c) <= NABU_CODE_DOWN_LAST)
+
+#define	NABU_CODE_UP_P(c)	((c) >= NABU_CODE_UP_FIRST &&		\
+				 (c) <= NABU_CODE_UP_LAST)
+
+#define	NABU_CODE_KEY_UP(c)	((c) + (NABU_CODE_UP_FIRST -		\
+					NABU_CODE_DOWN_FIRST))
+
+/*
+ * Of those, only the arrow and page keys auto-repeat, by sending their
+ * key-down code again.  NO, YES, SYM, PAUSE and TV/NABU don't.
+ */
+#define	NABU_CODE_REPEAT_FIRST	0xe0
+#define	NABU_CODE_REPEAT_LAST	0xe5
+
+#define	NABU_CODE_REPEAT_P(c)	((c) >= NABU_CODE_REPEAT_FIRST &&	\
+				 (c) <= NABU_CODE_REPEAT_LAST)
+
+#define	NABU_CODE_SYM_DOWN	0xe8
+#define	NABU_CODE_TV_DOWN	0xea
+#define	NABU_CODE_SYM_UP	0xf8
+#define	NABU_CODE_TV_UP		0xfa
+
+/*
+ * A code sent to the host is a HID key code in the low byte, plus
+ * the modifiers to report along with it and some flags that tell
+ * the sequencer what to do with it.
+ */
+#define	M_CTRL		0x0100		/* KEYBOARD_MODIFIER_LEFTCTRL << 8 */
+#define	M_SHIFT		0x0200		/* KEYBOARD_MODIFIER_LEFTSHIFT << 8 */
+#define	M_ALT		0x0400		/* KEYBOARD_MODIFIER_LEFTALT << 8 */
+#define	M_META		0x0800		/* KEYBOARD_MODIFIER_LEFTGUI << 8 */
+#define	M_DOWN		0x1000
+#define	M_UP		0x2000
+#define	M_ENDSEQ	0x4000
+#define	M_ALTGR		0x8000		/* KEYBOARD_MODIFIER_RIGHTALT */
+
+#define	M_EXCEPTION	(M_DOWN | M_UP)	/* low byte is exception index */
+
+#define	M_HIDKEY(m)	((m) & 0x00ff)
+#define	M_MODS(m)	((m) & (0x0f00 | M_ALTGR))
+#define	M_EXCEPTION_P(m) (((m) & M_EXCEPTION) == M_EXCEPTION)
+
+struct codeseq {
+	uint16_t codes[6];	/* 0-terminated */
+};
+
+#define	KEYMAP_NEXCEPTIONS	8
+
+/*
+ * Holding SYM and/or TV/NABU selects an alternate layer of the keymap.
+ * A 0 entry in a layer falls through to the base layer.
+ */
+#define	KEYMAP_LAYER_SYM	0x01
+#define	KEYMAP_LAYER_TV		0x02
+#define	KEYMAP_NLAYERS		4
+
+/*
+ * A keymap, indexed by layer and NABU code.  See keymap.c for the
+ * encoding.
+ */
+struct keymap {
+	uint16_t	map[KEYMAP_NLAYERS][256];
+	struct codeseq	exceptions[KEYMAP_NEXCEPTIONS];
+	uint8_t		layout;		/* LAYOUT_*, or LAYOUT_CUSTOM */
+	uint8_t		reserved;
+};
+
+/*
+ * Host keyboard layouts we know how to generate keymaps for.
+ */
+enum {
+	LAYOUT_US	= 0,
+	LAYOUT_UK	= 1,
+	LAYOUT_DE	= 2,
+	LAYOUT_FR	= 3,
+	LAYOUT_JP	= 4,
+	LAYOUT_COUNT,
+
+	LAYOUT_CUSTOM	= 0xff		/* uploaded by the host */
+};
+
+/*
+ * Built-in keymap compiled from a keymap source by tools/keymapc.py,
+ * if the firmware was configured with one (KEYMAP_BUILTIN).
+ */
+extern const struct keymap keymap_builtin;
+
+const char *	keymap_layout_name(unsigned int);
+bool		keymap_build(struct keymap *, unsigned int);
+unsigned int	keymap_expand(const struct keymap *, unsigned int, uint8_t,
+		    struct codeseq *);
+bool		keymap_assigned_p(const struct keymap *, uint8_t);
+unsigned int	keymap_layer_keys(const struct keymap *);
+bool		keymap_validate(const struct keymap *);
+
+#endif /* _KEYMAP_H_ */
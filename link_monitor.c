@@ -0,0 +1,198 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Keyboard link-quality monitor and deadcheck thresholds.  This is pure
+ * bookkeeping; the caller supplies the PING timestamps and UART error
+ * count, and acts on the verdicts.
+ */
+
+/* Pico SDK headers */
+#include "pico/stdlib.h"
+
+/* Standard headers */
+#include <string.h>
+
+/* Local headers */
+#include "link_monitor.h"
+
+/*
+ * Start from scratch.
+ */
+void
+link_init(struct link_monitor *lm)
+{
+	memset(lm, 0, sizeof(*lm));
+	lm->stats.version = LINK_VERSION;
+	lm->stats.score = 100;
+}
+
+/*
+ * The keyboard was powered off or reset; the next PING starts over,
+ * but we keep what we've learned about the period.
+ */
+void
+link_restart(struct link_monitor *lm)
+{
+	lm->have_last = false;
+}
+
+static void
+link_score(struct link_monitor *lm)
+{
+	uint32_t penalty;
+
+	penalty = MIN(60, lm->recent_missed * 20 / 16);
+	penalty += MIN(30, lm->recent_errors * 10 / 16);
+	penalty += MIN(40, lm->stats.jitter_us / 1000);
+	lm->stats.score = penalty >= 100 ? 0 : 100 - penalty;
+}
+
+/*
+ * Account for a PING that arrived at now (in microseconds), with the
+ * UART error count at the time.
+ */
+void
+link_ping(struct link_monitor *lm, uint32_t now, uint32_t uart_errors)
+{
+	struct link_stats *ls = &lm->stats;
+	uint32_t interval, period, dev, b, n;
+
+	lm->recent_missed -= lm->recent_missed / 16;
+	lm->recent_errors -= lm->recent_errors / 16;
+	n = uart_errors - lm->uart_errors;
+	lm->uart_errors = uart_errors;
+	lm->recent_errors += MIN(n, 16) * 16;
+
+	if (! lm->have_last) {
+		lm->have_last = true;
+		lm->last_us = now;
+		link_score(lm);
+		return;
+	}
+	interval = now - lm->last_us;
+	lm->last_us = now;
+	period = ls->period_us;
+
+	if (period == 0) {
+		/* First interval; assume it's a good one. */
+		ls->period_us = ls->min_us = ls->max_us = interval;
+		ls->intervals = 1;
+		link_score(lm);
+		return;
+	}
+
+	if (interval > period + period / 2) {
+		/* One or more went missing. */
+		n = (interval + period / 2) / period - 1;
+		ls->missed += n;
+		lm->recent_missed += n * 16;
+		link_score(lm);
+		return;
+	}
+	if (interval < period / 2) {
+		/* Not a periodic PING (e.g. right after a RESET). */
+		return;
+	}
+
+	dev = interval > period ? interval - period : period - interval;
+	for (b = 0; b < LINK_NBUCKETS - 1 &&
+		    dev >= (LINK_BUCKET0_US << b); b++) {
+		/* nothing */
+	}
+	ls->hist[b]++;
+	ls->intervals++;
+	ls->min_us = MIN(ls->min_us, interval);
+	ls->max_us = MAX(ls->max_us, interval);
+
+	/* Exponentially-weighted averages, 1/8 new. */
+	ls->period_us = (int32_t)period + ((int32_t)(interval - period) / 8);
+	ls->jitter_us += ((int32_t)dev - (int32_t)ls->jitter_us) / 8;
+
+	if (ls->baseline_us == 0 && ls->intervals >= LINK_LEARN_PINGS) {
+		ls->baseline_us = ls->period_us;
+	}
+	if (ls->baseline_us != 0) {
+		int64_t diff = (int64_t)ls->period_us - ls->baseline_us;
+
+		ls->drift_ppm = (int32_t)(diff * 1000000 / ls->baseline_us);
+	}
+
+	link_score(lm);
+}
+
+/*
+ * The deadcheck thresholds, in milliseconds since the last message
+ * from the keyboard.  Declaring at two periods plus slack, rather than
+ * a flat 2.5 periods, is sooner for a typical 3.7s PING (about 7.9s vs.
+ * 9.25s) and still allows for the jitter this keyboard has shown.
+ */
+void
+link_thresholds(const struct link_monitor *lm, uint32_t *warnp,
+    uint32_t *declarep)
+{
+	uint32_t period = lm->stats.period_us / 1000;
+	uint32_t slack = period / 8 + 4 * lm->stats.jitter_us / 1000;
+
+	if (lm->stats.baseline_us == 0) {
+		*warnp = DEADCHECK_WARN_MS;
+		*declarep = DEADCHECK_DECLARE_MS;
+		return;
+	}
+	*warnp = MAX(DEADCHECK_MIN_MS,
+	    MIN(DEADCHECK_WARN_MS, period + slack));
+	*declarep = MAX(*warnp + DEADCHECK_MIN_MS,
+	    MIN(DEADCHECK_DECLARE_MS, 2 * period + slack));
+}
+
+/*
+ * Judge the keyboard, given how long it's been since we last heard from
+ * it and whether the line has been held in break.  *nextp is set to how
+ * long until the verdict could next change.
+ */
+int
+link_deadcheck(const struct link_monitor *lm, uint32_t since, bool brk,
+    uint32_t *nextp)
+{
+	uint32_t warn, declare;
+
+	link_thresholds(lm, &warn, &declare);
+
+	if (brk) {
+		*nextp = warn;
+		return LINK_DEAD;
+	}
+	if (since < warn) {
+		*nextp = warn - since;
+		return LINK_ALIVE;
+	}
+	if (since < declare) {
+		*nextp = declare - since;
+		return LINK_LATE;
+	}
+	*nextp = warn;
+	return LINK_DEAD;
+}
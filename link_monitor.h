@@ -0,0 +1,101 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _LINK_MONITOR_H_
+#define	_LINK_MONITOR_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Link-quality monitor.  The keyboard sends a PING every ~3.7s, timed
+ * off its own crystal, so the PINGs tell us a lot about the health of
+ * the link: how regular they are (jitter), whether any went missing,
+ * and how far the keyboard's clock has drifted from where it was when
+ * we first learned the period.  These, along with recent UART errors,
+ * are folded into a 0-100 health score, so a flaky keyboard or cable
+ * can be spotted (and swapped) before it actually drops keys or the
+ * deadcheck fires.
+ *
+ * Once the period is known, it also sets the deadcheck thresholds.
+ */
+
+#define	LINK_LEARN_PINGS	16	/* intervals before baseline is set */
+#define	LINK_NBUCKETS		8	/* |interval - period|: <250us, ... */
+#define	LINK_BUCKET0_US		250
+#define	LINK_VERSION		1
+
+struct link_stats {
+	uint8_t		version;
+	uint8_t		score;		/* 0 (dead) - 100 (perfect) */
+	uint16_t	reserved;
+	uint32_t	intervals;	/* PING intervals measured */
+	uint32_t	missed;		/* PINGs that never showed up */
+	uint32_t	period_us;	/* smoothed PING period */
+	uint32_t	baseline_us;	/* period once first learned */
+	int32_t		drift_ppm;	/* period vs. baseline */
+	uint32_t	jitter_us;	/* smoothed |interval - period| */
+	uint32_t	min_us;
+	uint32_t	max_us;
+	uint32_t	hist[LINK_NBUCKETS];
+};
+
+struct link_monitor {
+	struct link_stats stats;	/* exported as-is */
+	uint32_t	last_us;	/* previous PING */
+	bool		have_last;
+	uint32_t	recent_missed;	/* x16, decays */
+	uint32_t	recent_errors;	/* x16, decays */
+	uint32_t	uart_errors;	/* UART error count at last PING */
+};
+
+/*
+ * The fixed deadcheck thresholds are used until the PING period has been
+ * learned.  After that, we warn when a PING is overdue and declare the
+ * keyboard dead when two in a row have gone missing, allowing some slack
+ * for that keyboard's jitter.  A line held in break for
+ * DEADCHECK_BREAK_MS is declared dead right away.
+ */
+#define	DEADCHECK_WARN_MS	5000
+#define	DEADCHECK_DECLARE_MS	10000
+#define	DEADCHECK_MIN_MS	1000
+#define	DEADCHECK_BREAK_MS	50	/* line must still be in break */
+
+enum {
+	LINK_ALIVE	= 0,
+	LINK_LATE	= 1,		/* past the warning threshold */
+	LINK_DEAD	= 2,
+};
+
+void		link_init(struct link_monitor *);
+void		link_restart(struct link_monitor *);
+void		link_ping(struct link_monitor *, uint32_t, uint32_t);
+void		link_thresholds(const struct link_monitor *, uint32_t *,
+		    uint32_t *);
+int		link_deadcheck(const struct link_monitor *, uint32_t, bool,
+		    uint32_t *);
+
+#endif /* _LINK_MONITOR_H_ */
@@ -0,0 +1,204 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Keyboard macros.  See macro.h for the format.
+ *
+ * The current macro blob lives in flash, and we only keep a pointer
+ * to it, plus a bitmap of the NABU codes that have macros bound to
+ * them so that the keyboard reader thread can cheaply decide whether
+ * an otherwise-unassigned code is worth enqueueing.
+ */
+
+/* Pico SDK headers */
+#include "pico/stdlib.h"
+
+/* TinyUSB SDK headers */
+#include "bsp/board.h"
+
+/* Standard headers */
+#include <string.h>
+
+/* Local headers */
+#include "flash_store.h"
+#include "keymap.h"
+#include "macro.h"
+
+static const struct macro_hdr *macro_blob;
+static size_t macro_bloblen;
+static uint32_t macro_codes[256 / 32];
+
+static inline const struct macro_def *
+macro_defs(const struct macro_hdr *hdr)
+{
+	return (const struct macro_def *)(hdr + 1);
+}
+
+static inline const uint16_t *
+macro_steps(const struct macro_hdr *hdr)
+{
+	return (const uint16_t *)(macro_defs(hdr) + hdr->nmacros);
+}
+
+static inline size_t
+macro_size(const struct macro_hdr *hdr)
+{
+	return sizeof(*hdr) + (hdr->nmacros * sizeof(struct macro_def)) +
+	    (hdr->nsteps * sizeof(uint16_t));
+}
+
+/*
+ * Make sure a macro blob is self-consistent and only contains steps
+ * we know how to send.
+ */
+bool
+macro_validate(const void *blob, size_t len)
+{
+	const struct macro_hdr *hdr = blob;
+	const struct macro_def *def;
+	const uint16_t *steps;
+	uint8_t c;
+	int i;
+
+	if (len < sizeof(*hdr) || hdr->nmacros > MACRO_MAX ||
+	    macro_size(hdr) != len) {
+		printf("[%10u] WARNING: macro table has bad size.\n",
+		    board_millis());
+		return false;
+	}
+
+	for (i = 0, def = macro_defs(hdr); i < hdr->nmacros; i++, def++) {
+		c = M_HIDKEY(def->trigger);
+		if ((def->trigger & ~(MACRO_TRIGGER_MODS | 0x00ff)) != 0 ||
+		    c == NABU_CODE_JOY0 || c == NABU_CODE_JOY1 ||
+		    NABU_CODE_ERR_P(c) || NABU_CODE_JOYDAT_P(c) ||
+		    def->first > hdr->nsteps ||
+		    def->count > hdr->nsteps - def->first) {
+			printf("[%10u] WARNING: macro %d is invalid.\n",
+			    board_millis(), i);
+			return false;
+		}
+	}
+
+	for (i = 0, steps = macro_steps(hdr); i < hdr->nsteps; i++) {
+		if (! MACRO_DELAY_P(steps[i]) &&
+		    (steps[i] & (M_DOWN | M_UP | M_ENDSEQ)) != 0) {
+			printf("[%10u] WARNING: macro step %d is invalid.\n",
+			    board_millis(), i);
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Start using a (validated) macro blob.  NULL removes all macros.
+ */
+void
+macro_install(const void *blob)
+{
+	const struct macro_hdr *hdr = blob;
+	const struct macro_def *def;
+	uint32_t codes[256 / 32] = { 0 };
+	int i;
+
+	if (hdr != NULL) {
+		for (i = 0, def = macro_defs(hdr); i < hdr->nmacros;
+		     i++, def++) {
+			codes[M_HIDKEY(def->trigger) / 32] |=
+			    1U << (M_HIDKEY(def->trigger) % 32);
+		}
+		macro_bloblen = macro_size(hdr);
+	} else {
+		macro_bloblen = 0;
+	}
+	macro_blob = hdr;
+	memcpy(macro_codes, codes, sizeof(macro_codes));
+}
+
+void
+macro_init(void)
+{
+	const void *blob;
+	size_t len;
+
+	blob = flash_store_load(FLASH_STORE_AREA_MACROS, MACRO_VERSION, &len);
+	if (blob != NULL && macro_validate(blob, len)) {
+		macro_install(blob);
+		printf("Loaded %u macros from flash.\n", macro_blob->nmacros);
+	} else {
+		macro_install(NULL);
+	}
+}
+
+/*
+ * Called from the keyboard reader thread; is there a macro bound
+ * to this code?
+ */
+bool
+macro_bound_p(uint8_t c)
+{
+	return (macro_codes[c / 32] & (1U << (c % 32))) != 0;
+}
+
+/*
+ * Find the macro bound to a code, given the current state of the
+ * sticky modifiers.  Returns a pointer to the first step (in flash)
+ * and the number of steps, or NULL if there isn't one.
+ */
+const uint16_t *
+macro_lookup(uint8_t c, uint16_t mods, uint16_t *countp)
+{
+	const struct macro_hdr *hdr = macro_blob;
+	const struct macro_def *def;
+	uint16_t trigger = c | (mods & MACRO_TRIGGER_MODS);
+	int i;
+
+	if (hdr == NULL || ! macro_bound_p(c)) {
+		return NULL;
+	}
+
+	for (i = 0, def = macro_defs(hdr); i < hdr->nmacros; i++, def++) {
+		if (def->trigger == trigger) {
+			*countp = def->count;
+			return macro_steps(hdr) + def->first;
+		}
+	}
+	return NULL;
+}
+
+size_t
+macro_read(size_t offset, uint8_t *buf, size_t len)
+{
+	if (macro_blob == NULL || offset >= macro_bloblen) {
+		return 0;
+	}
+	if (len > macro_bloblen - offset) {
+		len = macro_bloblen - offset;
+	}
+	memcpy(buf, (const uint8_t *)macro_blob + offset, len);
+	return len;
+}
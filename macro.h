@@ -0,0 +1,83 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MACRO_H_
+#define	_MACRO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Keyboard macros: a NABU key, optionally with SYM and/or TV/NABU held,
+ * can be bound to an arbitrarily long sequence of keyboard reports and
+ * delays.  Macros are uploaded by the host as a single blob using the
+ * config report, and are streamed directly out of flash, one report per
+ * keyboard endpoint slot.
+ *
+ * The blob is laid out as (all fields little-endian uint16_t):
+ *
+ *	struct macro_hdr
+ *	struct macro_def	defs[nmacros]
+ *	uint16_t		steps[nsteps]
+ *
+ * Each step is either a complete keyboard report (HID key code in the
+ * low byte plus M_CTRL / M_SHIFT / M_ALT / M_META / M_ALTGR), or a delay.
+ * Unlike keymap sequences, nothing is implied: the macro has to release
+ * everything it presses.  After the last step, one more report is sent
+ * to re-sync the host with the state of the sticky modifiers.
+ */
+struct macro_hdr {
+	uint16_t	nmacros;
+	uint16_t	nsteps;
+};
+
+struct macro_def {
+	uint16_t	trigger;	/* NABU code | MACRO_SYM / MACRO_TV */
+	uint16_t	first;		/* index of first step */
+	uint16_t	count;		/* number of steps */
+};
+
+#define	MACRO_SYM	0x0800		/* == M_META, the SYM key */
+#define	MACRO_TV	0x0400		/* == M_ALT, the TV/NABU key */
+#define	MACRO_TRIGGER_MODS (MACRO_SYM | MACRO_TV)
+
+#define	MACRO_DELAY	0x3000		/* low 12 bits are milliseconds */
+#define	MACRO_DELAY_P(s) (((s) & 0xf000) == MACRO_DELAY)
+#define	MACRO_DELAY_MS(s) ((s) & 0x0fff)
+
+#define	MACRO_MAX	64
+
+#define	MACRO_VERSION	1	/* bump if the blob format changes */
+
+void		macro_init(void);
+bool		macro_validate(const void *blob, size_t len);
+void		macro_install(const void *blob);
+bool		macro_bound_p(uint8_t c);
+const uint16_t *macro_lookup(uint8_t c, uint16_t mods, uint16_t *countp);
+size_t		macro_read(size_t offset, uint8_t *buf, size_t len);
+
+#endif /* _MACRO_H_ */
@@ -56,16 +56,31 @@
 #include "pico/sync.h"
 #include "pico/time.h"
 #include "pico/multicore.h"
+#include "hardware/clocks.h"
+#include "hardware/irq.h"
+#include "hardware/pll.h"
 #include "hardware/uart.h"
+#include "hardware/structs/scb.h"
+#include "hardware/structs/systick.h"
 
 /* TinyUSB SDK headers */
 #include "bsp/board.h"
 #include "tusb.h"
 
 /* Standard headers */
+#include <stddef.h>
 #include <string.h>
 
 /* Local headers */
+#include "flash_store.h"
+#include "hid_sched.h"
+#include "keymap.h"
+#include "link_monitor.h"
+#include "macro.h"
+#include "stuck_keys.h"
+#include "timer_service.h"
+#include "trace.h"
+#include "unicode.h"
 
 /*
  * GP22 (physical pin 29 on the DIP-40 Pico) is a debug-enable strapping
@@ -111,6 +126,10 @@ struct queue {
 	unsigned int	prod;
 	unsigned int	cons;
 	uint8_t		data[QUEUE_SIZE];
+#if LATENCY_HIST
+	uint32_t	stamp[QUEUE_SIZE];	/* when each byte came in */
+	uint32_t	cons_stamp;		/* ...the last one taken */
+#endif
 };
 
 static void
@@ -128,12 +147,18 @@ queue_add(struct queue *q, uint8_t v)
 	mutex_enter_blocking(&q->mutex);
 	if (! QUEUE_FULL_P(q)) {
 		q->data[q->prod] = v;
+#if LATENCY_HIST
+		q->stamp[q->prod] = time_us_32();
+#endif
 		q->prod = QUEUE_NEXT(q->prod);
 	} else {
 		rv = false;
 	}
 	mutex_exit(&q->mutex);
 
+	/* Ring Core 0's doorbell, in case it's waiting for work. */
+	__sev();
+
 	return rv;
 }
 
@@ -146,6 +171,9 @@ queue_consume(struct queue *q, uint8_t *vp, bool advance)
 	if (! QUEUE_EMPTY_P(q)) {
 		*vp = q->data[q->cons];
 		if (advance) {
+#if LATENCY_HIST
+			q->cons_stamp = q->stamp[q->cons];
+#endif
 			q->cons = QUEUE_NEXT(q->cons);
 		}
 		rv = true;
@@ -175,11 +203,563 @@ queue_drain(struct queue *q)
 	mutex_exit(&q->mutex);
 }
 
+#if HID_COMPOSITE
+/*
+ * With everything on one interface, reports go out in the order the
+ * data arrived from the keyboard (see hid_sched.c).  The reader records
+ * which queue it added each byte to here.  Whatever takes a byte out of
+ * one of those queues removes the oldest entry for that queue, so the
+ * order always matches what's actually queued.
+ */
+static struct queue hid_order;
+static struct hid_sched hid_sched;
+
+#define	hid_order_add(src)	queue_add(&hid_order, (src))
+
+static void
+hid_order_remove(uint8_t src)
+{
+	struct queue *q = &hid_order;
+	unsigned int i, j;
+
+	mutex_enter_blocking(&q->mutex);
+	for (i = q->cons; i != q->prod; i = QUEUE_NEXT(i)) {
+		if (q->data[i] == src) {
+			break;
+		}
+	}
+	if (i != q->prod) {
+		/* Close up the gap; the older entries move up one. */
+		for (j = i; j != q->cons; j = (j - 1) & QUEUE_MASK) {
+			q->data[j] = q->data[(j - 1) & QUEUE_MASK];
+		}
+		q->cons = QUEUE_NEXT(q->cons);
+	}
+	mutex_exit(&q->mutex);
+}
+
+/*
+ * Returns the oldest entry for a joystick, or HID_SRC_NONE.
+ */
+static uint8_t
+hid_order_first_joy(void)
+{
+	struct queue *q = &hid_order;
+	uint8_t src = HID_SRC_NONE;
+	unsigned int i;
+
+	mutex_enter_blocking(&q->mutex);
+	for (i = q->cons; i != q->prod; i = QUEUE_NEXT(i)) {
+		if (q->data[i] != HID_SRC_KBD) {
+			src = q->data[i];
+			break;
+		}
+	}
+	mutex_exit(&q->mutex);
+	return src;
+}
+#else
+#define	hid_order_add(src)	do { } while (/*CONSTCOND*/0)
+#define	hid_order_remove(src)	do { } while (/*CONSTCOND*/0)
+#endif
+
+#if HID_SOF_ALIGN
+/*
+ * The host polls the interrupt endpoint every few frames, at a fixed
+ * point in its frame schedule.  Instead of running the data processing
+ * task on a free-running millisecond tick, we learn the poll period and
+ * phase from the frame numbers at which keyboard reports complete, and
+ * run the task in the frame just before the next poll.  That way the
+ * report is as fresh as possible when the host picks it up.
+ */
+#define	SOF_FRAME_MASK		0x7ff	/* frame numbers are 11 bits */
+#define	SOF_MAX_PERIOD		32	/* longest poll period we track */
+#define	SOF_NWAIT		8
+
+static struct {
+	uint32_t frame;		/* running frame count */
+	uint32_t poll_frame;	/* frame of the last keyboard poll */
+	uint32_t sent_frame;	/* frame the outstanding report was sent */
+	uint16_t last_sof;	/* last frame number from the host */
+	uint8_t period;		/* poll period in frames; 0 = unknown */
+	bool sent;		/* a keyboard report is outstanding */
+	bool due;		/* next frame has a poll in it */
+} sof_context;
+
+/*
+ * Alignment stats, exported using the "sof" config object.  wait[n]
+ * counts reports that were picked up by the host n frames after they
+ * were sent (the last bucket is SOF_NWAIT - 1 or more).  When we're
+ * well-aligned, nearly all of them are in wait[1].
+ */
+struct sof_stats {
+	uint8_t		period;		/* poll period (frames) */
+	uint8_t		phase;		/* poll frame modulo period */
+	uint16_t	reserved;
+	uint32_t	wait[SOF_NWAIT];
+};
+
+static struct sof_stats sof_stats;
+
+static void
+sof_reset(void)
+{
+	sof_context.period = 0;
+	sof_context.sent = false;
+	sof_context.due = false;
+	sof_stats.period = 0;
+	sof_stats.phase = 0;
+}
+
+static void
+sof_report_sent(void)
+{
+	sof_context.sent_frame = sof_context.frame;
+	sof_context.sent = true;
+}
+
+static uint32_t
+sof_gcd(uint32_t a, uint32_t b)
+{
+	while (b != 0) {
+		uint32_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/*
+ * Invoked (from tud_task()) for each start-of-frame.
+ */
+void
+tud_sof_cb(uint32_t frame_count)
+{
+	uint32_t next;
+
+	sof_context.frame +=
+	    (frame_count - sof_context.last_sof) & SOF_FRAME_MASK;
+	sof_context.last_sof = frame_count & SOF_FRAME_MASK;
+
+	if (sof_context.period != 0) {
+		next = sof_context.frame + 1 - sof_context.poll_frame;
+		if (next % sof_context.period == 0) {
+			sof_context.due = true;
+		}
+	}
+}
+
+/*
+ * Called when the host has picked up a report.  Events are delivered
+ * in order, so the current frame is the one the poll happened in.
+ * Any two polls are a multiple of the period apart, so the period is
+ * the GCD of the intervals we see.
+ */
+static void
+sof_report_complete(uint8_t instance)
+{
+	uint32_t delta, wait;
+
+	if (instance != ITF_NUM_KBD || !sof_context.sent) {
+		return;
+	}
+	sof_context.sent = false;
+
+	wait = sof_context.frame - sof_context.sent_frame;
+	sof_stats.wait[wait < SOF_NWAIT ? wait : SOF_NWAIT - 1]++;
+
+	/* If the last poll was long ago, just use this one as the anchor. */
+	delta = sof_context.frame - sof_context.poll_frame;
+	if (delta != 0 && delta <= SOF_MAX_PERIOD) {
+		sof_context.period = sof_gcd(sof_context.period, delta);
+	}
+	sof_context.poll_frame = sof_context.frame;
+
+	if (sof_context.period != 0) {
+		sof_stats.period = sof_context.period;
+		sof_stats.phase = sof_context.poll_frame % sof_context.period;
+	}
+}
+#else
+#define	sof_report_sent()	do { } while (/*CONSTCOND*/0)
+#endif
+
+#if LATENCY_HIST
+/*
+ * End-to-end latency, from a byte arriving from the keyboard to the
+ * host picking up the report it produced, broken down into stages:
+ *
+ *	QUEUE		UART RX -> dequeued by the data processing task
+ *			(waiting for the tick, or behind other data)
+ *	PROCESS		dequeued -> report submitted to TinyUSB
+ *	HOST		submitted -> transfer complete (the host's poll)
+ *	TOTAL		UART RX -> transfer complete
+ *
+ * One byte per source is followed through at a time, up to the first
+ * report it produces; QUEUE is recorded for every byte.  Each histogram
+ * has log2 buckets: bucket 0 is < 2us, bucket n is [2^n, 2^(n+1)) us,
+ * and the last bucket catches everything longer.  The histograms are
+ * exported using the "latency" config object.  With everything on one
+ * interface, the sources stand in for the interfaces.
+ */
+#define	LAT_SRC_KBD		0
+#define	LAT_SRC_JOY0		1
+#define	LAT_SRC_JOY1		2
+#define	LAT_NSRC		3
+
+#define	LAT_STAGE_QUEUE		0
+#define	LAT_STAGE_PROCESS	1
+#define	LAT_STAGE_HOST		2
+#define	LAT_STAGE_TOTAL		3
+#define	LAT_NSTAGES		4
+
+#define	LAT_NBUCKETS		16
+
+/* Give up on a byte whose report never completed. */
+#define	LAT_STALE_US		1000000
+
+struct lat_hist {
+	uint8_t		nsrc;
+	uint8_t		nstages;
+	uint8_t		nbuckets;
+	uint8_t		reserved;
+	uint32_t	count[LAT_NSRC][LAT_NSTAGES][LAT_NBUCKETS];
+};
+
+static struct lat_hist lat_hist = {
+	.nsrc		=	LAT_NSRC,
+	.nstages	=	LAT_NSTAGES,
+	.nbuckets	=	LAT_NBUCKETS,
+};
+
+enum {
+	LAT_IDLE,
+	LAT_DEQUEUED,
+	LAT_SUBMITTED,
+};
+
+static struct {
+	uint32_t rx_us;
+	uint32_t deq_us;
+	uint32_t sub_us;
+	int state;
+} lat_track[LAT_NSRC];
+
+static void
+lat_record(int src, int stage, uint32_t us)
+{
+	unsigned int b = 31 - __builtin_clz(us | 1);
+
+	lat_hist.count[src][stage][b < LAT_NBUCKETS ? b : LAT_NBUCKETS - 1]++;
+}
+
+static void
+lat_dequeued(int src, uint32_t rx_us)
+{
+	uint32_t now = time_us_32();
+
+	lat_record(src, LAT_STAGE_QUEUE, now - rx_us);
+
+	if (lat_track[src].state == LAT_IDLE ||
+	    now - lat_track[src].deq_us >= LAT_STALE_US) {
+		lat_track[src].rx_us = rx_us;
+		lat_track[src].deq_us = now;
+		lat_track[src].state = LAT_DEQUEUED;
+	}
+}
+
+static void
+lat_submitted(int src)
+{
+	uint32_t now = time_us_32();
+
+	if (lat_track[src].state == LAT_DEQUEUED) {
+		lat_record(src, LAT_STAGE_PROCESS,
+		    now - lat_track[src].deq_us);
+		lat_track[src].sub_us = now;
+		lat_track[src].state = LAT_SUBMITTED;
+	}
+}
+
+static void
+lat_report_complete(uint8_t instance, uint8_t const *report, uint16_t len)
+{
+	uint32_t now = time_us_32();
+	int src;
+
+	if (instance == ITF_NUM_KBD) {
+		/* The report ID is in the first byte. */
+		if (len == 0) {
+			return;
+		}
+		if (report[0] == REPORT_ID_KEYBOARD) {
+			src = LAT_SRC_KBD;
+		} else if (report[0] == REPORT_ID_JOY0 ||
+			   report[0] == REPORT_ID_JOY1) {
+			src = LAT_SRC_JOY0 + (report[0] - REPORT_ID_JOY0);
+		} else {
+			return;
+		}
+#if ! HID_COMPOSITE
+	} else if (instance == ITF_NUM_JOY0 || instance == ITF_NUM_JOY1) {
+		src = LAT_SRC_JOY0 + (instance - ITF_NUM_JOY0);
+#endif
+	} else {
+		return;
+	}
+
+	if (lat_track[src].state == LAT_SUBMITTED) {
+		lat_record(src, LAT_STAGE_HOST, now - lat_track[src].sub_us);
+		lat_record(src, LAT_STAGE_TOTAL, now - lat_track[src].rx_us);
+		lat_track[src].state = LAT_IDLE;
+	}
+}
+#else
+#define	lat_dequeued(s, t)	do { } while (/*CONSTCOND*/0)
+#define	lat_submitted(s)	do { } while (/*CONSTCOND*/0)
+#endif /* LATENCY_HIST */
+
+/*
+ * Invoked when the host has picked up a report.
+ */
+void
+tud_hid_report_complete_cb(uint8_t instance, uint8_t const *report,
+    uint16_t len)
+{
+	TRACE(TRACE_EV_READY, instance);
+#if HID_SOF_ALIGN
+	sof_report_complete(instance);
+#endif
+#if LATENCY_HIST
+	lat_report_complete(instance, report, len);
+#endif
+}
+
+/*
+ * Counters, for keeping an eye on adapters without a console cable
+ * attached.  They're exported using the "counters" config object, and
+ * resetting the object clears them.  The rx_* counters and queue_drops
+ * are only updated by the reader on Core 1, and the rest only by
+ * Core 0.  The count field is the number of 32-bit values that follow
+ * it (uptime_ms, then the counters proper), which lets host tools cope
+ * with counters being added to the end.
+ */
+#define	COUNTERS_VERSION	1
+
+struct counters {
+	uint16_t	version;
+	uint16_t	count;		/* number of uint32_t below */
+	uint32_t	uptime_ms;	/* filled in when read */
+	uint32_t	rx_bytes;	/* all bytes from the keyboard */
+	uint32_t	rx_key;		/* ...key codes */
+	uint32_t	rx_joy;		/* ...joystick instance / data */
+	uint32_t	rx_status;	/* ...pings, RESETs and errors */
+	uint32_t	rx_ignored;	/* ...codes with nothing mapped */
+	uint32_t	queue_drops;	/* bytes lost to a full queue */
+	uint32_t	uart_errors;	/* framing, parity, break, overrun */
+	uint32_t	pings;
+	uint32_t	resets;		/* RESET notifications */
+	uint32_t	kbd_errors;	/* RAM / ROM / ISR errors */
+	uint32_t	reboots;	/* keyboard power-cycles */
+	uint32_t	zombie_clears;
+	uint32_t	reports_sent;
+	uint32_t	reports_suppressed; /* refused, or coalesced away */
+	uint32_t	loop_iterations;
+	uint32_t	stuck_releases;	/* missing key-ups supplied */
+};
+
+#define	COUNTERS_COUNT							\
+	((sizeof(struct counters) -					\
+	  offsetof(struct counters, uptime_ms)) / sizeof(uint32_t))
+
+static struct counters counters = {
+	.version	=	COUNTERS_VERSION,
+	.count		=	COUNTERS_COUNT,
+};
+
+/*
+ * Per-task cycle counts, using each core's SysTick as a free-running
+ * 24-bit cycle counter (so anything longer than ~134ms at 125MHz
+ * wraps).  PROF_LOOP is the busy part of each main loop pass, not
+ * counting the time spent asleep.  Exported using the "profile" config
+ * object; resetting it clears the stats.  The reader's slot is only
+ * updated on Core 1, and the rest only on Core 0.  When TASK_PROFILE
+ * is off, PROF() is just the statement it wraps.
+ */
+#if TASK_PROFILE
+#define	PROF_LED		0	/* led_task() */
+#define	PROF_DEADCHECK		1	/* kbd_deadcheck() */
+#define	PROF_HID		2	/* hid_task() */
+#define	PROF_TUD		3	/* tud_task() */
+#define	PROF_READER		4	/* Core 1, per byte */
+#define	PROF_LOOP		5	/* whole main loop pass */
+#define	PROF_NSLOTS		6
+
+#define	PROF_MASK		0x00ffffff
+
+struct prof_slot {
+	uint64_t	cycles;		/* total */
+	uint32_t	calls;
+	uint32_t	min;
+	uint32_t	max;
+	uint32_t	reserved;
+};
+
+struct prof_stats {
+	uint8_t		nslots;
+	uint8_t		reserved[3];
+	uint32_t	sys_hz;		/* full-speed clk_sys */
+	struct prof_slot slot[PROF_NSLOTS];
+};
+
+static struct prof_stats prof_stats;
+
+static void
+prof_reset(void)
+{
+	memset(prof_stats.slot, 0, sizeof(prof_stats.slot));
+	for (int i = 0; i < PROF_NSLOTS; i++) {
+		prof_stats.slot[i].min = UINT32_MAX;
+	}
+}
+
+/* Called on each core. */
+static void
+prof_init(void)
+{
+	systick_hw->rvr = PROF_MASK;
+	systick_hw->cvr = 0;
+	systick_hw->csr = M0PLUS_SYST_CSR_CLKSOURCE_BITS |
+	    M0PLUS_SYST_CSR_ENABLE_BITS;
+	if (get_core_num() == 0) {
+		prof_stats.nslots = PROF_NSLOTS;
+		prof_stats.sys_hz = clock_get_hz(clk_sys);
+		prof_reset();
+	}
+}
+
+static inline uint32_t
+prof_now(void)
+{
+	return systick_hw->cvr;
+}
+
+static void
+prof_record(int slot, uint32_t start)
+{
+	struct prof_slot *ps = &prof_stats.slot[slot];
+	/* SysTick counts down. */
+	uint32_t cycles = (start - prof_now()) & PROF_MASK;
+
+	ps->cycles += cycles;
+	ps->calls++;
+	if (cycles < ps->min) {
+		ps->min = cycles;
+	}
+	if (cycles > ps->max) {
+		ps->max = cycles;
+	}
+}
+
+#define	PROF(slot, stmt)						\
+do {									\
+	uint32_t prof_start_ = prof_now();				\
+	stmt;								\
+	prof_record((slot), prof_start_);				\
+} while (/*CONSTCOND*/0)
+#else
+#define	prof_init()		do { } while (/*CONSTCOND*/0)
+#define	PROF(slot, stmt)	do { stmt; } while (/*CONSTCOND*/0)
+#endif /* TASK_PROFILE */
+
 static bool suspended = false;
 static bool mounted = false;
 static bool want_remote_wakeup = false;
 static bool have_nabu = false;
 
+/*
+ * Remote wakeup state.  We keep signalling resume every WAKE_RETRY_MS
+ * until the host comes back, and time how long it takes from the
+ * first request until the first report goes out.
+ */
+#define	WAKE_RETRY_MS		500
+
+static struct {
+	bool requested;		/* waiting for the host to resume */
+	bool resumed;		/* host resumed; no report sent yet */
+	uint32_t request_ms;	/* last time we signalled resume */
+	uint32_t start_us;	/* first time we signalled resume */
+} wake_context;
+
+static void
+wake_report_sent(void)
+{
+	if (wake_context.resumed) {
+		wake_context.resumed = false;
+		printf("[%10u] INFO: first report %u us after remote wakeup.\n",
+		    board_millis(), time_us_32() - wake_context.start_us);
+	}
+}
+
+/* Run the data processing task without waiting for the next tick. */
+static bool hid_kick = false;
+
+/*
+ * The main loop sleeps (WFE) until something needs doing: a USB
+ * interrupt, a doorbell from the reader on Core 1, or a timer event.
+ * The tasks arm timers for when they next need to run; see
+ * timer_service.h.
+ */
+#ifndef MAIN_LOOP_WFE
+#define	MAIN_LOOP_WFE		1
+#endif
+
+enum {
+	TIMER_EV_LED		= 0,	/* next LED blink */
+	TIMER_EV_DEADCHECK	= 1,	/* keyboard health check */
+	TIMER_EV_REBOOT		= 2,	/* keyboard power-cycle step */
+	TIMER_EV_HID		= 3,	/* report interval tick */
+	TIMER_EV_STATS		= 4,	/* main loop stats */
+	TIMER_EV_GOV		= 5,	/* clock governor idle check */
+	TIMER_EV_STUCK		= 6,	/* stuck special key check */
+};
+
+#define	LOOP_STATS_MS		10000
+
+static struct {
+	uint32_t woke_us;	/* when we last woke up */
+	bool woke;		/* woke up this time around */
+} loop_context;
+
+/*
+ * Sleep residency stands in for idle current, which we can't measure
+ * from in here; compare against a MAIN_LOOP_WFE=0 build with a meter.
+ */
+static struct {
+	uint32_t start_ms;	/* start of this stats window */
+	uint32_t sleep_us;	/* time spent asleep */
+	uint32_t wakes;
+	uint32_t reports;	/* reports sent right after a wake */
+	uint32_t wake_report_us; /* total wake-to-report time */
+	uint32_t wake_report_max_us;
+} loop_stats;
+
+static void
+loop_report_sent(void)
+{
+	uint32_t lat;
+
+	if (loop_context.woke) {
+		loop_context.woke = false;
+		lat = time_us_32() - loop_context.woke_us;
+		loop_stats.reports++;
+		loop_stats.wake_report_us += lat;
+		if (lat > loop_stats.wake_report_max_us) {
+			loop_stats.wake_report_max_us = lat;
+		}
+	}
+}
+
 /*
  * LED blinking patterns.  Even indices are ON time, odd indices are
  * OFF time.  -1 means "go back to beginning".
@@ -208,7 +788,6 @@ static const int ledseq_suspended[] = {
 struct {
 	const int *sequence;
 	uint idx;
-	uint32_t start_ms;
 	bool state;
 } led_context;
 
@@ -221,10 +800,10 @@ led_set_sequence(const int *seq)
 
 	led_context.sequence = seq;
 	led_context.idx = 0;
-	led_context.start_ms = board_millis();
 	led_context.state = true;
 
 	board_led_write(led_context.state);
+	timer_oneshot(TIMER_EV_LED, seq[0] * 1000);
 }
 
 static void
@@ -253,7 +832,7 @@ led_select_sequence(void)
 }
 
 static void
-led_task(uint32_t now)
+led_task(void)
 {
 	int interval;
 
@@ -261,14 +840,6 @@ led_task(uint32_t now)
 		return;
 	}
 
-	interval = led_context.sequence[led_context.idx];
-
-	if (now - led_context.start_ms < interval) {
-		return;
-	}
-
-	led_context.start_ms += interval;
-
 	if ((interval = led_context.sequence[++led_context.idx]) == -1) {
 		interval = led_context.sequence[0];
 		led_context.idx = 0;
@@ -277,394 +848,136 @@ led_task(uint32_t now)
 	led_context.state ^= true;
 
 	board_led_write(led_context.state);
+	timer_oneshot(TIMER_EV_LED, interval * 1000);
 }
 
+#define	NABU_KBD_BAUDRATE	6992
+
 /*
- * Map NABU keycodes to HID key codes.
+ * The keymap that's actually used lives in RAM, so that it can be
+ * replaced at run-time without rebuilding the firmware.  The built-in
+ * default is generated for the host keyboard layout selected at build
+ * time (KEYMAP_DEFAULT_LAYOUT).  The host can select a different layout,
+ * or upload a complete replacement keymap, using the config report.
+ * Either way, the result is saved in flash so that it survives a power
+ * cycle.
  *
- * The HID Report array sends a report for each modifier key, in the
- * seqence they are pressed / released.  So, an 'A' is:
- *
- *	Shift, Shift + A, Shift, none
- *
- * We encode these sequences directly in the map.  The final entry in
- * each sequence is always 0.  For keys where we get individual Down/Up
- * events from the NABU keyboard, we don't use sequences, we just send
- * the individual event (those keys aren't affected by modifiers).
- *
- * Unassigned entries get 0, which conveniently is HID_KEY_NONE.  N.B.
- * the NABU keyboard reader thread won't even enqueue keystroke events
- * for these unassigned keys.
- */
-
-#define	M_CTRL		0x0100		/* KEYBOARD_MODIFIER_LEFTCTRL << 8 */
-#define	M_SHIFT		0x0200		/* KEYBOARD_MODIFIER_LEFTSHIFT << 8 */
-#define	M_ALT		0x0400		/* KEYBOARD_MODIFIER_LEFTALT << 8 */
-#define	M_META		0x0800		/* KEYBOARD_MODIFIER_LEFTGUI << 8 */
-#define	M_DOWN		0x1000
-#define	M_UP		0x2000
-#define	M_ENDSEQ	0x4000
-
-#define	M_HIDKEY(m)	((m) & 0x00ff)
-#define	M_MODS(m)	((m) & 0x0f00)
-
-#define	NABU_CODE_JOY0		0x80
-#define	NABU_CODE_JOY1		0x81
-#define	NABU_CODE_ERR_FIRST	0x90
-#define	NABU_CODE_ERR_LAST	0x95
-#define	NABU_CODE_JOYDAT_FIRST	0xa0
-#define	NABU_CODE_JOYDAT_LAST	0xbf
-
-#define	NABU_CODE_JOYDAT_P(c)	((c) >= NABU_CODE_JOYDAT_FIRST &&	\
-				 (c) <= NABU_CODE_JOYDAT_LAST)
-
-#define	NABU_CODE_ERR_P(c)	((c) >= NABU_CODE_ERR_FIRST &&		\
-				 (c) <= NABU_CODE_ERR_LAST)
-
-#define	NABU_CODE_ERR_MKEY	0x90	/* multiple keys pressed */
-#define	NABU_CODE_ERR_RAM	0x91	/* faulty keyboard RAM */
-#define	NABU_CODE_ERR_ROM	0x92	/* faulty keyboard ROM */
-#define	NABU_CODE_ERR_ISR	0x93	/* illegal ISR (?) */
-#define	NABU_CODE_ERR_PING	0x94	/* periodic no-load ping */
-#define	NABU_CODE_ERR_RESET	0x95	/* keyboard power-up/reset */
+ * There are 2 copies of the keymap: the active one and a staging area
+ * that new keymaps are uploaded into.  Once a new keymap has been
+ * validated, we just swap the pointer, so a lookup is still a simple
+ * array index.
+ */
+#define	KEYMAP_VERSION		4	/* bump if struct keymap changes */
 
-#define	NABU_KBD_BAUDRATE	6992
+#ifndef KEYMAP_BUILTIN
+#define	KEYMAP_BUILTIN		0
+#endif
 
-struct codeseq {
-	uint16_t codes[6];	/* 0-terminated */
-};
+#ifndef KEYMAP_DEFAULT_LAYOUT
+#define	KEYMAP_DEFAULT_LAYOUT	LAYOUT_US
+#endif
 
-static const struct codeseq nabu_to_hid[256] = {
-/*
- * CTRL just lops off the 2 upper bits of the keycode
- * on the NABU keyboard (except for C-'<' ??), but we
- * simplify to C-a, C-c, etc.
- */
-[0x00]		=	{ { M_CTRL,				/* C-'@' */
-			    M_CTRL | M_SHIFT,
-			    M_CTRL | M_SHIFT | HID_KEY_2,
-			    M_CTRL | M_SHIFT,
-			    M_CTRL } },
-[0x01]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_A,
-			    M_CTRL } },
-[0x02]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_B,
-			    M_CTRL } },
-[0x03]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_C,
-			    M_CTRL } },
-[0x04]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_D,
-			    M_CTRL } },
-[0x05]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_E,
-			    M_CTRL } },
-[0x06]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_F,
-			    M_CTRL } },
-[0x07]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_G,
-			    M_CTRL } },
-[0x08]		=	{ { HID_KEY_BACKSPACE } },		/* Backspace */
-[0x09]		=	{ { HID_KEY_TAB } },			/* Tab */
-[0x0a]		=	{ { HID_KEY_ENTER } },			/* LF */
-[0x0b]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_K,
-			    M_CTRL } },
-[0x0c]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_L,
-			    M_CTRL } },
-[0x0d]		=	{ { HID_KEY_ENTER } },			/* CR */
-[0x0e]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_N,
-			    M_CTRL } },
-[0x0f]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_O,
-			    M_CTRL } },
-[0x10]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_P,
-			    M_CTRL } },
-[0x11]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_Q,
-			    M_CTRL } },
-[0x12]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_R,
-			    M_CTRL } },
-[0x13]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_S,
-			    M_CTRL } },
-[0x14]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_T,
-			    M_CTRL } },
-[0x15]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_U,
-			    M_CTRL } },
-[0x16]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_V,
-			    M_CTRL } },
-[0x17]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_W,
-			    M_CTRL } },
-[0x18]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_X,
-			    M_CTRL } },
-[0x19]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_Y,
-			    M_CTRL } },
-[0x1a]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_Z,
-			    M_CTRL } },
-[0x1b]		=	{ { HID_KEY_ESCAPE } },			/* ESC */
-[0x1c]		=	{ { M_CTRL,				/* C-'<' */
-			    M_CTRL | M_SHIFT,
-			    M_CTRL | M_SHIFT | HID_KEY_COMMA,
-			    M_CTRL | M_SHIFT,
-			    M_CTRL } },
-[0x1d]		=	{ { M_CTRL,
-			    M_CTRL | HID_KEY_BRACKET_RIGHT,
-			    M_CTRL } },
-[0x1e]		=	{ { M_CTRL,				/* C-'^' */
-			    M_CTRL | M_SHIFT,
-			    M_CTRL | M_SHIFT | HID_KEY_6,
-			    M_CTRL | M_SHIFT,
-			    M_CTRL } },
-[0x1f]		=	{ { M_CTRL,				/* C-'_' */
-			    M_CTRL | M_SHIFT,
-			    M_CTRL | M_SHIFT | HID_KEY_MINUS,
-			    M_CTRL | M_SHIFT,
-			    M_CTRL } },
-
-[0x20]		=	{ { HID_KEY_SPACE } },
-[0x21]		=	{ { M_SHIFT,				/* ! */
-			    M_SHIFT | HID_KEY_1,
-			    M_SHIFT } },
-[0x22]		=	{ { M_SHIFT,				/* " */
-			    M_SHIFT | HID_KEY_APOSTROPHE,
-			    M_SHIFT } },
-[0x23]		=	{ { M_SHIFT,				/* # */
-			    M_SHIFT | HID_KEY_3,
-			    M_SHIFT } },
-[0x24]		=	{ { M_SHIFT,				/* $ */
-			    M_SHIFT | HID_KEY_4,
-			    M_SHIFT } },
-[0x25]		=	{ { M_SHIFT,				/* % */
-			    M_SHIFT | HID_KEY_5,
-			    M_SHIFT } },
-[0x26]		=	{ { M_SHIFT,				/* & */
-			    M_SHIFT | HID_KEY_7,
-			    M_SHIFT } },
-[0x27]		=	{ { HID_KEY_APOSTROPHE } },
-[0x28]		=	{ { M_SHIFT,				/* ( */
-			    M_SHIFT | HID_KEY_9,
-			    M_SHIFT } },
-[0x29]		=	{ { M_SHIFT,				/* ) */
-			    M_SHIFT | HID_KEY_0,
-			    M_SHIFT } },
-[0x2a]		=	{ { M_SHIFT,				/* * */
-			    M_SHIFT | HID_KEY_8,
-			    M_SHIFT } },
-[0x2b]		=	{ { M_SHIFT,				/* + */
-			    M_SHIFT | HID_KEY_EQUAL,
-			    M_SHIFT } },
-[0x2c]		=	{ { HID_KEY_COMMA } },			/* , */
-[0x2d]		=	{ { HID_KEY_MINUS } },			/* - */
-[0x2e]		=	{ { HID_KEY_PERIOD } },			/* . */
-[0x2f]		=	{ { HID_KEY_SLASH } },			/* / */
-[0x30]		=	{ { HID_KEY_0 } },
-[0x31]		=	{ { HID_KEY_1 } },
-[0x32]		=	{ { HID_KEY_2 } },
-[0x33]		=	{ { HID_KEY_3 } },
-[0x34]		=	{ { HID_KEY_4 } },
-[0x35]		=	{ { HID_KEY_5 } },
-[0x36]		=	{ { HID_KEY_6 } },
-[0x37]		=	{ { HID_KEY_7 } },
-[0x38]		=	{ { HID_KEY_8 } },
-[0x39]		=	{ { HID_KEY_9 } },
-[0x3a]		=	{ { M_SHIFT,				/* : */
-			    M_SHIFT | HID_KEY_SEMICOLON,
-			    M_SHIFT } },
-[0x3b]		=	{ { HID_KEY_SEMICOLON } },
-[0x3c]		=	{ { M_SHIFT,				/* < */
-			    M_SHIFT | HID_KEY_COMMA,
-			    M_SHIFT } },
-[0x3d]		=	{ { HID_KEY_EQUAL } },
-[0x3e]		=	{ { M_SHIFT,				/* > */
-			    M_SHIFT | HID_KEY_PERIOD,
-			    M_SHIFT } },
-[0x3f]		=	{ { M_SHIFT,				/* ? */
-			    M_SHIFT | HID_KEY_SLASH,
-			    M_SHIFT } },
-
-[0x40]		=	{ { M_SHIFT,				/* @ */
-			    M_SHIFT | HID_KEY_2,
-			    M_SHIFT } },
-[0x41]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_A,
-			    M_SHIFT } },
-[0x42]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_B,
-			    M_SHIFT } },
-[0x43]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_C,
-			    M_SHIFT } },
-[0x44]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_D,
-			    M_SHIFT } },
-[0x45]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_E,
-			    M_SHIFT } },
-[0x46]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_F,
-			    M_SHIFT } },
-[0x47]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_G,
-			    M_SHIFT } },
-[0x48]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_H,
-			    M_SHIFT } },
-[0x49]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_I,
-			    M_SHIFT } },
-[0x4a]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_J,
-			    M_SHIFT } },
-[0x4b]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_K,
-			    M_SHIFT } },
-[0x4c]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_L,
-			    M_SHIFT } },
-[0x4d]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_M,
-			    M_SHIFT } },
-[0x4e]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_N,
-			    M_SHIFT } },
-[0x4f]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_O,
-			    M_SHIFT } },
-[0x50]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_P,
-			    M_SHIFT } },
-[0x51]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_Q,
-			    M_SHIFT } },
-[0x52]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_R,
-			    M_SHIFT } },
-[0x53]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_S,
-			    M_SHIFT } },
-[0x54]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_T,
-			    M_SHIFT } },
-[0x55]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_U,
-			    M_SHIFT } },
-[0x56]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_V,
-			    M_SHIFT } },
-[0x57]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_W,
-			    M_SHIFT } },
-[0x58]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_X,
-			    M_SHIFT } },
-[0x59]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_Y,
-			    M_SHIFT } },
-[0x5a]		=	{ { M_SHIFT,
-			    M_SHIFT | HID_KEY_Z,
-			    M_SHIFT } },
-[0x5b]		=	{ { HID_KEY_BRACKET_LEFT } },		/* [ */
-/* 0x5c */
-[0x5d]		=	{ { HID_KEY_BRACKET_RIGHT } },		/* ] */
-[0x5e]		=	{ { M_SHIFT,				/* ^ */
-			    M_SHIFT | HID_KEY_6,
-			    M_SHIFT } },
-[0x5f]		=	{ { M_SHIFT,				/* _ */
-			    M_SHIFT | HID_KEY_MINUS,
-			    M_SHIFT } },
-
-/* 0x60 */
-[0x61]		=	{ { HID_KEY_A } },
-[0x62]		=	{ { HID_KEY_B } },
-[0x63]		=	{ { HID_KEY_C } },
-[0x64]		=	{ { HID_KEY_D } },
-[0x65]		=	{ { HID_KEY_E } },
-[0x66]		=	{ { HID_KEY_F } },
-[0x67]		=	{ { HID_KEY_G } },
-[0x68]		=	{ { HID_KEY_H } },
-[0x69]		=	{ { HID_KEY_I } },
-[0x6a]		=	{ { HID_KEY_J } },
-[0x6b]		=	{ { HID_KEY_K } },
-[0x6c]		=	{ { HID_KEY_L } },
-[0x6d]		=	{ { HID_KEY_M } },
-[0x6e]		=	{ { HID_KEY_N } },
-[0x6f]		=	{ { HID_KEY_O } },
-[0x70]		=	{ { HID_KEY_P } },
-[0x71]		=	{ { HID_KEY_Q } },
-[0x72]		=	{ { HID_KEY_R } },
-[0x73]		=	{ { HID_KEY_S } },
-[0x74]		=	{ { HID_KEY_T } },
-[0x75]		=	{ { HID_KEY_U } },
-[0x76]		=	{ { HID_KEY_V } },
-[0x77]		=	{ { HID_KEY_W } },
-[0x78]		=	{ { HID_KEY_X } },
-[0x79]		=	{ { HID_KEY_Y } },
-[0x7a]		=	{ { HID_KEY_Z } },
-[0x7b]		=	{ { M_SHIFT,				/* { */
-			    M_SHIFT | HID_KEY_BRACKET_LEFT,
-			    M_SHIFT } },
-/* 0x7c */
-[0x7d]		=	{ { M_SHIFT,				/* } */
-			    M_SHIFT | HID_KEY_BRACKET_RIGHT,
-			    M_SHIFT } },
-/* 0x7e */
-[0x7f]		=	{ { HID_KEY_BACKSPACE } },		/* DEL */
-
-/* 0x80 - 0x9f */
-
-/* 0xa0 - 0xbf */
-
-/* 0xc0 - 0xdf */
-
-[0xe0]		=	{ { M_DOWN | HID_KEY_ARROW_RIGHT } },
-[0xe1]		=	{ { M_DOWN | HID_KEY_ARROW_LEFT } },
-[0xe2]		=	{ { M_DOWN | HID_KEY_ARROW_UP } },
-[0xe3]		=	{ { M_DOWN | HID_KEY_ARROW_DOWN } },
-[0xe4]		=	{ { M_DOWN | HID_KEY_PAGE_DOWN } },	/* |||> */
-[0xe5]		=	{ { M_DOWN | HID_KEY_PAGE_UP } },	/* <||| */
-	/*
-	 * There isn't really a good alternative for \ and |, so we steal
-	 * the NO and YES keys, respectively.  Because these keys don't
-	 * self-repeat, we end their key-down sequences without unwinding
-	 * to HID_KEY_NONE, and let the USB host do the key repeat itself.
-	 * We do this by ending the sequence with whatever HID key code
-	 * is present with M_ENDSEQ.
-	 */
-[0xe6]		=	{ { M_ENDSEQ | HID_KEY_BACKSLASH } },	/* NO */
-[0xe7]		=	{ { M_SHIFT,				/* YES */
-			    M_SHIFT | M_ENDSEQ | HID_KEY_BACKSLASH } },
-[0xe8]		=	{ { M_DOWN | M_META } },		/* SYM */
-[0xe9]		=	{ { M_DOWN | HID_KEY_PAUSE } },		/* PAUSE */
-[0xea]		=	{ { M_DOWN | M_ALT } },			/* TV/NABU */
-/* 0xeb - 0xef */
-[0xf0]		=	{ { M_UP | HID_KEY_ARROW_RIGHT } },
-[0xf1]		=	{ { M_UP | HID_KEY_ARROW_LEFT } },
-[0xf2]		=	{ { M_UP | HID_KEY_ARROW_UP } },
-[0xf3]		=	{ { M_UP | HID_KEY_ARROW_DOWN } },
-[0xf4]		=	{ { M_UP | HID_KEY_PAGE_DOWN } },	/* |||> */
-[0xf5]		=	{ { M_UP | HID_KEY_PAGE_UP } },		/* <||| */
-[0xf6]		=	{ { M_ENDSEQ } },			/* NO */
-[0xf7]		=	{ { M_SHIFT } },			/* YES */
-[0xf8]		=	{ { M_UP | M_META } },			/* SYM */
-[0xf9]		=	{ { M_UP | HID_KEY_PAUSE } },		/* PAUSE */
-[0xfa]		=	{ { M_UP | M_ALT } },			/* TV/NABU */
-/* 0xfb - 0xff */
+static struct keymap keymap_tables[2];
+static unsigned int keymap_active;
+static size_t keymap_staged;		/* bytes uploaded to staging */
+static const struct keymap * volatile kbd_keymap = &keymap_tables[0];
+static unsigned int kbd_layer_keys;	/* KEYMAP_LAYER_* in use */
+
+static void
+keymap_load_default(struct keymap *km)
+{
+#if KEYMAP_BUILTIN
+	*km = keymap_builtin;
+#else
+	keymap_build(km, KEYMAP_DEFAULT_LAYOUT);
+#endif
+}
+
+static void
+keymap_activate(unsigned int which)
+{
+	keymap_active = which;
+	kbd_keymap = &keymap_tables[which];
+	kbd_layer_keys = keymap_layer_keys(kbd_keymap);
+	keymap_staged = 0;
+}
+
+static void
+keymap_init(void)
+{
+	const struct keymap *km;
+	size_t len;
+
+	km = flash_store_load(FLASH_STORE_AREA_KEYMAP, KEYMAP_VERSION, &len);
+	if (km != NULL && len == sizeof(*km) && keymap_validate(km)) {
+		keymap_tables[0] = *km;
+		printf("Using keymap from flash (%s layout).\n",
+		    keymap_layout_name(km->layout));
+	} else {
+		keymap_load_default(&keymap_tables[0]);
+		printf("Using built-in keymap (%s layout).\n",
+		    keymap_layout_name(keymap_tables[0].layout));
+	}
+	keymap_activate(0);
+}
+
+/*
+ * Miscellaneous run-time settings, which the host can change using
+ * the config report.  These are saved in flash, too.
+ */
+#define	SETTINGS_VERSION	1	/* bump if struct settings changes */
+
+#ifndef UNICODE_DEFAULT_MODE
+#define	UNICODE_DEFAULT_MODE	UNICODE_OFF
+#endif
+
+#define	STUCK_KEY_DEFAULT_S	10
+#define	STUCK_KEY_OFF		0xff
+
+struct settings {
+	uint8_t		unicode_mode;	/* UNICODE_* */
+	uint8_t		stuck_key_s;	/* 0 = default, STUCK_KEY_OFF */
+	uint8_t		reserved[14];
 };
 
+static struct settings settings;
+
+static void
+settings_load_default(struct settings *s)
+{
+	memset(s, 0, sizeof(*s));
+	s->unicode_mode = UNICODE_DEFAULT_MODE;
+}
+
+static bool
+settings_validate(const struct settings *s)
+{
+	return s->unicode_mode < UNICODE_NMODES;
+}
+
+static void
+settings_init(void)
+{
+	const struct settings *s;
+	size_t len;
+
+	s = flash_store_load(FLASH_STORE_AREA_SETTINGS, SETTINGS_VERSION,
+	    &len);
+	if (s != NULL && len == sizeof(*s) && settings_validate(s)) {
+		printf("Using settings from flash.\n");
+		settings = *s;
+	} else {
+		settings_load_default(&settings);
+	}
+	printf("Unicode entry: %s\n", unicode_mode_name(settings.unicode_mode));
+	if (settings.stuck_key_s == STUCK_KEY_OFF) {
+		printf("Stuck key release: off\n");
+	} else {
+		printf("Stuck key release: %us\n", settings.stuck_key_s != 0 ?
+		    settings.stuck_key_s : STUCK_KEY_DEFAULT_S);
+	}
+}
+
 /*
  * Joystick data packets have the format:
  *
@@ -696,6 +1009,12 @@ static const uint8_t joy_to_dpad[JOY_DIR_MASK + 1] = {
 [JOY_UP | JOY_LEFT]	=	GAMEPAD_HAT_UP_LEFT,
 };
 
+#if HID_JOY_COMPACT
+typedef uint8_t joy_report_t;
+#else
+typedef hid_gamepad_report_t joy_report_t;
+#endif
+
 /*
  * We keep 2 joystick contexts so we can report "simultaneous" movements
  * on both sticks more accurately, but we still need to have a global for
@@ -703,6 +1022,9 @@ static const uint8_t joy_to_dpad[JOY_DIR_MASK + 1] = {
  */
 static struct joy_context {
 	struct queue queue;
+	joy_report_t report;	/* last report sent, for GET_REPORT */
+	uint8_t wake_sample;	/* newest sample while suspended */
+	bool have_wake_sample;
 	bool zombie;
 } joy_context[2];
 
@@ -710,6 +1032,9 @@ static void
 joy_init(int which)
 {
 	queue_init(&joy_context[which].queue);
+	memset(&joy_context[which].report, 0,
+	    sizeof(joy_context[which].report));
+	joy_context[which].have_wake_sample = false;
 	joy_context[which].zombie = false;
 }
 
@@ -717,27 +1042,64 @@ static inline bool
 joy_has_data_unlocked(int which)
 {
 	return !QUEUE_EMPTY_P(&joy_context[which].queue) ||
+	       joy_context[which].have_wake_sample ||
 	       joy_context[which].zombie;
 }
 
 static void
 send_joy_report(int which, uint8_t data)
 {
+	joy_report_t *report = &joy_context[which].report;
 	uint8_t dpad = joy_to_dpad[data & JOY_DIR_MASK];
+
+#if HID_JOY_COMPACT
+	*report = dpad | ((data & JOY_FIRE) ? JOY_REPORT_FIRE : 0);
+#else
 	uint8_t buttons = (data & JOY_FIRE) ? GAMEPAD_BUTTON_A : 0;
 
-	hid_gamepad_report_t report = {
+	*report = (hid_gamepad_report_t) {
 		.hat		=	dpad,
 		.buttons	=	buttons,
 	};
-
-	tud_hid_n_report(ITF_NUM_JOY0 + which, 0, &report, sizeof(report));
+#endif
+
+	bool ok;
+
+	TRACE(TRACE_EV_JOY_REPORT, (which << 5) | (data & 0x1f));
+#if HID_COMPOSITE
+	ok = tud_hid_n_report(ITF_NUM_KBD, REPORT_ID_JOY0 + which, report,
+	    sizeof(*report));
+	sof_report_sent();
+#else
+	ok = tud_hid_n_report(ITF_NUM_JOY0 + which, 0, report,
+	    sizeof(*report));
+#endif
+	if (ok) {
+		counters.reports_sent++;
+	} else {
+		counters.reports_suppressed++;
+	}
+	lat_submitted(LAT_SRC_JOY0 + which);
+	wake_report_sent();
+	loop_report_sent();
 }
 
 static struct {
 	struct queue queue;
+	struct codeseq seq;	/* the sequence in progress */
 	const uint16_t *next;
+	const uint16_t *macro;	/* macro in progress (in flash) */
+	uint16_t macro_left;	/* steps left in macro */
+	uint32_t macro_resume;	/* when current macro delay ends */
+	struct unicode_gen unicode; /* Unicode entry in progress */
+	hid_keyboard_report_t report; /* last report sent, for GET_REPORT */
+	uint8_t wake_key;	/* key that woke the host */
+	bool have_wake_key;
 	uint16_t modifiers;
+	uint8_t layer;		/* KEYMAP_LAYER_* keys held */
+	uint8_t layer_pending;	/* layer keys held back from the host */
+	uint8_t layer_used;	/* layer keys that selected something */
+	struct stuck_keys stuck; /* special keys down */
 	bool zombie;
 } kbd_context;
 
@@ -746,7 +1108,14 @@ kbd_init(void)
 {
 	queue_init(&kbd_context.queue);
 	kbd_context.next = NULL;
+	kbd_context.macro = NULL;
+	kbd_context.unicode.cp = 0;
+	memset(&kbd_context.report, 0, sizeof(kbd_context.report));
+	kbd_context.have_wake_key = false;
 	kbd_context.modifiers = 0;
+	kbd_context.layer = 0;
+	kbd_context.layer_pending = 0;
+	stuck_keys_init(&kbd_context.stuck);
 	kbd_context.zombie = false;
 }
 
@@ -754,6 +1123,9 @@ static inline bool
 kbd_has_data_unlocked(void)
 {
 	return kbd_context.next != NULL ||
+	       kbd_context.macro != NULL ||
+	       kbd_context.unicode.cp != 0 ||
+	       kbd_context.have_wake_key ||
 	       !QUEUE_EMPTY_P(&kbd_context.queue) ||
 	       kbd_context.zombie;
 }
@@ -761,7 +1133,8 @@ kbd_has_data_unlocked(void)
 static inline uint8_t
 keymod_to_hid(uint16_t code)
 {
-	return M_MODS(code) >> 8;
+	return ((code & 0x0f00) >> 8) |
+	       ((code & M_ALTGR) ? KEYBOARD_MODIFIER_RIGHTALT : 0);
 }
 
 static uint16_t
@@ -790,79 +1163,521 @@ kbd_modifier(uint16_t code)
 }
 
 static void
-send_kbd_report(uint16_t code)
+kbd_report(uint8_t keymod, uint8_t keycode)
 {
-	uint8_t keymod = keymod_to_hid(code | kbd_context.modifiers);
-	uint8_t keycode = (uint8_t)code;
+	hid_keyboard_report_t *report = &kbd_context.report;
 
-	hid_keyboard_report_t report = {
+	*report = (hid_keyboard_report_t) {
 		.modifier	=	keymod,
 		.keycode	=	{ [0] = keycode },
 	};
 
-	tud_hid_n_report(ITF_NUM_KBD, 0, &report, sizeof(report));
+	TRACE(TRACE_EV_KBD_REPORT, keycode);
+	if (tud_hid_n_report(ITF_NUM_KBD, REPORT_ID_KEYBOARD, report,
+			     sizeof(*report))) {
+		counters.reports_sent++;
+	} else {
+		counters.reports_suppressed++;
+	}
+	sof_report_sent();
+	lat_submitted(LAT_SRC_KBD);
+	wake_report_sent();
+	loop_report_sent();
 }
 
-/*
- * The reader thread updates this timestamp each time it gets a
- * byte from the keyboard.
- */
-static volatile uint32_t last_kbd_message_time;	/* in milliseconds */
-static bool kbd_powerstate;
-
 static void
-kbd_setpower(bool enabled)
+send_kbd_report(uint16_t code)
 {
-	kbd_powerstate = enabled;
-	gpio_put(PWREN_PIN, enabled);
+	kbd_report(keymod_to_hid(code | kbd_context.modifiers),
+	    (uint8_t)code);
+}
+
+/*
+ * SYM and TV/NABU select keymap layers while they're held.  If the
+ * keymap actually has a layer for one of them, we hold back its own
+ * mapping (normally a sticky modifier) until we know what it's for:
+ * if it selects a layer entry, the host never sees it; if some other
+ * key is typed, it's applied first (kbd_layer_commit()); and if it's
+ * released without anything else being typed, it's sent as a tap.
+ *
+ * Returns true if the code was consumed here.
+ */
+static bool
+kbd_layer_key(uint8_t c)
+{
+	unsigned int bit;
+	uint8_t down;
+	uint16_t code;
+
+	switch (c) {
+	case NABU_CODE_SYM_DOWN:
+	case NABU_CODE_SYM_UP:
+		bit = KEYMAP_LAYER_SYM;
+		down = NABU_CODE_SYM_DOWN;
+		break;
+
+	case NABU_CODE_TV_DOWN:
+	case NABU_CODE_TV_UP:
+		bit = KEYMAP_LAYER_TV;
+		down = NABU_CODE_TV_DOWN;
+		break;
+
+	default:
+		return false;
+	}
+
+	if (c == down) {
+		kbd_context.layer |= bit;
+		if ((kbd_layer_keys & bit) == 0) {
+			return false;
+		}
+		kbd_context.layer_pending |= bit;
+		kbd_context.layer_used &= ~bit;
+		return true;
+	}
+
+	kbd_context.layer &= ~bit;
+	if ((kbd_context.layer_pending & bit) == 0) {
+		/* Never held back; release it normally. */
+		return false;
+	}
+	kbd_context.layer_pending &= ~bit;
+	if (kbd_context.layer_used & bit) {
+		return true;
+	}
+
+	/* Tapped on its own; press and release it now. */
+	code = kbd_keymap->map[0][down] & ~M_DOWN;
+	debug_printf("DEBUG: %s: layer key 0x%02x tapped\n", __func__, down);
+	memset(&kbd_context.seq, 0, sizeof(kbd_context.seq));
+	kbd_context.seq.codes[0] = code;
+	kbd_context.next = &kbd_context.seq.codes[1];
+	send_kbd_report(code);
+	return true;
+}
+
+/*
+ * A key that isn't in any layer was typed; apply the sticky modifiers
+ * for any layer keys we held back.
+ */
+static void
+kbd_layer_commit(void)
+{
+	static const uint8_t downs[] = {
+		[KEYMAP_LAYER_SYM] = NABU_CODE_SYM_DOWN,
+		[KEYMAP_LAYER_TV] = NABU_CODE_TV_DOWN,
+	};
+	unsigned int bit;
+	uint16_t code;
+
+	for (bit = KEYMAP_LAYER_SYM; bit <= KEYMAP_LAYER_TV; bit <<= 1) {
+		if (kbd_context.layer_pending & bit) {
+			code = kbd_keymap->map[0][downs[bit]];
+			if ((code & M_DOWN) != 0 &&
+			    M_HIDKEY(code) == HID_KEY_NONE) {
+				kbd_modifier(code);
+			}
+		}
+	}
+	kbd_context.layer_pending = 0;
+}
+
+/*
+ * Special keys whose key-up code got lost (see stuck_keys.c) are
+ * released after the stuck key timeout by putting their key-up code in
+ * the queue, as if it came from the keyboard.
+ */
+static uint32_t
+kbd_stuck_timeout_ms(void)
+{
+	switch (settings.stuck_key_s) {
+	case 0:
+		return STUCK_KEY_DEFAULT_S * 1000;
+
+	case STUCK_KEY_OFF:
+		return 0;
+
+	default:
+		return settings.stuck_key_s * 1000;
+	}
+}
+
+static void
+kbd_stuck_track(uint8_t c, uint32_t now)
+{
+	uint32_t timeout = kbd_stuck_timeout_ms();
+
+	stuck_keys_track(&kbd_context.stuck, c, now);
+	if (kbd_context.stuck.held != 0 && timeout != 0 &&
+	    ! timer_armed_p(TIMER_EV_STUCK)) {
+		timer_oneshot(TIMER_EV_STUCK, timeout * 1000);
+	}
+}
+
+#define	STUCK_KEY_RETRY_MS	100	/* after the queue was full */
+
+static void
+kbd_stuck_task(uint32_t now)
+{
+	uint32_t timeout = kbd_stuck_timeout_ms();
+	struct stuck_keys *sk = &kbd_context.stuck;
+	bool retry = false;
+	uint32_t next;
+	uint16_t expired;
+	unsigned int i;
+	uint8_t c;
+
+	if (timeout == 0) {
+		/* Turned off since the keys went down. */
+		stuck_keys_init(sk);
+		return;
+	}
+
+	expired = stuck_keys_expired(sk, now, timeout, &next);
+	for (i = 0; i < STUCK_KEYS_NKEYS; i++) {
+		if ((expired & (1U << i)) == 0) {
+			continue;
+		}
+		if (suspended) {
+			/* Don't wake the host for this; check back later. */
+			continue;
+		}
+
+		c = NABU_CODE_DOWN_FIRST + i;
+		if (c == NABU_CODE_SYM_DOWN) {
+			/* Not a tap; see kbd_layer_key(). */
+			kbd_context.layer_used |= KEYMAP_LAYER_SYM;
+		} else if (c == NABU_CODE_TV_DOWN) {
+			kbd_context.layer_used |= KEYMAP_LAYER_TV;
+		}
+		if (! queue_add(&kbd_context.queue, NABU_CODE_KEY_UP(c))) {
+			/* Try again as soon as there's room. */
+			retry = true;
+			continue;
+		}
+		hid_order_add(HID_SRC_KBD);
+		sk->held &= ~(1U << i);
+		counters.stuck_releases++;
+		printf("[%10u] WARNING: no key-up for 0x%02x after %u ms, "
+		    "releasing it.\n", board_millis(), c,
+		    now - sk->held_time[i]);
+	}
+
+	if (retry) {
+		next = STUCK_KEY_RETRY_MS;
+	}
+	if (sk->held != 0) {
+		timer_oneshot(TIMER_EV_STUCK,
+		    MAX(next, STUCK_KEY_RETRY_MS) * 1000);
+	}
+}
+
+/*
+ * Start the macro bound to this code (if there is one) given the
+ * current state of SYM and TV/NABU.
+ */
+static bool
+kbd_macro_start(uint8_t c, uint32_t now)
+{
+	uint16_t mods = kbd_context.modifiers;
+
+	if (kbd_context.layer & KEYMAP_LAYER_SYM) {
+		mods |= MACRO_SYM;
+	}
+	if (kbd_context.layer & KEYMAP_LAYER_TV) {
+		mods |= MACRO_TV;
+	}
+	kbd_context.macro = macro_lookup(c, mods, &kbd_context.macro_left);
+	if (kbd_context.macro == NULL) {
+		return false;
+	}
+	debug_printf("DEBUG: %s: macro for 0x%02x, %u steps\n",
+	    __func__, c, kbd_context.macro_left);
+	kbd_context.layer_used |= kbd_context.layer_pending;
+	kbd_context.macro_resume = now;
+	return true;
+}
+
+/*
+ * Send the next report in the macro in progress.  Delays just push
+ * out the time of the next report; we never wait for them here.
+ */
+static void
+kbd_macro_step(uint32_t now)
+{
+	uint16_t step;
+
+	for (;;) {
+		if ((int32_t)(now - kbd_context.macro_resume) < 0) {
+			return;
+		}
+		if (kbd_context.macro_left == 0) {
+			/* Put the host back in sync with the sticky mods. */
+			kbd_context.macro = NULL;
+			send_kbd_report(HID_KEY_NONE);
+			return;
+		}
+		step = *kbd_context.macro++;
+		kbd_context.macro_left--;
+
+		if (MACRO_DELAY_P(step)) {
+			kbd_context.macro_resume = now + MACRO_DELAY_MS(step);
+			continue;
+		}
+
+		/* Macro steps are complete reports; no sticky mods. */
+		kbd_report(keymod_to_hid(step), M_HIDKEY(step));
+		return;
+	}
+}
+
+/*
+ * Characters that the keymap can't type are entered using the host's
+ * Unicode input method, if one has been selected.
+ */
+static bool
+kbd_unicode_start(uint8_t c)
+{
+	uint32_t cp;
+
+	if (settings.unicode_mode == UNICODE_OFF ||
+	    (cp = unicode_codepoint(c)) == 0) {
+		return false;
+	}
+	debug_printf("DEBUG: %s: 0x%02x -> U+%04X (%s)\n", __func__, c, cp,
+	    unicode_mode_name(settings.unicode_mode));
+	unicode_start(&kbd_context.unicode, settings.unicode_mode, cp);
+	return true;
+}
+
+/*
+ * Feed the next chunk of the Unicode entry sequence to the sequencer.
+ */
+static void
+kbd_unicode_step(void)
+{
+	uint16_t code;
+
+	if (! unicode_next(&kbd_context.unicode, kbd_keymap,
+			   &kbd_context.seq)) {
+		return;
+	}
+	code = kbd_context.seq.codes[0];
+	if (code != 0 && (code & M_ENDSEQ) == 0) {
+		kbd_context.next = &kbd_context.seq.codes[1];
+	}
+	send_kbd_report(code);
+}
+
+/*
+ * Abandon the macro in progress (because the macros are being
+ * replaced); we still send the final re-sync report.
+ */
+static void
+kbd_macro_cancel(void)
+{
+	kbd_context.macro_left = 0;
+}
+
+/*
+ * Link-quality monitor (see link_monitor.c), exported using the "link"
+ * config object.  The reader stamps each PING as it arrives; intervals
+ * are measured between those stamps, so they don't include queueing
+ * delay.
+ */
+#define	LINK_WARN_SCORE		60
+#define	LINK_OK_SCORE		80
+
+static struct link_monitor link_monitor;
+static volatile uint32_t link_ping_rx_us;	/* set by the reader */
+static bool link_warned;
+
+/*
+ * Called from the data processing task for each PING.
+ */
+static void
+kbd_link_ping(void)
+{
+	const struct link_stats *ls = &link_monitor.stats;
+
+	link_ping(&link_monitor, link_ping_rx_us, counters.uart_errors);
+
+	if (! link_warned && ls->score < LINK_WARN_SCORE) {
+		printf("[%10u] WARNING: keyboard link degrading (score %u, "
+		    "%u missed, jitter %u us).\n", board_millis(),
+		    ls->score, ls->missed, ls->jitter_us);
+		link_warned = true;
+	} else if (link_warned && ls->score >= LINK_OK_SCORE) {
+		printf("[%10u] INFO: keyboard link recovered (score %u).\n",
+		    board_millis(), ls->score);
+		link_warned = false;
+	}
+}
+
+/*
+ * The reader thread updates this timestamp each time it gets a
+ * byte from the keyboard.
+ */
+static volatile uint32_t last_kbd_message_time;	/* in milliseconds */
+static bool kbd_powerstate;
+
+/*
+ * ...and sets this if it receives a break, which is what a keyboard
+ * that has lost power or been unplugged tends to look like.
+ */
+static volatile bool kbd_rx_break;
+
+static void
+kbd_setpower(bool enabled)
+{
+	kbd_powerstate = enabled;
+	gpio_put(PWREN_PIN, enabled);
 	if (! enabled) {
 		have_nabu = false;
+		link_restart(&link_monitor);
 		led_select_sequence();
 	}
 }
 
-static void
-kbd_reboot(void)
-{
-	/* Power down the keyboard. */
-	kbd_setpower(false);
+/*
+ * Rebooting the keyboard means cycling its power, with the power off
+ * long enough for it to really reset.  This is done by a state machine
+ * driven from the main loop, so that we keep servicing USB (and
+ * blinking the LED) while it happens.
+ */
+#define	KBD_REBOOT_OFF_MS	4000
+#define	KBD_REBOOT_AWAIT_MS	5000
 
-	/* Wait for 4 seconds. */
-	sleep_ms(4000);
+enum {
+	KBD_REBOOT_IDLE		= 0,
+	KBD_REBOOT_OFF		= 1,	/* powered off, waiting */
+	KBD_REBOOT_AWAIT	= 2,	/* powered on, waiting for RESET */
+};
+
+static struct {
+	int state;
+} kbd_reboot_context;
 
-	/* Reset all of the queues. */
+static void
+kbd_reboot_drain(void)
+{
 	queue_drain(&kbd_context.queue);
 	queue_drain(&joy_context[0].queue);
 	queue_drain(&joy_context[1].queue);
+#if HID_COMPOSITE
+	queue_drain(&hid_order);
+#endif
+}
 
-	/*
-	 * Pretend we got a message while we wait for the power-up
-	 * packet.
-	 */
-	last_kbd_message_time = board_millis();
+static void
+kbd_reboot(void)
+{
+	if (kbd_reboot_context.state == KBD_REBOOT_OFF) {
+		/* Already on it. */
+		return;
+	}
+
+	counters.reboots++;
+
+	/* Power down the keyboard. */
+	kbd_setpower(false);
+
+	/* Anything we have from it now is suspect. */
+	kbd_reboot_drain();
 
 	/*
-	 * hid_task() will see these later and rectify any zombie state
+	 * hid_task() will see these and rectify any zombie state
 	 * the host has.
 	 */
 	kbd_context.zombie =
 	    joy_context[0].zombie = joy_context[1].zombie = true;
 
-	/* Power up the keyboard. */
-	kbd_setpower(true);
+	kbd_reboot_context.state = KBD_REBOOT_OFF;
+	TRACE(TRACE_EV_REBOOT, KBD_REBOOT_OFF);
+	timer_oneshot(TIMER_EV_REBOOT, KBD_REBOOT_OFF_MS * 1000);
+}
+
+static void
+kbd_reboot_task(uint32_t now)
+{
+	switch (kbd_reboot_context.state) {
+	case KBD_REBOOT_OFF:
+		/* Toss any noise we picked up while it was off. */
+		kbd_reboot_drain();
+
+		/*
+		 * Pretend we got a message while we wait for the power-up
+		 * packet.
+		 */
+		last_kbd_message_time = now;
+
+		if (suspended && !want_remote_wakeup) {
+			/* tud_resume_cb() will power it up. */
+			kbd_reboot_context.state = KBD_REBOOT_IDLE;
+			break;
+		}
+
+		/* Power up the keyboard. */
+		kbd_setpower(true);
+		kbd_reboot_context.state = KBD_REBOOT_AWAIT;
+		timer_oneshot(TIMER_EV_REBOOT, KBD_REBOOT_AWAIT_MS * 1000);
+		break;
+
+	case KBD_REBOOT_AWAIT:
+		if (have_nabu) {
+			printf("[%10u] INFO: keyboard is back after reboot.\n",
+			    board_millis());
+		} else {
+			/* Deadcheck will keep an eye on it. */
+			printf("[%10u] WARNING: no RESET from keyboard after "
+			    "reboot.\n", board_millis());
+		}
+		kbd_reboot_context.state = KBD_REBOOT_IDLE;
+		break;
+
+	default:
+		return;
+	}
+	TRACE(TRACE_EV_REBOOT, kbd_reboot_context.state);
 }
 
-#define	DEADCHECK_WARN_MS	5000
-#define	DEADCHECK_DECLARE_MS	10000
+/*
+ * The deadcheck thresholds come from the link monitor, once it has
+ * learned the keyboard's PING period; see link_monitor.h.
+ */
+static bool deadcheck_break_pending;
+
+/*
+ * The reader saw a break.  A glitch on the line can cause one of those,
+ * too, so give it a moment and then see if the line is still stuck.
+ */
+static void
+kbd_deadcheck_break(void)
+{
+	kbd_rx_break = false;
+	if (have_nabu && kbd_powerstate && !deadcheck_break_pending) {
+		deadcheck_break_pending = true;
+		timer_oneshot(TIMER_EV_DEADCHECK, DEADCHECK_BREAK_MS * 1000);
+	}
+}
 
 static void
 kbd_deadcheck(uint32_t now)
 {
 	static bool deadcheck_warned;
+	uint32_t next;
+	bool brk;
+	int verdict;
 
-	if (now - last_kbd_message_time < DEADCHECK_WARN_MS) {
+	/* If the reader saw a break, is the line still stuck there? */
+	brk = deadcheck_break_pending && !gpio_get(UART1_RX_PIN);
+	deadcheck_break_pending = false;
+
+	verdict = link_deadcheck(&link_monitor, now - last_kbd_message_time,
+	    brk, &next);
+	if (verdict == LINK_ALIVE) {
 		deadcheck_warned = false;
-		return;
+		goto out;
 	}
 
 	/*
@@ -872,272 +1687,1444 @@ kbd_deadcheck(uint32_t now)
 	if (!have_nabu || !kbd_powerstate) {
 		/* Suppress for another deadcheck interval. */
 		last_kbd_message_time = now;
+		link_deadcheck(&link_monitor, 0, false, &next);
 		printf("[%10u] INFO: waiting for keyboard.\n", board_millis());
-		return;
+		goto out;
 	}
 
-	if (now - last_kbd_message_time < DEADCHECK_DECLARE_MS) {
+	if (verdict == LINK_LATE) {
 		if (! deadcheck_warned) {
 			printf("[%10u] WARNING: keyboard failed to ping.\n",
 			    board_millis());
 			deadcheck_warned = true;
 		}
-		return;
+		goto out;
+	}
+
+	/* Declare the keyboard dead and reboot it. */
+	if (brk) {
+		printf("[%10u] ERROR: keyboard line is in break, "
+		    "rebooting...\n", board_millis());
+	} else {
+		printf("[%10u] ERROR: keyboard appears dead, rebooting...\n",
+		    board_millis());
 	}
+	kbd_reboot();
+	deadcheck_warned = false;
+
+ out:
+	/* Check again when the verdict could change. */
+	timer_oneshot(TIMER_EV_DEADCHECK, next * 1000);
+}
+
+static bool
+kbd_err_task(uint8_t c)
+{
+	TRACE(TRACE_EV_KBD_ERR, c);
+
+	switch (c) {
+	case NABU_CODE_ERR_MKEY:
+		printf("[%10u] INFO: multi-keypress, sending HID_KEY_NONE.\n",
+		    board_millis());
+		send_kbd_report(HID_KEY_NONE);
+		return false;
+
+	case NABU_CODE_ERR_RAM:
+		printf("[%10u] ERROR: keyboard RAM error, rebooting...\n",
+		     board_millis());
+		counters.kbd_errors++;
+		break;
+
+	case NABU_CODE_ERR_ROM:
+		printf("[%10u] ERROR: keyboard ROM error, rebooting...\n",
+		     board_millis());
+		counters.kbd_errors++;
+		break;
+
+	case NABU_CODE_ERR_ISR:
+		printf("[%10u] ERROR: keyboard ISR error, rebooting...\n",
+		     board_millis());
+		counters.kbd_errors++;
+		break;
+
+	case NABU_CODE_ERR_PING:
+		counters.pings++;
+		kbd_link_ping();
+		have_nabu = true;
+		led_select_sequence();
+		debug_printf("DEBUG: %s: received PING from keyboard.\n",
+		    __func__);
+		return false;
+
+	case NABU_CODE_ERR_RESET:
+		/* Keyboard has announced itself! */
+		counters.resets++;
+		link_restart(&link_monitor);
+		have_nabu = true;
+		led_select_sequence();
+		printf(
+		    "[%10u] INFO: received RESET notification from keyboard.\n",
+		    board_millis());
+		return false;
+
+	default:
+		/* This won't ever happen; just ignore. */
+		return false;
+	}
+
+	/* If we got here, we're rebooting the keyboard. */
+	kbd_reboot();
+	return true;
+}
+
+#define	REPORT_INTERVAL_MS	10	/* keymapc --interval in CMakeLists.txt */
+
+/*
+ * Take the next byte from the keyboard queue.
+ */
+static bool
+kbd_queue_get(uint8_t *cp)
+{
+	if (! queue_get(&kbd_context.queue, cp)) {
+		return false;
+	}
+	TRACE(TRACE_EV_DEQUEUE, *cp);
+	lat_dequeued(LAT_SRC_KBD, kbd_context.queue.cons_stamp);
+	hid_order_remove(HID_SRC_KBD);
+	return true;
+}
+
+/*
+ * Get the next key to process.  The key that woke the host goes first.
+ */
+static bool
+kbd_dequeue(uint8_t *cp)
+{
+	if (kbd_context.have_wake_key) {
+		kbd_context.have_wake_key = false;
+		*cp = kbd_context.wake_key;
+		return true;
+	}
+	return kbd_queue_get(cp);
+}
+
+/*
+ * Data processing while the host is suspended.  Keyboard errors
+ * (including the pings) are handled as usual.  The first key pressed
+ * is pulled out of the queue and held until the host resumes, so that
+ * it's the first thing the host sees and errors behind it can still be
+ * processed.  Joystick samples are coalesced down to the newest one;
+ * the sticks only report changes, so the newest sample is where the
+ * stick is now and the rest are just stale.
+ */
+static void
+hid_suspended_task(uint32_t now)
+{
+	uint8_t c;
+
+	if (queue_peek(&kbd_context.queue, &c) &&
+	    NABU_CODE_ERR_P(c) &&
+	    c != NABU_CODE_ERR_MKEY /* this is a key-press */) {
+		kbd_queue_get(&c);
+		kbd_err_task(c);
+		return;
+	}
+
+	if (! kbd_context.have_wake_key && kbd_queue_get(&c)) {
+		debug_printf("DEBUG: %s: holding wake key 0x%02x\n",
+		    __func__, c);
+		kbd_context.wake_key = c;
+		kbd_context.have_wake_key = true;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		while (queue_get(&joy_context[i].queue, &c)) {
+			hid_order_remove(HID_SRC_JOY0 + i);
+			if (joy_context[i].have_wake_sample) {
+				counters.reports_suppressed++;
+			}
+			joy_context[i].wake_sample = c;
+			joy_context[i].have_wake_sample = true;
+		}
+	}
+
+	if (want_remote_wakeup &&
+	    (! wake_context.requested ||
+	     now - wake_context.request_ms >= WAKE_RETRY_MS)) {
+		if (! wake_context.requested) {
+			wake_context.start_us = time_us_32();
+			wake_context.requested = true;
+		}
+		wake_context.request_ms = now;
+		tud_remote_wakeup();
+	}
+}
+
+static void	hid_kbd_task(uint32_t);
+static void	hid_joy_task(int);
+#if HID_COMPOSITE
+static void	hid_composite_task(uint32_t);
+#endif
+
+#define	REPORT_INTERVAL_US	(REPORT_INTERVAL_MS * 1000)
+
+/*
+ * Check if it's time to run the data processing task: each report
+ * interval tick, or just before the host's next poll if we're aligning
+ * to SOF and know when that is.  The tick only runs while there's work
+ * to do, and for one more interval after that (see hid_task()).  When
+ * it's stopped, new work can go out right away, since the last report
+ * was at least one interval ago.
+ */
+static bool
+hid_task_due(bool tick)
+{
+	if (hid_kick) {
+		hid_kick = false;
+		return true;
+	}
+
+#if HID_SOF_ALIGN
+	if (sof_context.period != 0) {
+		if (! sof_context.due) {
+			return false;
+		}
+		sof_context.due = false;
+		return true;
+	}
+#endif
+
+	return tick || !timer_armed_p(TIMER_EV_HID);
+}
+
+static void
+hid_task(uint32_t now, bool tick)
+{
+	bool due = hid_task_due(tick);
+
+	/*
+	 * Quick unlocked queue-empty checks to see if there's
+	 * work to do.  If there is, keep the tick running.
+	 */
+	if (kbd_has_data_unlocked() ||
+	    joy_has_data_unlocked(0) || joy_has_data_unlocked(1)) {
+		if (! timer_armed_p(TIMER_EV_HID)) {
+			timer_periodic(TIMER_EV_HID, REPORT_INTERVAL_US);
+		}
+		if (! due) {
+			return;
+		}
+		debug_printf("DEBUG: %s: have work to do (k=%d j0=%d j1=%d)\n",
+		    __func__, kbd_has_data_unlocked(),
+		    joy_has_data_unlocked(0), joy_has_data_unlocked(1));
+	} else {
+		/*
+		 * No data to send.  Stop the tick, but only once it's
+		 * gone a whole interval without any, so that the next
+		 * byte can't go out less than an interval after the
+		 * last report.
+		 */
+		if (tick) {
+			timer_cancel(TIMER_EV_HID);
+		}
+		return;
+	}
+
+	/*
+	 * We have at least one report to send.  If we're suspended,
+	 * wake up the host.  We'll send the report as soon as it
+	 * resumes.
+	 */
+	if (tud_suspended()) {
+		hid_suspended_task(now);
+		return;
+	}
+
+#if HID_COMPOSITE
+	if (tud_hid_n_ready(ITF_NUM_KBD)) {
+		hid_composite_task(now);
+	}
+#else
+	if (tud_hid_n_ready(ITF_NUM_KBD)) {
+		hid_kbd_task(now);
+	}
+
+	/* Now do the joysticks. */
+	for (int i = 0; i < 2; i++) {
+		if (tud_hid_n_ready(ITF_NUM_JOY0 + i)) {
+			hid_joy_task(i);
+		}
+	}
+#endif
+}
+
+/*
+ * Keyboard part of the data processing task.  Called when the keyboard
+ * report can be sent.
+ */
+static void
+hid_kbd_task(uint32_t now)
+{
+	uint16_t code;
+	uint8_t c;
+
+	if (kbd_context.next != NULL) {
+		code = *kbd_context.next++;
+		if (code == 0 || (code & M_ENDSEQ) != 0) {
+			/* Last code in the sequence. */
+			kbd_context.next = NULL;
+		}
+		debug_printf("DEBUG: %s: next in sequence: 0x%04x\n",
+		    __func__, code);
+		send_kbd_report(code);
+	} else if (kbd_context.macro != NULL) {
+		kbd_macro_step(now);
+	} else if (kbd_context.unicode.cp != 0) {
+		kbd_unicode_step();
+	} else if (kbd_context.zombie) {
+		/*
+		 * We let any outstanding sequence complete, but
+		 * we do one more key-up event in case there is
+		 * other state latched by the host.
+		 */
+		debug_printf("DEBUG: %s: clearing zombie state.\n",
+		    __func__);
+		kbd_context.zombie = false;
+		kbd_context.modifiers = 0;
+		kbd_context.layer = 0;
+		kbd_context.layer_pending = 0;
+		stuck_keys_init(&kbd_context.stuck);
+		counters.zombie_clears++;
+		send_kbd_report(HID_KEY_NONE);
+	} else if (kbd_dequeue(&c)) {
+		const uint16_t *sequence;
+		unsigned int layer;
+
+		kbd_stuck_track(c, now);
+
+		/* Expand it, in case the keymap is replaced under us. */
+		layer = keymap_expand(kbd_keymap,
+		    kbd_context.layer & kbd_layer_keys, c,
+		    &kbd_context.seq);
+		sequence = kbd_context.seq.codes;
+		code = sequence[0];
+
+		if (NABU_CODE_ERR_P(c)) {
+			if (kbd_err_task(c)) {
+				/* Error message already displayed. */
+				return;
+			}
+		} else if (kbd_layer_key(c)) {
+			/* Held back, or tapped. */
+		} else if (kbd_macro_start(c, now)) {
+			kbd_macro_step(now);
+		} else if (code == 0 && kbd_unicode_start(c)) {
+			kbd_unicode_step();
+		} else if (code != 0) {
+			debug_printf(
+			    "DEBUG: %s: got 0x%02x (layer %u)\n",
+			    __func__, c, layer);
+			if (layer != 0) {
+				kbd_context.layer_used |= layer;
+			} else {
+				kbd_layer_commit();
+			}
+			/* UP/DOWN keys don't use a sequence. */
+			if (code & M_DOWN) {
+				debug_printf("DEBUG: %s: code 0x%04x\n",
+				    __func__, code);
+				if (M_HIDKEY(code) == HID_KEY_NONE) {
+					/* Sticky modifier. */
+					code = kbd_modifier(code);
+				}
+			} else if (code & M_UP) {
+				debug_printf("DEBUG: %s: key-up\n",
+				    __func__);
+				if (M_HIDKEY(code) == HID_KEY_NONE) {
+					/* Sticky modifier. */
+					code = kbd_modifier(code);
+				} else {
+					code = HID_KEY_NONE;
+				}
+			} else {
+				debug_printf(
+				    "DEBUG: %s: first code 0x%04x\n",
+				    __func__, code);
+				if ((code & M_ENDSEQ) == 0) {
+					kbd_context.next = &sequence[1];
+				}
+			}
+			send_kbd_report(code);
+		} else {
+			debug_printf("DEBUG: %s: ignoring 0x%02x\n",
+			    __func__, c);
+		}
+	}
+}
+
+/*
+ * Joystick part of the data processing task.  Called when the joystick
+ * report can be sent.
+ */
+static void
+hid_joy_task(int i)
+{
+	uint8_t c;
+
+	if (joy_context[i].zombie) {
+		send_joy_report(i, 0);
+		joy_context[i].zombie = false;
+		counters.zombie_clears++;
+	} else if (joy_context[i].have_wake_sample) {
+		send_joy_report(i, joy_context[i].wake_sample);
+		joy_context[i].have_wake_sample = false;
+	} else if (queue_get(&joy_context[i].queue, &c)) {
+		hid_order_remove(HID_SRC_JOY0 + i);
+		TRACE(TRACE_EV_DEQUEUE, c);
+		lat_dequeued(LAT_SRC_JOY0 + i, joy_context[i].queue.cons_stamp);
+		send_joy_report(i, c);
+	}
+}
+
+#if HID_COMPOSITE
+/*
+ * With a single interface, we can only send one report per interval;
+ * hid_sched_pick() decides which.  While a keyboard sequence, macro or
+ * Unicode entry is in progress, joystick reports take turns with it
+ * rather than waiting behind it.
+ */
+static void
+hid_composite_task(uint32_t now)
+{
+	uint8_t head, src;
+	bool busy;
+
+	/* Clearing state after a keyboard reset goes first. */
+	for (int i = 0; i < 2; i++) {
+		if (joy_context[i].zombie) {
+			hid_joy_task(i);
+			return;
+		}
+	}
+
+	/* So does the key that woke the host. */
+	if (kbd_context.have_wake_key) {
+		hid_kbd_task(now);
+		return;
+	}
+
+	if (! queue_peek(&hid_order, &head)) {
+		head = HID_SRC_NONE;
+	}
+	busy = kbd_context.next != NULL || kbd_context.macro != NULL ||
+	    kbd_context.unicode.cp != 0;
+
+	/* hid_joy_task() takes the order entry along with the byte. */
+	src = hid_sched_pick(&hid_sched, head, hid_order_first_joy(), busy);
+	if (src != HID_SRC_KBD) {
+		hid_joy_task(src - HID_SRC_JOY0);
+		return;
+	}
+
+	hid_kbd_task(now);
+
+	/*
+	 * If the keyboard had nothing to send (or the order queue
+	 * overflowed), give the joysticks a chance.
+	 */
+	for (int i = 0; i < 2 && tud_hid_n_ready(ITF_NUM_KBD); i++) {
+		hid_joy_task(i);
+	}
+}
+#endif
+
+/*
+ * Clock governor.  When there's been nothing to do for a little while,
+ * we run clk_sys from the 48MHz USB PLL instead of the system PLL, and
+ * switch back as soon as a byte arrives from the keyboard or the USB
+ * stack has something for us.  The switch is glitchless and takes a
+ * few microseconds.
+ *
+ * clk_peri is moved to the USB PLL at startup, before the UARTs are
+ * set up, so the baud rate divisors are right at either speed.  The
+ * timer runs off clk_ref, so it's unaffected, too.
+ */
+#ifndef CLOCK_GOVERNOR
+#define	CLOCK_GOVERNOR		1
+#endif
+
+#if CLOCK_GOVERNOR
+#define	GOV_IDLE_MS		100
+#define	GOV_SLOW_HZ		(48 * MHZ)
+
+enum {
+	GOV_FAST		= 0,
+	GOV_SLOW		= 1,
+	GOV_NSTATES
+};
+
+static struct {
+	int state;
+	uint32_t fast_hz;	/* clk_sys as configured at startup */
+	uint32_t since_us;	/* when we entered this state */
+	uint32_t active_us;	/* when we last had something to do */
+	bool parked;		/* held slow with the system PLL off */
+} gov_context;
+
+static struct {
+	uint32_t residency_us[GOV_NSTATES];
+	uint32_t boosts;
+	uint32_t boost_us;	/* total wake-to-full-speed time */
+	uint32_t boost_max_us;
+} gov_stats;
+
+static void
+gov_init(void)
+{
+	clock_configure(clk_peri, 0,
+	    CLOCKS_CLK_PERI_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB,
+	    GOV_SLOW_HZ, GOV_SLOW_HZ);
+
+	gov_context.state = GOV_FAST;
+	gov_context.fast_hz = clock_get_hz(clk_sys);
+	gov_context.since_us = gov_context.active_us = time_us_32();
+}
+
+static void
+gov_account(uint32_t t)
+{
+	gov_stats.residency_us[gov_context.state] +=
+	    t - gov_context.since_us;
+	gov_context.since_us = t;
+}
+
+static void
+gov_set(int state)
+{
+	gov_account(time_us_32());
+
+	if (state == GOV_FAST) {
+		clock_configure(clk_sys,
+		    CLOCKS_CLK_SYS_CTRL_SRC_VALUE_CLKSRC_CLK_SYS_AUX,
+		    CLOCKS_CLK_SYS_CTRL_AUXSRC_VALUE_CLKSRC_PLL_SYS,
+		    gov_context.fast_hz, gov_context.fast_hz);
+	} else {
+		clock_configure(clk_sys,
+		    CLOCKS_CLK_SYS_CTRL_SRC_VALUE_CLKSRC_CLK_SYS_AUX,
+		    CLOCKS_CLK_SYS_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB,
+		    GOV_SLOW_HZ, GOV_SLOW_HZ);
+	}
+	gov_context.state = state;
+}
+
+/*
+ * Called at the top of each pass through the main loop.  If there's
+ * work waiting, make sure we're at full speed.
+ */
+static void
+gov_task(uint32_t events)
+{
+	uint32_t t, lat;
+
+	if (gov_context.parked) {
+		return;
+	}
+
+	if (! (kbd_has_data_unlocked() ||
+	       joy_has_data_unlocked(0) || joy_has_data_unlocked(1) ||
+	       tud_task_event_ready() || hid_kick)) {
+		/* Throttle down once we've been idle long enough. */
+		if (gov_context.state == GOV_SLOW) {
+			return;
+		}
+		t = time_us_32() - gov_context.active_us;
+		if (t >= GOV_IDLE_MS * 1000) {
+			gov_set(GOV_SLOW);
+		} else if ((events & TIMER_EVENT(TIMER_EV_GOV)) != 0 ||
+			   ! timer_armed_p(TIMER_EV_GOV)) {
+			timer_oneshot(TIMER_EV_GOV, GOV_IDLE_MS * 1000 - t);
+		}
+		return;
+	}
+
+	gov_context.active_us = time_us_32();
+	if (gov_context.state == GOV_SLOW) {
+		gov_set(GOV_FAST);
+		lat = time_us_32() - (loop_context.woke ?
+		    loop_context.woke_us : gov_context.active_us);
+		gov_stats.boosts++;
+		gov_stats.boost_us += lat;
+		if (lat > gov_stats.boost_max_us) {
+			gov_stats.boost_max_us = lat;
+		}
+	}
+	if (! timer_armed_p(TIMER_EV_GOV)) {
+		timer_oneshot(TIMER_EV_GOV, GOV_IDLE_MS * 1000);
+	}
+}
+
+/*
+ * Hold the system clock at the slow speed and power down the system
+ * PLL, or undo that.  The PLL keeps its dividers while it's powered
+ * down, so bringing it back is just a matter of waiting for lock.
+ */
+static void
+gov_park(bool park)
+{
+	if (park == gov_context.parked) {
+		return;
+	}
+	if (park) {
+		if (gov_context.state != GOV_SLOW) {
+			gov_set(GOV_SLOW);
+		}
+		pll_deinit(pll_sys);
+	} else {
+		hw_clear_bits(&pll_sys_hw->pwr,
+		    PLL_PWR_PD_BITS | PLL_PWR_VCOPD_BITS);
+		while ((pll_sys_hw->cs & PLL_CS_LOCK_BITS) == 0) {
+			tight_loop_contents();
+		}
+		hw_clear_bits(&pll_sys_hw->pwr, PLL_PWR_POSTDIVPD_BITS);
+	}
+	gov_context.parked = park;
+}
+
+static void
+gov_stats_print(void)
+{
+	uint32_t fast, slow, total;
+
+	gov_account(time_us_32());
+	fast = gov_stats.residency_us[GOV_FAST] / 1000;
+	slow = gov_stats.residency_us[GOV_SLOW] / 1000;
+	if ((total = fast + slow) == 0) {
+		total = 1;
+	}
+	debug_printf("DEBUG: %s: %u MHz %u%%, %u MHz %u%%, %u boosts, "
+	    "boost avg %u us max %u us\n", __func__,
+	    gov_context.fast_hz / MHZ, fast * 100 / total,
+	    GOV_SLOW_HZ / MHZ, slow * 100 / total, gov_stats.boosts,
+	    gov_stats.boosts != 0 ? gov_stats.boost_us / gov_stats.boosts : 0,
+	    gov_stats.boost_max_us);
+	memset(&gov_stats, 0, sizeof(gov_stats));
+}
+#else
+#define	gov_init()		do { } while (/*CONSTCOND*/0)
+#define	gov_task(e)		do { } while (/*CONSTCOND*/0)
+#define	gov_park(p)		do { } while (/*CONSTCOND*/0)
+#define	gov_stats_print()	do { } while (/*CONSTCOND*/0)
+#endif /* CLOCK_GOVERNOR */
+
+/*
+ * While the bus is suspended, we sleep as deeply as we can without
+ * losing the ability to notice the host resuming us.  Dormant mode
+ * would stop clk_usb, so instead both cores sleep with SLEEPDEEP set,
+ * which gates the clocks to the blocks we don't use, and the clock
+ * governor parks the system clock on the USB PLL and powers down the
+ * system PLL.
+ *
+ * Core 1 can't spin on the UART in the meantime, so it waits for the
+ * falling edge of a start bit on the RX pin instead, then polls until
+ * the byte has been shifted in.  The UART is still clocked from the
+ * USB PLL, so the byte comes through intact, and the wake key is
+ * forwarded as usual once the host resumes.
+ */
+#ifndef SUSPEND_SLEEP
+#define	SUSPEND_SLEEP		1
+#endif
+
+#if SUSPEND_SLEEP
+/* 1 start + 8 data + 1 stop bits at 6992 baud is ~1.43ms. */
+#define	KBD_RX_CHAR_US		1430
+
+#define	SUSPEND_SLEEP_GATED						\
+	(CLOCKS_SLEEP_EN0_CLK_ADC_ADC_BITS |				\
+	 CLOCKS_SLEEP_EN0_CLK_SYS_ADC_BITS |				\
+	 CLOCKS_SLEEP_EN0_CLK_SYS_I2C0_BITS |				\
+	 CLOCKS_SLEEP_EN0_CLK_SYS_I2C1_BITS |				\
+	 CLOCKS_SLEEP_EN0_CLK_SYS_JTAG_BITS |				\
+	 CLOCKS_SLEEP_EN0_CLK_SYS_PIO0_BITS |				\
+	 CLOCKS_SLEEP_EN0_CLK_SYS_PIO1_BITS |				\
+	 CLOCKS_SLEEP_EN0_CLK_SYS_PWM_BITS |				\
+	 CLOCKS_SLEEP_EN0_CLK_RTC_RTC_BITS |				\
+	 CLOCKS_SLEEP_EN0_CLK_SYS_RTC_BITS |				\
+	 CLOCKS_SLEEP_EN0_CLK_PERI_SPI0_BITS |				\
+	 CLOCKS_SLEEP_EN0_CLK_SYS_SPI0_BITS |				\
+	 CLOCKS_SLEEP_EN0_CLK_PERI_SPI1_BITS |				\
+	 CLOCKS_SLEEP_EN0_CLK_SYS_SPI1_BITS)
+
+static volatile bool kbd_rx_sleep;	/* Core 1 waits for RX edges */
+static bool suspend_sleeping;
+static uint32_t suspend_sleep_en0;
+
+static void
+suspend_sleep_enter(void)
+{
+	if (suspend_sleeping) {
+		return;
+	}
+	debug_printf("DEBUG: %s: entering suspend sleep\n", __func__);
+	suspend_sleeping = true;
+
+	gov_park(true);
+	suspend_sleep_en0 = clocks_hw->sleep_en0;
+	clocks_hw->sleep_en0 = suspend_sleep_en0 & ~SUSPEND_SLEEP_GATED;
+	scb_hw->scr |= M0PLUS_SCR_SLEEPDEEP_BITS;
+	kbd_rx_sleep = true;
+}
+
+static void
+suspend_sleep_exit(void)
+{
+	if (! suspend_sleeping) {
+		return;
+	}
+	suspend_sleeping = false;
+
+	kbd_rx_sleep = false;
+	scb_hw->scr &= ~M0PLUS_SCR_SLEEPDEEP_BITS;
+	clocks_hw->sleep_en0 = suspend_sleep_en0;
+	gov_park(false);
+	debug_printf("DEBUG: %s: left suspend sleep\n", __func__);
+}
+
+/*
+ * Runs on Core 1: sleep until a byte from the keyboard starts to come
+ * in, and then wait for the rest of it.  The RX pin's edge interrupt
+ * is enabled for Core 1 but not in its NVIC; with SEVONPEND, it going
+ * pending is enough to wake us from WFE.
+ */
+static void
+kbd_rx_wait(void)
+{
+	uint32_t start;
+
+	gpio_acknowledge_irq(UART1_RX_PIN, GPIO_IRQ_EDGE_FALL);
+	irq_clear(IO_IRQ_BANK0);
+	if (uart_is_readable(uart1)) {
+		return;
+	}
+
+	scb_hw->scr |= M0PLUS_SCR_SLEEPDEEP_BITS;
+	__wfe();
+	scb_hw->scr &= ~M0PLUS_SCR_SLEEPDEEP_BITS;
+
+	start = time_us_32();
+	while (! uart_is_readable(uart1) &&
+	       time_us_32() - start < KBD_RX_CHAR_US * 2) {
+		tight_loop_contents();
+	}
+}
+#else
+#define	suspend_sleep_enter()	do { } while (/*CONSTCOND*/0)
+#define	suspend_sleep_exit()	do { } while (/*CONSTCOND*/0)
+#endif /* SUSPEND_SLEEP */
+
+/*
+ * Print the main loop stats now and then, if debugging.
+ */
+static void
+loop_stats_task(uint32_t now)
+{
+	uint32_t window_ms = now - loop_stats.start_ms;
+	uint32_t permille;
+
+	if (window_ms == 0) {
+		return;
+	}
+
+	permille = loop_stats.sleep_us / window_ms;
+	debug_printf("DEBUG: %s: asleep %u.%u%%, %u wakes, "
+	    "wake-to-report avg %u us max %u us\n", __func__,
+	    permille / 10, permille % 10, loop_stats.wakes,
+	    loop_stats.reports != 0 ?
+	    loop_stats.wake_report_us / loop_stats.reports : 0,
+	    loop_stats.wake_report_max_us);
+	memset(&loop_stats, 0, sizeof(loop_stats));
+	loop_stats.start_ms = now;
+
+	gov_stats_print();
+}
+
+/*
+ * Sleep until there's something to do.  Interrupts that happen after
+ * the tasks have run, but before we get to the WFE, set the event
+ * register (SEVONPEND), so we don't miss them.  That includes the
+ * timer alarms.
+ */
+static void
+loop_sleep(void)
+{
+	loop_context.woke = false;
+
+	if (timer_events_pending_p() || hid_kick || kbd_rx_break) {
+		return;
+	}
+#if HID_SOF_ALIGN
+	if (sof_context.due) {
+		return;
+	}
+#endif
+
+#if MAIN_LOOP_WFE
+	uint32_t t0 = time_us_32();
+	__wfe();
+	uint32_t t1 = time_us_32();
+
+	loop_stats.sleep_us += t1 - t0;
+	loop_stats.wakes++;
+	loop_context.woke_us = t1;
+	loop_context.woke = true;
+#endif
+}
+
+/*
+ * Invoked when the device is "mounted".
+ */
+void
+tud_mount_cb(void)
+{
+	suspend_sleep_exit();
+	TRACE(TRACE_EV_MOUNT, 1);
+	mounted = true;
+	led_select_sequence();
+}
+
+/*
+ * Invoked when the device is "unmounted".
+ */
+void
+tud_umount_cb(void)
+{
+	suspend_sleep_exit();
+	TRACE(TRACE_EV_MOUNT, 0);
+	mounted = false;
+#if HID_SOF_ALIGN
+	sof_reset();
+#endif
+	led_select_sequence();
+}
+
+/*
+ * Invoked when the USB bus is suspended.
+ *
+ * remote_wakeup_en indicates if the host allows us to perform a
+ * remote wakeup.
+ *
+ * Within 7ms, we must drop our current draw to less than 2.5mA from
+ * the bus.  Not a problem, since we require an external power source
+ * for the keyboard anyway.  But we do power the keyboard off to make
+ * sure that we don't erroneously wake up the host due to pings or
+ * errors.
+ */
+void
+tud_suspend_cb(bool remote_wakeup_en)
+{
+	TRACE(TRACE_EV_SUSPEND, remote_wakeup_en);
+	want_remote_wakeup = remote_wakeup_en;
+	suspended = true;
+	wake_context.requested = false;
+	wake_context.resumed = false;
+#if HID_SOF_ALIGN
+	sof_reset();
+#endif
+	if (!want_remote_wakeup) {
+		printf(
+		  "[%10u] INFO: Powering down keyboard for suspend request.\n",
+		  board_millis());
+		kbd_setpower(false);
+		if (kbd_reboot_context.state == KBD_REBOOT_AWAIT) {
+			kbd_reboot_context.state = KBD_REBOOT_IDLE;
+		}
+	}
+	led_select_sequence();
+	suspend_sleep_enter();
+}
+
+/*
+ * Invoked when the USB bus is resumed.
+ */
+void
+tud_resume_cb(void)
+{
+	suspend_sleep_exit();
+	TRACE(TRACE_EV_RESUME, 0);
+	suspended = false;
+	if (wake_context.requested) {
+		/* We woke the host; send the key that did it right away. */
+		printf("[%10u] INFO: host resumed %u us after remote wakeup.\n",
+		    board_millis(), time_us_32() - wake_context.start_us);
+		wake_context.requested = false;
+		wake_context.resumed = true;
+		hid_kick = true;
+	}
+	if (!kbd_powerstate && kbd_reboot_context.state != KBD_REBOOT_OFF) {
+		printf(
+		    "[%10u] INFO: Powering up keyboard for resume request.\n",
+		    board_millis());
+		kbd_setpower(true);
+	}
+	led_select_sequence();
+}
+
+/*
+ * The config report is a vendor-defined feature report on the keyboard
+ * interface that lets the host manage the adapter at run-time, without
+ * having to re-enumerate.  Its layout is:
+ *
+ *	byte 0		op (SET_REPORT) / status of last op (GET_REPORT)
+ *	byte 1		object
+ *	bytes 2-3	offset into the object (little-endian)
+ *	bytes 4-35	data
+ *
+ * SET_REPORT performs an operation on an object.  GET_REPORT returns
+ * the next chunk of the selected object and advances the offset, so
+ * an object can be read out by selecting it and then issuing GET_REPORT
+ * until a short chunk comes back.
+ *
+ * Objects are written by uploading the whole thing in order, starting
+ * at offset 0, and then committing it.  Nothing takes effect until the
+ * commit, which validates what was uploaded.
+ */
+#define	CFG_OP_SELECT		1	/* select object / offset to read */
+#define	CFG_OP_WRITE		2	/* write data to staging area */
+#define	CFG_OP_COMMIT		3	/* validate and commit staging area */
+#define	CFG_OP_RESET		4	/* revert object to built-in default */
+
+#define	CFG_STATUS_OK		0
+#define	CFG_STATUS_EINVAL	1	/* bad op, object, or offset */
+#define	CFG_STATUS_EBADDATA	2	/* staged data failed validation */
+#define	CFG_STATUS_EIO		3	/* couldn't write to flash */
+
+#define	CFG_OBJ_KEYMAP		1	/* struct keymap */
+#define	CFG_OBJ_LAYOUT		2	/* host keyboard layout */
+#define	CFG_OBJ_MACROS		3	/* macro blob; see macro.h */
+#define	CFG_OBJ_SETTINGS	4	/* struct settings */
+#define	CFG_OBJ_SOF		5	/* struct sof_stats (read-only) */
+#define	CFG_OBJ_LATENCY		6	/* struct lat_hist (read-only) */
+#define	CFG_OBJ_COUNTERS	7	/* struct counters (read-only) */
+#define	CFG_OBJ_PROFILE		8	/* struct prof_stats (read-only) */
+#define	CFG_OBJ_TRACE		9	/* trace dump (read-only) */
+#define	CFG_OBJ_LINK		10	/* struct link_stats (read-only) */
+
+static size_t
+config_read_blob(const void *blob, size_t bloblen, size_t offset,
+    uint8_t *buf, size_t len)
+{
+	if (offset >= bloblen) {
+		return 0;
+	}
+	if (len > bloblen - offset) {
+		len = bloblen - offset;
+	}
+	memcpy(buf, (const uint8_t *)blob + offset, len);
+	return len;
+}
+
+static size_t
+keymap_read(size_t offset, uint8_t *buf, size_t len)
+{
+	return config_read_blob((const void *)kbd_keymap,
+	    sizeof(struct keymap), offset, buf, len);
+}
+
+static int
+keymap_write(size_t offset, const uint8_t *buf, size_t len)
+{
+	uint8_t *staging = (uint8_t *)&keymap_tables[keymap_active ^ 1];
+
+	if ((offset != 0 && offset != keymap_staged) ||
+	    offset >= sizeof(struct keymap)) {
+		return CFG_STATUS_EINVAL;
+	}
+	if (len > sizeof(struct keymap) - offset) {
+		len = sizeof(struct keymap) - offset;
+	}
+	memcpy(staging + offset, buf, len);
+	keymap_staged = offset + len;
+
+	return CFG_STATUS_OK;
+}
+
+static int
+keymap_commit(void)
+{
+	const struct keymap *staging = &keymap_tables[keymap_active ^ 1];
+
+	if (keymap_staged != sizeof(*staging)) {
+		return CFG_STATUS_EINVAL;
+	}
+	keymap_staged = 0;
+
+	if (! keymap_validate(staging)) {
+		return CFG_STATUS_EBADDATA;
+	}
+	if (! flash_store_save(FLASH_STORE_AREA_KEYMAP, KEYMAP_VERSION,
+			       staging, sizeof(*staging))) {
+		printf("[%10u] ERROR: failed to save keymap to flash.\n",
+		    board_millis());
+		return CFG_STATUS_EIO;
+	}
+	keymap_activate(keymap_active ^ 1);
+	printf("[%10u] INFO: new keymap installed.\n", board_millis());
+
+	return CFG_STATUS_OK;
+}
+
+static int
+keymap_reset(void)
+{
+	keymap_load_default(&keymap_tables[keymap_active ^ 1]);
+	keymap_activate(keymap_active ^ 1);
+	flash_store_erase(FLASH_STORE_AREA_KEYMAP);
+	printf("[%10u] INFO: reverted to built-in keymap.\n", board_millis());
+
+	return CFG_STATUS_OK;
+}
+
+/*
+ * Selecting a host layout generates a keymap for it and installs that
+ * just like an uploaded one.  Reading the layout object returns the
+ * current layout and the number of layouts we know about.
+ */
+static int layout_staged = -1;
+
+static size_t
+layout_read(size_t offset, uint8_t *buf, size_t len)
+{
+	const uint8_t info[2] = { kbd_keymap->layout, LAYOUT_COUNT };
+
+	return config_read_blob(info, sizeof(info), offset, buf, len);
+}
+
+static int
+layout_write(size_t offset, const uint8_t *buf, size_t len)
+{
+	if (offset != 0 || len < 1) {
+		return CFG_STATUS_EINVAL;
+	}
+	layout_staged = buf[0];
+
+	return CFG_STATUS_OK;
+}
+
+static int
+layout_commit(void)
+{
+	struct keymap *staging = &keymap_tables[keymap_active ^ 1];
+	unsigned int layout = layout_staged;
+
+	layout_staged = -1;
+	if (! keymap_build(staging, layout)) {
+		return CFG_STATUS_EINVAL;
+	}
+	if (! flash_store_save(FLASH_STORE_AREA_KEYMAP, KEYMAP_VERSION,
+			       staging, sizeof(*staging))) {
+		printf("[%10u] ERROR: failed to save keymap to flash.\n",
+		    board_millis());
+		return CFG_STATUS_EIO;
+	}
+	keymap_activate(keymap_active ^ 1);
+	printf("[%10u] INFO: switched to %s layout.\n", board_millis(),
+	    keymap_layout_name(layout));
+
+	return CFG_STATUS_OK;
+}
+
+/*
+ * Macros are uploaded into a RAM staging buffer, and only take effect
+ * once they've been validated and written to flash.  Macros in progress
+ * are streamed from flash, so they're cancelled first.
+ */
+static uint8_t macro_staging[FLASH_STORE_MAXLEN];
+static size_t macro_staged;
+
+static int
+macros_write(size_t offset, const uint8_t *buf, size_t len)
+{
+	if ((offset != 0 && offset != macro_staged) ||
+	    offset >= sizeof(macro_staging)) {
+		return CFG_STATUS_EINVAL;
+	}
+	if (len > sizeof(macro_staging) - offset) {
+		len = sizeof(macro_staging) - offset;
+	}
+	memcpy(macro_staging + offset, buf, len);
+	macro_staged = offset + len;
+
+	return CFG_STATUS_OK;
+}
+
+static int
+macros_commit(void)
+{
+	const struct macro_hdr *hdr = (const void *)macro_staging;
+	size_t len;
+
+	/* The last chunk is padded out; trim it to the real size. */
+	if (macro_staged < sizeof(*hdr)) {
+		return CFG_STATUS_EINVAL;
+	}
+	len = sizeof(*hdr) + (hdr->nmacros * sizeof(struct macro_def)) +
+	    (hdr->nsteps * sizeof(uint16_t));
+	if (len > macro_staged) {
+		return CFG_STATUS_EINVAL;
+	}
+	macro_staged = 0;
+
+	if (! macro_validate(macro_staging, len)) {
+		return CFG_STATUS_EBADDATA;
+	}
+
+	kbd_macro_cancel();
+	macro_install(NULL);
+	if (! flash_store_save(FLASH_STORE_AREA_MACROS, MACRO_VERSION,
+			       macro_staging, len)) {
+		printf("[%10u] ERROR: failed to save macros to flash.\n",
+		    board_millis());
+		macro_init();
+		return CFG_STATUS_EIO;
+	}
+	macro_init();
+	printf("[%10u] INFO: new macros installed.\n", board_millis());
+
+	return CFG_STATUS_OK;
+}
+
+static int
+macros_reset(void)
+{
+	kbd_macro_cancel();
+	macro_install(NULL);
+	flash_store_erase(FLASH_STORE_AREA_MACROS);
+	macro_staged = 0;
+	printf("[%10u] INFO: macros removed.\n", board_millis());
+
+	return CFG_STATUS_OK;
+}
+
+static struct settings settings_staging;
+static size_t settings_staged;
+
+static size_t
+settings_read(size_t offset, uint8_t *buf, size_t len)
+{
+	return config_read_blob(&settings, sizeof(settings), offset, buf, len);
+}
+
+static int
+settings_write(size_t offset, const uint8_t *buf, size_t len)
+{
+	if ((offset != 0 && offset != settings_staged) ||
+	    offset >= sizeof(settings_staging)) {
+		return CFG_STATUS_EINVAL;
+	}
+	if (len > sizeof(settings_staging) - offset) {
+		len = sizeof(settings_staging) - offset;
+	}
+	memcpy((uint8_t *)&settings_staging + offset, buf, len);
+	settings_staged = offset + len;
+
+	return CFG_STATUS_OK;
+}
+
+static int
+settings_commit(void)
+{
+	if (settings_staged != sizeof(settings_staging)) {
+		return CFG_STATUS_EINVAL;
+	}
+	settings_staged = 0;
+
+	if (! settings_validate(&settings_staging)) {
+		return CFG_STATUS_EBADDATA;
+	}
+	if (! flash_store_save(FLASH_STORE_AREA_SETTINGS, SETTINGS_VERSION,
+			       &settings_staging, sizeof(settings_staging))) {
+		printf("[%10u] ERROR: failed to save settings to flash.\n",
+		    board_millis());
+		return CFG_STATUS_EIO;
+	}
+	settings = settings_staging;
+	printf("[%10u] INFO: new settings installed.\n", board_millis());
+
+	return CFG_STATUS_OK;
+}
 
-	/* Declare the keyboard dead and reboot it. */
-	printf("[%10u] ERROR: keyboard appears dead, rebooting...\n",
+static int
+settings_reset(void)
+{
+	settings_load_default(&settings);
+	flash_store_erase(FLASH_STORE_AREA_SETTINGS);
+	settings_staged = 0;
+	printf("[%10u] INFO: reverted to default settings.\n",
 	    board_millis());
-	kbd_reboot();
-	deadcheck_warned = false;
+
+	return CFG_STATUS_OK;
 }
 
-static bool
-kbd_err_task(uint8_t c)
+#if HID_SOF_ALIGN
+static size_t
+sof_stats_read(size_t offset, uint8_t *buf, size_t len)
 {
-	switch (c) {
-	case NABU_CODE_ERR_MKEY:
-		printf("[%10u] INFO: multi-keypress, sending HID_KEY_NONE.\n",
-		    board_millis());
-		send_kbd_report(HID_KEY_NONE);
-		return false;
+	return config_read_blob(&sof_stats, sizeof(sof_stats), offset, buf,
+	    len);
+}
 
-	case NABU_CODE_ERR_RAM:
-		printf("[%10u] ERROR: keyboard RAM error, rebooting...\n",
-		     board_millis());
-		break;
+static int
+sof_stats_reset(void)
+{
+	memset(sof_stats.wait, 0, sizeof(sof_stats.wait));
 
-	case NABU_CODE_ERR_ROM:
-		printf("[%10u] ERROR: keyboard ROM error, rebooting...\n",
-		     board_millis());
-		break;
+	return CFG_STATUS_OK;
+}
+#endif
 
-	case NABU_CODE_ERR_ISR:
-		printf("[%10u] ERROR: keyboard ISR error, rebooting...\n",
-		     board_millis());
-		break;
+#if LATENCY_HIST
+static size_t
+lat_hist_read(size_t offset, uint8_t *buf, size_t len)
+{
+	return config_read_blob(&lat_hist, sizeof(lat_hist), offset, buf,
+	    len);
+}
 
-	case NABU_CODE_ERR_PING:
-		have_nabu = true;
-		led_select_sequence();
-		debug_printf("DEBUG: %s: received PING from keyboard.\n",
-		    __func__);
-		return false;
+static int
+lat_hist_reset(void)
+{
+	memset(lat_hist.count, 0, sizeof(lat_hist.count));
 
-	case NABU_CODE_ERR_RESET:
-		/* Keyboard has announced itself! */
-		have_nabu = true;
-		led_select_sequence();
-		printf(
-		    "[%10u] INFO: received RESET notification from keyboard.\n",
-		    board_millis());
-		return false;
+	return CFG_STATUS_OK;
+}
+#endif
 
-	default:
-		/* This won't ever happen; just ignore. */
-		return false;
+static size_t
+counters_read(size_t offset, uint8_t *buf, size_t len)
+{
+	if (offset == 0) {
+		counters.uptime_ms = board_millis();
 	}
+	return config_read_blob(&counters, sizeof(counters), offset, buf,
+	    len);
+}
 
-	/* If we got here, we're rebooting the keyboard. */
-	kbd_reboot();
-	return true;
+static int
+counters_reset(void)
+{
+	memset(&counters.rx_bytes, 0,
+	    sizeof(counters) - offsetof(struct counters, rx_bytes));
+
+	return CFG_STATUS_OK;
 }
 
-#define	REPORT_INTERVAL_MS	10
+#if TASK_PROFILE
+static size_t
+prof_stats_read(size_t offset, uint8_t *buf, size_t len)
+{
+	return config_read_blob(&prof_stats, sizeof(prof_stats), offset,
+	    buf, len);
+}
 
-static void
-hid_task(uint32_t now)
+static int
+prof_stats_reset(void)
 {
-	uint8_t c;
+	prof_reset();
 
-	/* This is good for ~139 years of uptime. */
-	static uint32_t start_ms;
+	return CFG_STATUS_OK;
+}
+#endif
 
-	if (now - start_ms < REPORT_INTERVAL_MS) {
-		return;
-	}
+static size_t
+link_stats_read(size_t offset, uint8_t *buf, size_t len)
+{
+	return config_read_blob(&link_monitor.stats,
+	    sizeof(link_monitor.stats), offset, buf, len);
+}
 
-	start_ms += REPORT_INTERVAL_MS;
+/* Start learning the link from scratch. */
+static int
+link_stats_reset(void)
+{
+	link_init(&link_monitor);
+	link_warned = false;
 
-	/*
-	 * Quick unlocked queue-empty checks to see if there's
-	 * work to do.
-	 */
-	if (kbd_has_data_unlocked() ||
-	    joy_has_data_unlocked(0) || joy_has_data_unlocked(1)) {
-		debug_printf("DEBUG: %s: have work to do (k=%d j0=%d j1=%d)\n",
-		    __func__, kbd_has_data_unlocked(),
-		    joy_has_data_unlocked(0), joy_has_data_unlocked(1));
-	} else {
-		/* No data to send. */
-		return;
-	}
+	return CFG_STATUS_OK;
+}
 
-	/*
-	 * We have at least one report to send.  If we're suspended,
-	 * wake up the host.  We'll send the report the next time
-	 * around.
-	 */
-	if (tud_suspended()) {
-		/*
-		 * Peek at the keyboard; if it's an error code,
-		 * process it and get out.
-		 */
-		if (queue_peek(&kbd_context.queue, &c) &&
-		    NABU_CODE_ERR_P(c) &&
-		    c != NABU_CODE_ERR_MKEY /* this is a key-press */) {
-			queue_get(&kbd_context.queue, &c);
-			kbd_err_task(c);
-			return;
-		}
-		if (want_remote_wakeup) {
-			tud_remote_wakeup();
-			want_remote_wakeup = false;
-		}
-		return;
-	}
+#if TRACE_MASK != 0
+static int
+trace_obj_reset(void)
+{
+	trace_reset();
 
-	if (tud_hid_n_ready(ITF_NUM_KBD)) {
-		uint16_t code;
+	return CFG_STATUS_OK;
+}
+#endif
+
+static const struct config_obj {
+	size_t	(*read)(size_t, uint8_t *, size_t);
+	int	(*write)(size_t, const uint8_t *, size_t);
+	int	(*commit)(void);
+	int	(*reset)(void);
+} config_objs[] = {
+[CFG_OBJ_KEYMAP]	=	{ .read = keymap_read,
+				  .write = keymap_write,
+				  .commit = keymap_commit,
+				  .reset = keymap_reset },
+[CFG_OBJ_LAYOUT]	=	{ .read = layout_read,
+				  .write = layout_write,
+				  .commit = layout_commit,
+				  .reset = keymap_reset },
+[CFG_OBJ_MACROS]	=	{ .read = macro_read,
+				  .write = macros_write,
+				  .commit = macros_commit,
+				  .reset = macros_reset },
+[CFG_OBJ_SETTINGS]	=	{ .read = settings_read,
+				  .write = settings_write,
+				  .commit = settings_commit,
+				  .reset = settings_reset },
+#if HID_SOF_ALIGN
+[CFG_OBJ_SOF]		=	{ .read = sof_stats_read,
+				  .reset = sof_stats_reset },
+#endif
+#if LATENCY_HIST
+[CFG_OBJ_LATENCY]	=	{ .read = lat_hist_read,
+				  .reset = lat_hist_reset },
+#endif
+[CFG_OBJ_COUNTERS]	=	{ .read = counters_read,
+				  .reset = counters_reset },
+[CFG_OBJ_LINK]		=	{ .read = link_stats_read,
+				  .reset = link_stats_reset },
+#if TASK_PROFILE
+[CFG_OBJ_PROFILE]	=	{ .read = prof_stats_read,
+				  .reset = prof_stats_reset },
+#endif
+#if TRACE_MASK != 0
+[CFG_OBJ_TRACE]		=	{ .read = trace_read,
+				  .reset = trace_obj_reset },
+#endif
+};
 
-		if (kbd_context.next != NULL) {
-			code = *kbd_context.next++;
-			if (code == 0 || (code & M_ENDSEQ) != 0) {
-				/* Last code in the sequence. */
-				kbd_context.next = NULL;
-			}
-			debug_printf("DEBUG: %s: next in sequence: 0x%04x\n",
-			    __func__, code);
-			send_kbd_report(code);
-		} else if (kbd_context.zombie) {
-			/*
-			 * We let any outstanding sequence complete, but
-			 * we do one more key-up event in case there is
-			 * other state latched by the host.
-			 */
-			debug_printf("DEBUG: %s: clearing zombie state.\n",
-			    __func__);
-			kbd_context.zombie = false;
-			kbd_context.modifiers = 0;
-			send_kbd_report(HID_KEY_NONE);
-		} else if (queue_get(&kbd_context.queue, &c)) {
-			const uint16_t *sequence = nabu_to_hid[c].codes;
-			code = sequence[0];
-
-			if (NABU_CODE_ERR_P(c)) {
-				if (kbd_err_task(c)) {
-					/* Error message already displayed. */
-					return;
-				}
-			} else if (code != 0) {
-				debug_printf("DEBUG: %s: got 0x%02x\n",
-				    __func__, c);
-				/* UP/DOWN keys don't use a sequence. */
-				if (code & M_DOWN) {
-					debug_printf("DEBUG: %s: code 0x%04x\n",
-					    __func__, code);
-					if (M_HIDKEY(code) == HID_KEY_NONE) {
-						/* Sticky modifier. */
-						code = kbd_modifier(code);
-					}
-				} else if (code & M_UP) {
-					debug_printf("DEBUG: %s: key-up\n",
-					    __func__);
-					if (M_HIDKEY(code) == HID_KEY_NONE) {
-						/* Sticky modifier. */
-						code = kbd_modifier(code);
-					} else {
-						code = HID_KEY_NONE;
-					}
-				} else {
-					debug_printf(
-					    "DEBUG: %s: first code 0x%04x\n",
-					    __func__, code);
-					if ((code & M_ENDSEQ) == 0) {
-						kbd_context.next = &sequence[1];
-					}
-				}
-				send_kbd_report(code);
-			} else {
-				debug_printf("DEBUG: %s: ignoring 0x%02x\n",
-				    __func__, c);
-			}
-		}
+#define	CONFIG_NOBJS	(sizeof(config_objs) / sizeof(config_objs[0]))
+
+static struct {
+	uint8_t obj;
+	uint8_t status;
+	uint16_t offset;
+} config_context;
+
+static uint16_t
+config_report_get(uint8_t *buffer, uint16_t reqlen)
+{
+	uint8_t report[CONFIG_REPORT_SIZE] = { 0 };
+	const struct config_obj *obj = NULL;
+	size_t len = 0;
+
+	if (config_context.obj < CONFIG_NOBJS) {
+		obj = &config_objs[config_context.obj];
+	}
+	if (obj != NULL && obj->read != NULL) {
+		len = (*obj->read)(config_context.offset,
+		    &report[CONFIG_REPORT_HDR_SIZE], CONFIG_REPORT_DATA_SIZE);
 	}
 
-	/* Now do the joysticks. */
-	for (int i = 0; i < 2; i++) {
-		if (tud_hid_n_ready(ITF_NUM_JOY0 + i)) {
-			if (joy_context[i].zombie) {
-				send_joy_report(i, 0);
-				joy_context[i].zombie = false;
-			} else if (queue_get(&joy_context[i].queue, &c)) {
-				send_joy_report(i, c);
-			}
-		}
+	report[0] = config_context.status;
+	report[1] = config_context.obj;
+	report[2] = config_context.offset & 0xff;
+	report[3] = config_context.offset >> 8;
+	config_context.offset += len;
+
+	if (reqlen > sizeof(report)) {
+		reqlen = sizeof(report);
 	}
+	memcpy(buffer, report, reqlen);
+	return reqlen;
 }
 
 /*
- * Invoked when the device is "mounted".
+ * GET_REPORT for an input report returns the last one we sent, so
+ * the host can resync with the keyboard (held keys and SYM / TV/NABU
+ * modifiers) and joysticks without waiting for them to change.
  */
-void
-tud_mount_cb(void)
+static uint16_t
+input_report_get(uint8_t itf, uint8_t report_id, uint8_t *buffer,
+    uint16_t reqlen)
 {
-	mounted = true;
-	led_select_sequence();
-}
+	const void *report;
+	uint16_t len;
+
+	if (itf == ITF_NUM_KBD && report_id == REPORT_ID_KEYBOARD) {
+		report = &kbd_context.report;
+		len = sizeof(kbd_context.report);
+#if HID_COMPOSITE
+	} else if (itf == ITF_NUM_KBD && (report_id == REPORT_ID_JOY0 ||
+					  report_id == REPORT_ID_JOY1)) {
+		report = &joy_context[report_id - REPORT_ID_JOY0].report;
+		len = sizeof(joy_report_t);
+#else
+	} else if (itf == ITF_NUM_JOY0 || itf == ITF_NUM_JOY1) {
+		report = &joy_context[itf - ITF_NUM_JOY0].report;
+		len = sizeof(joy_report_t);
+#endif
+	} else {
+		return 0;
+	}
 
-/*
- * Invoked when the device is "unmounted".
- */
-void
-tud_umount_cb(void)
-{
-	mounted = false;
-	led_select_sequence();
+	if (reqlen > len) {
+		reqlen = len;
+	}
+	memcpy(buffer, report, reqlen);
+	return reqlen;
 }
 
-/*
- * Invoked when the USB bus is suspended.
- *
- * remote_wakeup_en indicates if the host allows us to perform a
- * remote wakeup.
- *
- * Within 7ms, we must drop our current draw to less than 2.5mA from
- * the bus.  Not a problem, since we require an external power source
- * for the keyboard anyway.  But we do power the keyboard off to make
- * sure that we don't erroneously wake up the host due to pings or
- * errors.
- */
-void
-tud_suspend_cb(bool remote_wakeup_en)
+static void
+config_report_set(uint8_t const *buffer, uint16_t bufsize)
 {
-	want_remote_wakeup = remote_wakeup_en;
-	suspended = true;
-	if (!want_remote_wakeup) {
-		printf(
-		  "[%10u] INFO: Powering down keyboard for suspend request.\n",
-		  board_millis());
-		kbd_setpower(false);
+	const struct config_obj *obj = NULL;
+	uint16_t offset;
+	int status = CFG_STATUS_EINVAL;
+
+	if (bufsize < CONFIG_REPORT_HDR_SIZE) {
+		goto out;
 	}
-	led_select_sequence();
-}
+	if (buffer[1] < CONFIG_NOBJS) {
+		obj = &config_objs[buffer[1]];
+	}
+	offset = buffer[2] | (buffer[3] << 8);
 
-/*
- * Invoked when the USB bus is resumed.
- */
-void
-tud_resume_cb(void)
-{
-	suspended = false;
-	if (!kbd_powerstate) {
-		printf(
-		    "[%10u] INFO: Powering up keyboard for resume request.\n",
-		    board_millis());
-		kbd_setpower(true);
+	debug_printf("DEBUG: %s: op %u obj %u offset %u\n", __func__,
+	    buffer[0], buffer[1], offset);
+
+	switch (buffer[0]) {
+	case CFG_OP_SELECT:
+		config_context.obj = buffer[1];
+		config_context.offset = offset;
+		status = CFG_STATUS_OK;
+		break;
+
+	case CFG_OP_WRITE:
+		if (obj != NULL && obj->write != NULL) {
+			status = (*obj->write)(offset,
+			    &buffer[CONFIG_REPORT_HDR_SIZE],
+			    bufsize - CONFIG_REPORT_HDR_SIZE);
+		}
+		break;
+
+	case CFG_OP_COMMIT:
+		if (obj != NULL && obj->commit != NULL) {
+			status = (*obj->commit)();
+		}
+		break;
+
+	case CFG_OP_RESET:
+		if (obj != NULL && obj->reset != NULL) {
+			status = (*obj->reset)();
+		}
+		break;
 	}
-	led_select_sequence();
+
+ out:
+	config_context.status = status;
 }
 
 /*
@@ -1149,12 +3136,14 @@ uint16_t
 tud_hid_get_report_cb(uint8_t itf, uint8_t report_id,
     hid_report_type_t report_type, uint8_t* buffer, uint16_t reqlen)
 {
-	// TODO not Implemented
-	(void) itf;
-	(void) report_id; 
-	(void) report_type;
-	(void) buffer;
-	(void) reqlen;
+	if (itf == ITF_NUM_KBD && report_id == REPORT_ID_CONFIG &&
+	    report_type == HID_REPORT_TYPE_FEATURE) {
+		return config_report_get(buffer, reqlen);
+	}
+
+	if (report_type == HID_REPORT_TYPE_INPUT) {
+		return input_report_get(itf, report_id, buffer, reqlen);
+	}
 
 	return 0;
 }
@@ -1167,25 +3156,123 @@ void
 tud_hid_set_report_cb(uint8_t itf, uint8_t report_id,
     hid_report_type_t report_type, uint8_t const* buffer, uint16_t bufsize)
 {
+	if (itf == ITF_NUM_KBD && report_id == REPORT_ID_CONFIG &&
+	    report_type == HID_REPORT_TYPE_FEATURE) {
+		config_report_set(buffer, bufsize);
+		return;
+	}
+
 	// TODO set LED based on CAPLOCK, NUMLOCK etc...
-	(void) itf;
-	(void) report_id;
-	(void) report_type;
-	(void) buffer;
-	(void) bufsize;
 }
 
 static inline uint8_t
 kbd_getc(void)
 {
-	uint32_t now;
-	uint8_t c;
+	uint32_t now, dr;
 
-	c = uart_getc(uart1);
+#if SUSPEND_SLEEP
+	while (kbd_rx_sleep && ! uart_is_readable(uart1)) {
+		kbd_rx_wait();
+	}
+#endif
+	/* Like uart_getc(), but we want the error bits, too. */
+	while (! uart_is_readable(uart1)) {
+		tight_loop_contents();
+	}
+	dr = uart_get_hw(uart1)->dr;
 	now = board_millis();
 
-	last_kbd_message_time = now;
-	return c;
+	counters.rx_bytes++;
+	if (dr & (UART_UARTDR_OE_BITS | UART_UARTDR_BE_BITS |
+		  UART_UARTDR_PE_BITS | UART_UARTDR_FE_BITS)) {
+		counters.uart_errors++;
+	}
+	if (dr & UART_UARTDR_BE_BITS) {
+		/* Not a message; let Core 0 have a look. */
+		kbd_rx_break = true;
+		__sev();
+	} else {
+		last_kbd_message_time = now;
+	}
+	return (uint8_t)(dr & UART_UARTDR_DATA_BITS);
+}
+
+/*
+ * Sort out a byte from the keyboard and push it onto the appropriate
+ * queue.  Runs on Core 1.
+ */
+static void
+kbd_rx_byte(uint8_t c)
+{
+	static int joy_instance = -1;
+
+	TRACE(TRACE_EV_RX, c);
+
+	if (c == NABU_CODE_ERR_PING) {
+		link_ping_rx_us = time_us_32();
+	}
+
+	/* Check for a joystick instance. */
+	if (c == NABU_CODE_JOY0 || c == NABU_CODE_JOY1) {
+		counters.rx_joy++;
+		joy_instance = c & 1;
+		/* We expect a joystick data byte next. */
+		return;
+	}
+
+	/* Check for joystick data. */
+	if (NABU_CODE_JOYDAT_P(c)) {
+		counters.rx_joy++;
+		if (joy_instance < 0) {
+			/* Unexpected; discard data. */
+			return;
+		}
+		debug_printf("DEBUG: %s: adding JOY%d code 0x%02x\n",
+		    __func__, joy_instance, c);
+		if (queue_add(&joy_context[joy_instance].queue, c)) {
+			TRACE(TRACE_EV_ENQUEUE, c);
+			hid_order_add(HID_SRC_JOY0 + joy_instance);
+		} else {
+			TRACE(TRACE_EV_DROP, c);
+			counters.queue_drops++;
+		}
+		joy_instance = -1;
+		return;
+	}
+
+	if (joy_instance >= 0) {
+		/* Unexpected; reset state. */
+		joy_instance = -1;
+	}
+
+	/*
+	 * The rest is ostensibly keyboard data, but don't
+	 * bother to enqueue it if there's no action that
+	 * will be taken.
+	 */
+	if (keymap_assigned_p(kbd_keymap, c) || NABU_CODE_ERR_P(c) ||
+	    macro_bound_p(c) ||
+	    (settings.unicode_mode != UNICODE_OFF &&
+	     unicode_codepoint(c) != 0)) {
+		debug_printf("DEBUG: %s: adding KBD code 0x%02x\n",
+		    __func__, c);
+		if (NABU_CODE_ERR_P(c)) {
+			counters.rx_status++;
+		} else {
+			counters.rx_key++;
+		}
+		if (queue_add(&kbd_context.queue, c)) {
+			TRACE(TRACE_EV_ENQUEUE, c);
+			hid_order_add(HID_SRC_KBD);
+		} else {
+			TRACE(TRACE_EV_DROP, c);
+			counters.queue_drops++;
+		}
+	} else {
+		debug_printf("DEBUG: %s: ignored KBD code 0x%02x\n",
+		    __func__, c);
+		counters.rx_ignored++;
+	}
 }
 
 #define	CORE1_MAGIC	(('N' << 24) | ('A' << 16) | ('B' << 8) | 'U')
@@ -1197,54 +3284,26 @@ kbd_getc(void)
 static void
 nabu_keyboard_reader(void)
 {
-	int joy_instance = -1;
 	uint8_t c;
 
 	/* Let the main thread know we're alive and ready. */
 	multicore_fifo_push_blocking(CORE1_MAGIC);
 	multicore_fifo_drain();
 
-	for (;;) {
-		c = kbd_getc();
-
-		/* Check for a joystick instance. */
-		if (c == NABU_CODE_JOY0 || c == NABU_CODE_JOY1) {
-			joy_instance = c & 1;
-			/* We expect a joystick data byte next. */
-			continue;
-		}
+	/* Allow Core 0 to pause us while it writes to flash. */
+	multicore_lockout_victim_init();
 
-		/* Check for joystick data. */
-		if (NABU_CODE_JOYDAT_P(c)) {
-			if (joy_instance < 0) {
-				/* Unexpected; discard data. */
-				continue;
-			}
-			debug_printf("DEBUG: %s: adding JOY%d code 0x%02x\n",
-			    __func__, joy_instance, c);
-			queue_add(&joy_context[joy_instance].queue, c);
-			joy_instance = -1;
-			continue;
-		}
+	prof_init();
 
-		if (joy_instance >= 0) {
-			/* Unexpected; reset state. */
-			joy_instance = -1;
-		}
+#if SUSPEND_SLEEP
+	/* Let the start of a byte wake us up; see kbd_rx_wait(). */
+	gpio_set_irq_enabled(UART1_RX_PIN, GPIO_IRQ_EDGE_FALL, true);
+	scb_hw->scr |= M0PLUS_SCR_SEVONPEND_BITS;
+#endif
 
-		/*
-		 * The rest is ostensibly keyboard data, but don't
-		 * bother to enqueue it if there's no action that
-		 * will be taken.
-		 */
-		if (nabu_to_hid[c].codes[0] != 0 || NABU_CODE_ERR_P(c)) {
-			debug_printf("DEBUG: %s: adding KBD code 0x%02x\n",
-			    __func__, c);
-			queue_add(&kbd_context.queue, c);
-		} else {
-			debug_printf("DEBUG: %s: ignored KBD code 0x%02x\n",
-			    __func__, c);
-		}
+	for (;;) {
+		c = kbd_getc();
+		PROF(PROF_READER, kbd_rx_byte(c));
 	}
 }
 
@@ -1252,20 +3311,30 @@ int
 main(void)
 {
 	extern const char version_string[];
-	uint32_t now;
+	extern const char *usb_descriptors_init(void);
+	uint32_t now, events;
 	uint actual_baud;
 
+	/* Before anything sets up a UART; see above. */
+	gov_init();
+
 	/* TinyUSB SDK board init - initializes LED and console UART (0). */
 	board_init();
 
 	printf("NABU Keyboard -> USB HID Adapter %s\n", version_string);
 	printf("Copyright (c) 2022 Jason R. Thorpe\n\n");
 
+	/* kbd_setpower() restarts the link monitor. */
+	link_init(&link_monitor);
+
 	printf("Disabling keyboard power.\n");
 	gpio_init(PWREN_PIN);
 	gpio_set_dir(PWREN_PIN, GPIO_OUT);
 	kbd_setpower(false);
 
+	timer_service_init();
+	trace_init();
+
 	printf("Initializing status LED.\n");
 	led_set_sequence(ledseq_not_mounted);
 
@@ -1296,15 +3365,28 @@ main(void)
 		uart_getc(uart1);
 	}
 
+	prof_init();
+
 	printf("Initializing USB stack.\n");
+	printf("USB serial number: %s\n", usb_descriptors_init());
 	tusb_init();
+#if HID_SOF_ALIGN
+	tud_sof_cb_enable(true);
+#endif
 
 	printf("Initializing keyboard state.\n");
 	kbd_init();
+	keymap_init();
+	macro_init();
+	settings_init();
 
 	printf("Initializing joystick state.\n");
 	joy_init(0);
 	joy_init(1);
+#if HID_COMPOSITE
+	queue_init(&hid_order);
+	hid_sched_init(&hid_sched);
+#endif
 
  relaunch:
 	printf("Resetting Core 1.\n");
@@ -1325,12 +3407,52 @@ main(void)
 	printf("Enabling keyboard power.\n");
 	kbd_setpower(true);
 
+#if MAIN_LOOP_WFE
+	/* Any interrupt wakes us from WFE, even if we didn't take it. */
+	scb_hw->scr |= M0PLUS_SCR_SEVONPEND_BITS;
+#endif
+	timer_oneshot(TIMER_EV_DEADCHECK, DEADCHECK_WARN_MS * 1000);
+	loop_stats.start_ms = board_millis();
+	if (debug_enabled) {
+		timer_periodic(TIMER_EV_STATS, LOOP_STATS_MS * 1000);
+	}
+
 	printf("Entering main loop!\n");
 	for (;;) {
+#if TASK_PROFILE
+		uint32_t loop_start = prof_now();
+#endif
+		events = timer_events();
 		now = board_millis();
-		led_task(now);		/* heartbeat LED */
-		kbd_deadcheck(now);	/* check if keyboard is alive */
-		hid_task(now);		/* HID processing */
-		tud_task();		/* TinyUSB device task */
+		counters.loop_iterations++;
+		gov_task(events);		/* clock governor */
+		if (events & TIMER_EVENT(TIMER_EV_LED)) {
+			/* heartbeat LED */
+			PROF(PROF_LED, led_task());
+		}
+		if (kbd_rx_break) {
+			kbd_deadcheck_break();	/* line break from keyboard */
+		}
+		if (events & TIMER_EVENT(TIMER_EV_DEADCHECK)) {
+			/* check if keyboard is alive */
+			PROF(PROF_DEADCHECK, kbd_deadcheck(now));
+		}
+		if (events & TIMER_EVENT(TIMER_EV_REBOOT)) {
+			kbd_reboot_task(now);	/* keyboard power-cycle */
+		}
+		if (events & TIMER_EVENT(TIMER_EV_STUCK)) {
+			kbd_stuck_task(now);	/* stuck special keys */
+		}
+		PROF(PROF_HID,			/* HID processing */
+		    hid_task(now, (events & TIMER_EVENT(TIMER_EV_HID)) != 0));
+		PROF(PROF_TUD,
+		    tud_task());		/* TinyUSB device task */
+		if (events & TIMER_EVENT(TIMER_EV_STATS)) {
+			loop_stats_task(now);	/* main loop stats */
+		}
+#if TASK_PROFILE
+		prof_record(PROF_LOOP, loop_start);
+#endif
+		loop_sleep();			/* wait for something to do */
 	}
 }
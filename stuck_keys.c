@@ -0,0 +1,115 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The special keys (arrows, page, NO, YES, PAUSE, SYM and TV/NABU) are
+ * the only ones with a key-up code, and if that gets lost to a UART
+ * error or a full queue, the host sees the key held forever (or SYM /
+ * TV/NABU's sticky modifier stays latched).  We keep track of which
+ * ones are down and when we last heard from each, so that one that's
+ * been quiet for too long can be released.
+ *
+ * What counts as hearing from a key depends on the key.  The arrow and
+ * page keys auto-repeat, so a held one sends its key-down code again
+ * and again; when those stop without a key-up, the key-up was lost.
+ * The others don't repeat, and they're often held while other keys are
+ * typed (SYM and TV/NABU select keymap layers), so any key typed while
+ * they're down counts as hearing from them.  Only once the keyboard
+ * has gone quiet (PINGs aside) for the timeout are they released.
+ */
+
+/* Standard headers */
+#include <string.h>
+
+/* Local headers */
+#include "keymap.h"
+#include "stuck_keys.h"
+
+#define	STUCK_KEYS_BIT(c)	(1U << ((c) & 0xf))
+
+void
+stuck_keys_init(struct stuck_keys *sk)
+{
+	memset(sk, 0, sizeof(*sk));
+}
+
+/*
+ * Account for a code from the keyboard, taken at now (ms).
+ */
+void
+stuck_keys_track(struct stuck_keys *sk, uint8_t c, uint32_t now)
+{
+	unsigned int i;
+
+	if (NABU_CODE_ERR_P(c)) {
+		/* PINGs and such say nothing about the keys. */
+		return;
+	}
+	if (NABU_CODE_UP_P(c)) {
+		sk->held &= ~STUCK_KEYS_BIT(c);
+		return;
+	}
+
+	/* Any key typed counts for the keys that don't repeat. */
+	for (i = 0; i < STUCK_KEYS_NKEYS; i++) {
+		if ((sk->held & (1U << i)) != 0 &&
+		    ! NABU_CODE_REPEAT_P(NABU_CODE_DOWN_FIRST + i)) {
+			sk->held_time[i] = now;
+		}
+	}
+
+	if (NABU_CODE_DOWN_P(c)) {
+		sk->held |= STUCK_KEYS_BIT(c);
+		sk->held_time[c & 0xf] = now;
+	}
+}
+
+/*
+ * Returns the keys that have been quiet for timeout (ms) or longer.
+ * *nextp is set to how long until the next of the rest would be.
+ */
+uint16_t
+stuck_keys_expired(const struct stuck_keys *sk, uint32_t now,
+    uint32_t timeout, uint32_t *nextp)
+{
+	uint32_t quiet, next = timeout;
+	uint16_t expired = 0;
+	unsigned int i;
+
+	for (i = 0; i < STUCK_KEYS_NKEYS; i++) {
+		if ((sk->held & (1U << i)) == 0) {
+			continue;
+		}
+		quiet = now - sk->held_time[i];
+		if (quiet >= timeout) {
+			expired |= 1U << i;
+		} else if (timeout - quiet < next) {
+			next = timeout - quiet;
+		}
+	}
+	*nextp = next;
+	return expired;
+}
@@ -0,0 +1,49 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _STUCK_KEYS_H_
+#define	_STUCK_KEYS_H_
+
+#include <stdint.h>
+
+/*
+ * Tracking of the special keys that are down, so that one whose key-up
+ * code got lost can be released; see stuck_keys.c.  Keys are indexed
+ * by the low nibble of their NABU key-down code.
+ */
+#define	STUCK_KEYS_NKEYS	16
+
+struct stuck_keys {
+	uint16_t	held;		/* keys down */
+	uint32_t	held_time[STUCK_KEYS_NKEYS]; /* last heard from (ms) */
+};
+
+void		stuck_keys_init(struct stuck_keys *);
+void		stuck_keys_track(struct stuck_keys *, uint8_t, uint32_t);
+uint16_t	stuck_keys_expired(const struct stuck_keys *, uint32_t,
+		    uint32_t, uint32_t *);
+
+#endif /* _STUCK_KEYS_H_ */
@@ -0,0 +1,227 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Simulation of the single-interface report scheduling: one report per
+ * interval, keyboard macros and sequences taking many of them, and
+ * joystick reports that mustn't wait behind them.
+ */
+
+/* Standard headers */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Local headers */
+#include "hid_sched.h"
+#include "test.h"
+
+#define	MACRO_REPORTS	40		/* a long macro */
+#define	SEQ_REPORTS	2		/* key down, key up */
+#define	ORDER_MAX	64
+
+/*
+ * The firmware's view: the arrival order of the queued bytes, and how
+ * many reports the keyboard has left in what it's sending.
+ */
+struct sim {
+	struct hid_sched sched;
+	uint8_t order[ORDER_MAX];
+	unsigned int norder;
+	unsigned int kbd_left;
+	unsigned int kbd_sent;
+	unsigned int joy_sent;
+};
+
+static void
+sim_init(struct sim *s)
+{
+	hid_sched_init(&s->sched);
+	s->norder = 0;
+	s->kbd_left = 0;
+	s->kbd_sent = 0;
+	s->joy_sent = 0;
+}
+
+static void
+sim_add(struct sim *s, uint8_t src)
+{
+	s->order[s->norder++] = src;
+}
+
+static void
+sim_remove(struct sim *s, uint8_t src)
+{
+	unsigned int i;
+
+	for (i = 0; i < s->norder; i++) {
+		if (s->order[i] == src) {
+			for (; i + 1 < s->norder; i++) {
+				s->order[i] = s->order[i + 1];
+			}
+			s->norder--;
+			return;
+		}
+	}
+}
+
+/*
+ * One report interval.  Returns the source that sent a report, or
+ * HID_SRC_NONE if there was nothing to send.
+ */
+static uint8_t
+sim_interval(struct sim *s)
+{
+	uint8_t head = HID_SRC_NONE, joy = HID_SRC_NONE, src;
+	unsigned int i;
+
+	if (s->norder != 0) {
+		head = s->order[0];
+	}
+	for (i = 0; i < s->norder; i++) {
+		if (s->order[i] != HID_SRC_KBD) {
+			joy = s->order[i];
+			break;
+		}
+	}
+
+	src = hid_sched_pick(&s->sched, head, joy, s->kbd_left != 0);
+	if (src != HID_SRC_KBD) {
+		sim_remove(s, src);
+		s->joy_sent++;
+		return src;
+	}
+	if (s->kbd_left == 0) {
+		for (i = 0; i < s->norder; i++) {
+			if (s->order[i] == HID_SRC_KBD) {
+				break;
+			}
+		}
+		if (i == s->norder) {
+			return HID_SRC_NONE;
+		}
+		sim_remove(s, HID_SRC_KBD);
+		s->kbd_left = SEQ_REPORTS;
+	}
+	s->kbd_left--;
+	s->kbd_sent++;
+	return HID_SRC_KBD;
+}
+
+/*
+ * A macro is running, a key byte is queued behind it, and then the
+ * joystick moves.  The joystick report has to go out right away, not
+ * after the macro and the key.
+ */
+static void
+test_macro_then_key_then_joy(void)
+{
+	struct sim s;
+	unsigned int t;
+
+	sim_init(&s);
+	s.kbd_left = MACRO_REPORTS;
+	CHECK(sim_interval(&s) == HID_SRC_KBD, "macro didn't start");
+	sim_add(&s, HID_SRC_KBD);
+	CHECK(sim_interval(&s) == HID_SRC_KBD, "macro stalled");
+	sim_add(&s, HID_SRC_JOY0);
+
+	for (t = 0; t < MACRO_REPORTS + SEQ_REPORTS; t++) {
+		if (sim_interval(&s) == HID_SRC_JOY0) {
+			break;
+		}
+	}
+	CHECK(t == 0, "joystick waited %u intervals", t);
+
+	/* The macro and then the key still go out, in that order. */
+	while (sim_interval(&s) != HID_SRC_NONE) {
+		continue;
+	}
+	CHECK(s.kbd_sent == MACRO_REPORTS + SEQ_REPORTS,
+	    "%u keyboard reports", s.kbd_sent);
+	CHECK(s.joy_sent == 1, "%u joystick reports", s.joy_sent);
+}
+
+/*
+ * A joystick moving every other interval during a macro: the two take
+ * turns, so the joystick never falls behind and the macro still gets
+ * half the intervals.
+ */
+static void
+test_macro_with_busy_joy(void)
+{
+	struct sim s;
+	unsigned int t;
+
+	sim_init(&s);
+	s.kbd_left = MACRO_REPORTS;
+	for (t = 0; s.kbd_left != 0 && t < 4 * MACRO_REPORTS; t++) {
+		if ((t & 1) == 0) {
+			sim_add(&s, HID_SRC_JOY1);
+		}
+		sim_interval(&s);
+		CHECK(s.norder == 0, "%u joystick bytes waiting at %u",
+		    s.norder, t);
+	}
+	CHECK(s.kbd_left == 0, "macro not done after %u intervals", t);
+	CHECK(t <= 2 * MACRO_REPORTS, "macro took %u intervals", t);
+}
+
+/*
+ * With the keyboard idle, reports follow the arrival order.
+ */
+static void
+test_arrival_order(void)
+{
+	struct sim s;
+
+	sim_init(&s);
+	sim_add(&s, HID_SRC_KBD);
+	sim_add(&s, HID_SRC_JOY0);
+	sim_add(&s, HID_SRC_JOY1);
+	CHECK(sim_interval(&s) == HID_SRC_KBD, "key not first");
+
+	/* The key's sequence is now in progress; joysticks take turns. */
+	CHECK(sim_interval(&s) == HID_SRC_JOY0, "joystick 0 not second");
+	CHECK(sim_interval(&s) == HID_SRC_KBD, "key-up not third");
+	CHECK(sim_interval(&s) == HID_SRC_JOY1, "joystick 1 not last");
+	CHECK(sim_interval(&s) == HID_SRC_NONE, "left over reports");
+
+	sim_add(&s, HID_SRC_JOY1);
+	sim_add(&s, HID_SRC_KBD);
+	CHECK(sim_interval(&s) == HID_SRC_JOY1, "joystick not first");
+	CHECK(sim_interval(&s) == HID_SRC_KBD, "key not second");
+}
+
+int
+main(void)
+{
+	test_macro_then_key_then_joy();
+	test_macro_with_busy_joy();
+	test_arrival_order();
+
+	TEST_EXIT();
+}
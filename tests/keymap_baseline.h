@@ -0,0 +1,361 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The keymap as it was before the compact encoding: the literal report
+ * sequence for each NABU code, for a US host.  keymap_test.c checks that
+ * the generated US keymap still expands to exactly this.
+ */
+static const struct codeseq keymap_baseline[256] = {
+/*
+ * CTRL just lops off the 2 upper bits of the keycode
+ * on the NABU keyboard (except for C-'<' ??), but we
+ * simplify to C-a, C-c, etc.
+ */
+[0x00]		=	{ { M_CTRL,				/* C-'@' */
+			    M_CTRL | M_SHIFT,
+			    M_CTRL | M_SHIFT | HID_KEY_2,
+			    M_CTRL | M_SHIFT,
+			    M_CTRL } },
+[0x01]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_A,
+			    M_CTRL } },
+[0x02]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_B,
+			    M_CTRL } },
+[0x03]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_C,
+			    M_CTRL } },
+[0x04]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_D,
+			    M_CTRL } },
+[0x05]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_E,
+			    M_CTRL } },
+[0x06]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_F,
+			    M_CTRL } },
+[0x07]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_G,
+			    M_CTRL } },
+[0x08]		=	{ { HID_KEY_BACKSPACE } },		/* Backspace */
+[0x09]		=	{ { HID_KEY_TAB } },			/* Tab */
+[0x0a]		=	{ { HID_KEY_ENTER } },			/* LF */
+[0x0b]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_K,
+			    M_CTRL } },
+[0x0c]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_L,
+			    M_CTRL } },
+[0x0d]		=	{ { HID_KEY_ENTER } },			/* CR */
+[0x0e]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_N,
+			    M_CTRL } },
+[0x0f]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_O,
+			    M_CTRL } },
+[0x10]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_P,
+			    M_CTRL } },
+[0x11]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_Q,
+			    M_CTRL } },
+[0x12]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_R,
+			    M_CTRL } },
+[0x13]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_S,
+			    M_CTRL } },
+[0x14]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_T,
+			    M_CTRL } },
+[0x15]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_U,
+			    M_CTRL } },
+[0x16]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_V,
+			    M_CTRL } },
+[0x17]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_W,
+			    M_CTRL } },
+[0x18]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_X,
+			    M_CTRL } },
+[0x19]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_Y,
+			    M_CTRL } },
+[0x1a]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_Z,
+			    M_CTRL } },
+[0x1b]		=	{ { HID_KEY_ESCAPE } },			/* ESC */
+[0x1c]		=	{ { M_CTRL,				/* C-'<' */
+			    M_CTRL | M_SHIFT,
+			    M_CTRL | M_SHIFT | HID_KEY_COMMA,
+			    M_CTRL | M_SHIFT,
+			    M_CTRL } },
+[0x1d]		=	{ { M_CTRL,
+			    M_CTRL | HID_KEY_BRACKET_RIGHT,
+			    M_CTRL } },
+[0x1e]		=	{ { M_CTRL,				/* C-'^' */
+			    M_CTRL | M_SHIFT,
+			    M_CTRL | M_SHIFT | HID_KEY_6,
+			    M_CTRL | M_SHIFT,
+			    M_CTRL } },
+[0x1f]		=	{ { M_CTRL,				/* C-'_' */
+			    M_CTRL | M_SHIFT,
+			    M_CTRL | M_SHIFT | HID_KEY_MINUS,
+			    M_CTRL | M_SHIFT,
+			    M_CTRL } },
+
+[0x20]		=	{ { HID_KEY_SPACE } },
+[0x21]		=	{ { M_SHIFT,				/* ! */
+			    M_SHIFT | HID_KEY_1,
+			    M_SHIFT } },
+[0x22]		=	{ { M_SHIFT,				/* " */
+			    M_SHIFT | HID_KEY_APOSTROPHE,
+			    M_SHIFT } },
+[0x23]		=	{ { M_SHIFT,				/* # */
+			    M_SHIFT | HID_KEY_3,
+			    M_SHIFT } },
+[0x24]		=	{ { M_SHIFT,				/* $ */
+			    M_SHIFT | HID_KEY_4,
+			    M_SHIFT } },
+[0x25]		=	{ { M_SHIFT,				/* % */
+			    M_SHIFT | HID_KEY_5,
+			    M_SHIFT } },
+[0x26]		=	{ { M_SHIFT,				/* & */
+			    M_SHIFT | HID_KEY_7,
+			    M_SHIFT } },
+[0x27]		=	{ { HID_KEY_APOSTROPHE } },
+[0x28]		=	{ { M_SHIFT,				/* ( */
+			    M_SHIFT | HID_KEY_9,
+			    M_SHIFT } },
+[0x29]		=	{ { M_SHIFT,				/* ) */
+			    M_SHIFT | HID_KEY_0,
+			    M_SHIFT } },
+[0x2a]		=	{ { M_SHIFT,				/* * */
+			    M_SHIFT | HID_KEY_8,
+			    M_SHIFT } },
+[0x2b]		=	{ { M_SHIFT,				/* + */
+			    M_SHIFT | HID_KEY_EQUAL,
+			    M_SHIFT } },
+[0x2c]		=	{ { HID_KEY_COMMA } },			/* , */
+[0x2d]		=	{ { HID_KEY_MINUS } },			/* - */
+[0x2e]		=	{ { HID_KEY_PERIOD } },			/* . */
+[0x2f]		=	{ { HID_KEY_SLASH } },			/* / */
+[0x30]		=	{ { HID_KEY_0 } },
+[0x31]		=	{ { HID_KEY_1 } },
+[0x32]		=	{ { HID_KEY_2 } },
+[0x33]		=	{ { HID_KEY_3 } },
+[0x34]		=	{ { HID_KEY_4 } },
+[0x35]		=	{ { HID_KEY_5 } },
+[0x36]		=	{ { HID_KEY_6 } },
+[0x37]		=	{ { HID_KEY_7 } },
+[0x38]		=	{ { HID_KEY_8 } },
+[0x39]		=	{ { HID_KEY_9 } },
+[0x3a]		=	{ { M_SHIFT,				/* : */
+			    M_SHIFT | HID_KEY_SEMICOLON,
+			    M_SHIFT } },
+[0x3b]		=	{ { HID_KEY_SEMICOLON } },
+[0x3c]		=	{ { M_SHIFT,				/* < */
+			    M_SHIFT | HID_KEY_COMMA,
+			    M_SHIFT } },
+[0x3d]		=	{ { HID_KEY_EQUAL } },
+[0x3e]		=	{ { M_SHIFT,				/* > */
+			    M_SHIFT | HID_KEY_PERIOD,
+			    M_SHIFT } },
+[0x3f]		=	{ { M_SHIFT,				/* ? */
+			    M_SHIFT | HID_KEY_SLASH,
+			    M_SHIFT } },
+
+[0x40]		=	{ { M_SHIFT,				/* @ */
+			    M_SHIFT | HID_KEY_2,
+			    M_SHIFT } },
+[0x41]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_A,
+			    M_SHIFT } },
+[0x42]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_B,
+			    M_SHIFT } },
+[0x43]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_C,
+			    M_SHIFT } },
+[0x44]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_D,
+			    M_SHIFT } },
+[0x45]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_E,
+			    M_SHIFT } },
+[0x46]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_F,
+			    M_SHIFT } },
+[0x47]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_G,
+			    M_SHIFT } },
+[0x48]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_H,
+			    M_SHIFT } },
+[0x49]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_I,
+			    M_SHIFT } },
+[0x4a]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_J,
+			    M_SHIFT } },
+[0x4b]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_K,
+			    M_SHIFT } },
+[0x4c]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_L,
+			    M_SHIFT } },
+[0x4d]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_M,
+			    M_SHIFT } },
+[0x4e]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_N,
+			    M_SHIFT } },
+[0x4f]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_O,
+			    M_SHIFT } },
+[0x50]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_P,
+			    M_SHIFT } },
+[0x51]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_Q,
+			    M_SHIFT } },
+[0x52]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_R,
+			    M_SHIFT } },
+[0x53]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_S,
+			    M_SHIFT } },
+[0x54]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_T,
+			    M_SHIFT } },
+[0x55]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_U,
+			    M_SHIFT } },
+[0x56]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_V,
+			    M_SHIFT } },
+[0x57]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_W,
+			    M_SHIFT } },
+[0x58]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_X,
+			    M_SHIFT } },
+[0x59]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_Y,
+			    M_SHIFT } },
+[0x5a]		=	{ { M_SHIFT,
+			    M_SHIFT | HID_KEY_Z,
+			    M_SHIFT } },
+[0x5b]		=	{ { HID_KEY_BRACKET_LEFT } },		/* [ */
+/* 0x5c */
+[0x5d]		=	{ { HID_KEY_BRACKET_RIGHT } },		/* ] */
+[0x5e]		=	{ { M_SHIFT,				/* ^ */
+			    M_SHIFT | HID_KEY_6,
+			    M_SHIFT } },
+[0x5f]		=	{ { M_SHIFT,				/* _ */
+			    M_SHIFT | HID_KEY_MINUS,
+			    M_SHIFT } },
+
+/* 0x60 */
+[0x61]		=	{ { HID_KEY_A } },
+[0x62]		=	{ { HID_KEY_B } },
+[0x63]		=	{ { HID_KEY_C } },
+[0x64]		=	{ { HID_KEY_D } },
+[0x65]		=	{ { HID_KEY_E } },
+[0x66]		=	{ { HID_KEY_F } },
+[0x67]		=	{ { HID_KEY_G } },
+[0x68]		=	{ { HID_KEY_H } },
+[0x69]		=	{ { HID_KEY_I } },
+[0x6a]		=	{ { HID_KEY_J } },
+[0x6b]		=	{ { HID_KEY_K } },
+[0x6c]		=	{ { HID_KEY_L } },
+[0x6d]		=	{ { HID_KEY_M } },
+[0x6e]		=	{ { HID_KEY_N } },
+[0x6f]		=	{ { HID_KEY_O } },
+[0x70]		=	{ { HID_KEY_P } },
+[0x71]		=	{ { HID_KEY_Q } },
+[0x72]		=	{ { HID_KEY_R } },
+[0x73]		=	{ { HID_KEY_S } },
+[0x74]		=	{ { HID_KEY_T } },
+[0x75]		=	{ { HID_KEY_U } },
+[0x76]		=	{ { HID_KEY_V } },
+[0x77]		=	{ { HID_KEY_W } },
+[0x78]		=	{ { HID_KEY_X } },
+[0x79]		=	{ { HID_KEY_Y } },
+[0x7a]		=	{ { HID_KEY_Z } },
+[0x7b]		=	{ { M_SHIFT,				/* { */
+			    M_SHIFT | HID_KEY_BRACKET_LEFT,
+			    M_SHIFT } },
+/* 0x7c */
+[0x7d]		=	{ { M_SHIFT,				/* } */
+			    M_SHIFT | HID_KEY_BRACKET_RIGHT,
+			    M_SHIFT } },
+/* 0x7e */
+[0x7f]		=	{ { HID_KEY_BACKSPACE } },		/* DEL */
+
+/* 0x80 - 0x9f */
+
+/* 0xa0 - 0xbf */
+
+/* 0xc0 - 0xdf */
+
+[0xe0]		=	{ { M_DOWN | HID_KEY_ARROW_RIGHT } },
+[0xe1]		=	{ { M_DOWN | HID_KEY_ARROW_LEFT } },
+[0xe2]		=	{ { M_DOWN | HID_KEY_ARROW_UP } },
+[0xe3]		=	{ { M_DOWN | HID_KEY_ARROW_DOWN } },
+[0xe4]		=	{ { M_DOWN | HID_KEY_PAGE_DOWN } },	/* |||> */
+[0xe5]		=	{ { M_DOWN | HID_KEY_PAGE_UP } },	/* <||| */
+	/*
+	 * There isn't really a good alternative for \ and |, so we steal
+	 * the NO and YES keys, respectively.  Because these keys don't
+	 * self-repeat, we end their key-down sequences without unwinding
+	 * to HID_KEY_NONE, and let the USB host do the key repeat itself.
+	 * We do this by ending the sequence with whatever HID key code
+	 * is present with M_ENDSEQ.
+	 */
+[0xe6]		=	{ { M_ENDSEQ | HID_KEY_BACKSLASH } },	/* NO */
+[0xe7]		=	{ { M_SHIFT,				/* YES */
+			    M_SHIFT | M_ENDSEQ | HID_KEY_BACKSLASH } },
+[0xe8]		=	{ { M_DOWN | M_META } },		/* SYM */
+[0xe9]		=	{ { M_DOWN | HID_KEY_PAUSE } },		/* PAUSE */
+[0xea]		=	{ { M_DOWN | M_ALT } },			/* TV/NABU */
+/* 0xeb - 0xef */
+[0xf0]		=	{ { M_UP | HID_KEY_ARROW_RIGHT } },
+[0xf1]		=	{ { M_UP | HID_KEY_ARROW_LEFT } },
+[0xf2]		=	{ { M_UP | HID_KEY_ARROW_UP } },
+[0xf3]		=	{ { M_UP | HID_KEY_ARROW_DOWN } },
+[0xf4]		=	{ { M_UP | HID_KEY_PAGE_DOWN } },	/* |||> */
+[0xf5]		=	{ { M_UP | HID_KEY_PAGE_UP } },		/* <||| */
+[0xf6]		=	{ { M_ENDSEQ } },			/* NO */
+[0xf7]		=	{ { M_SHIFT } },			/* YES */
+[0xf8]		=	{ { M_UP | M_META } },			/* SYM */
+[0xf9]		=	{ { M_UP | HID_KEY_PAUSE } },		/* PAUSE */
+[0xfa]		=	{ { M_UP | M_ALT } },			/* TV/NABU */
+/* 0xfb - 0xff */
+};
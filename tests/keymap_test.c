@@ -0,0 +1,73 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The compact keymap encoding has to expand to exactly the report
+ * sequences the old literal table had, for every NABU code.
+ */
+
+/* Standard headers */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Local headers */
+#include "keymap.h"
+#include "test.h"
+
+#include "tusb.h"
+#include "keymap_baseline.h"
+
+uint32_t
+board_millis(void)
+{
+	return 0;
+}
+
+int
+main(void)
+{
+	static struct keymap km;
+	struct codeseq seq;
+	unsigned int c, i;
+
+	CHECK(keymap_build(&km, LAYOUT_US), "keymap_build(LAYOUT_US)");
+	CHECK(keymap_validate(&km), "US keymap doesn't validate");
+
+	for (c = 0; c < 256; c++) {
+		keymap_expand(&km, 0, c, &seq);
+		if (memcmp(&seq, &keymap_baseline[c], sizeof(seq)) == 0) {
+			continue;
+		}
+		CHECK(0, "code 0x%02x expands differently", c);
+		for (i = 0; i < 6; i++) {
+			printf("\t0x%04x 0x%04x\n", seq.codes[i],
+			    keymap_baseline[c].codes[i]);
+		}
+	}
+
+	TEST_EXIT();
+}
@@ -0,0 +1,273 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Simulation of the keyboard deadcheck: thresholds derived from the
+ * learned PING period (and their clamping), and how long it takes to
+ * declare a dead keyboard compared with the old fixed thresholds,
+ * including the line-break fast path.
+ */
+
+/* Pico SDK headers */
+#include "pico/stdlib.h"
+
+/* Standard headers */
+#include <stdint.h>
+#include <stdio.h>
+
+/* Local headers */
+#include "link_monitor.h"
+#include "test.h"
+
+#define	PING_US		3700000		/* typical NABU keyboard */
+#define	BREAK_CHAR_US	1430		/* 10 bit times at 6992 baud */
+
+/*
+ * Feed the monitor n PINGs, period_us apart, each off by up to
+ * jitter_us either way.  Returns the time of the last one.
+ */
+static uint32_t
+feed(struct link_monitor *lm, uint32_t t, uint32_t period_us,
+    uint32_t jitter_us, unsigned int n)
+{
+	static uint32_t seed = 1;
+	int32_t off;
+
+	while (n--) {
+		seed = seed * 1103515245 + 12345;
+		off = jitter_us == 0 ? 0 :
+		    (int32_t)((seed >> 8) % (2 * jitter_us + 1)) -
+		    (int32_t)jitter_us;
+		link_ping(lm, t + off, 0);
+		t += period_us;
+	}
+	return t - period_us;
+}
+
+static struct link_monitor *
+learned(uint32_t period_us, uint32_t jitter_us)
+{
+	static struct link_monitor lm;
+
+	link_init(&lm);
+	feed(&lm, 0, period_us, jitter_us, LINK_LEARN_PINGS + 8);
+	return &lm;
+}
+
+/*
+ * Run the deadcheck the way the firmware schedules it, starting with
+ * the check that was armed before the last PING came in, until it
+ * declares the keyboard dead.  Returns the time since the last PING.
+ */
+static uint32_t
+time_to_declare(const struct link_monitor *lm, uint32_t first_check)
+{
+	uint32_t t = first_check, next;
+	int checks = 0;
+
+	while (link_deadcheck(lm, t, false, &next) != LINK_DEAD) {
+		CHECK(next > 0, "deadcheck rescheduled for now");
+		CHECK(++checks < 10, "deadcheck never declared");
+		if (checks >= 10) {
+			break;
+		}
+		t += next;
+	}
+	return t;
+}
+
+static void
+test_unlearned(void)
+{
+	struct link_monitor lm;
+	uint32_t warn, declare;
+
+	link_init(&lm);
+	link_thresholds(&lm, &warn, &declare);
+	CHECK(warn == DEADCHECK_WARN_MS && declare == DEADCHECK_DECLARE_MS,
+	    "unlearned thresholds %u / %u", warn, declare);
+
+	/* Not enough PINGs to trust the period yet. */
+	feed(&lm, 0, PING_US, 0, LINK_LEARN_PINGS - 1);
+	link_thresholds(&lm, &warn, &declare);
+	CHECK(warn == DEADCHECK_WARN_MS && declare == DEADCHECK_DECLARE_MS,
+	    "still learning, thresholds %u / %u", warn, declare);
+}
+
+static void
+test_learned(void)
+{
+	const struct link_monitor *lm = learned(PING_US, 500);
+	uint32_t warn, declare;
+
+	link_thresholds(lm, &warn, &declare);
+	printf("3.7s PING: warn %u ms, declare %u ms\n", warn, declare);
+	CHECK(lm->stats.baseline_us != 0, "baseline not learned");
+	CHECK(lm->stats.period_us > PING_US - 2000 &&
+	      lm->stats.period_us < PING_US + 2000,
+	    "period %u", lm->stats.period_us);
+	CHECK(warn > 3700 && warn < 4300, "warn %u", warn);
+	CHECK(declare > 7400 && declare < 8000, "declare %u", declare);
+	CHECK(lm->stats.missed == 0, "missed %u", lm->stats.missed);
+}
+
+static void
+test_clamping(void)
+{
+	const struct link_monitor *lm;
+	uint32_t warn, declare;
+
+	/* A slow PING can't make us wait longer than we used to. */
+	lm = learned(9000000, 0);
+	link_thresholds(lm, &warn, &declare);
+	CHECK(warn == DEADCHECK_WARN_MS, "slow PING, warn %u", warn);
+	CHECK(declare == DEADCHECK_DECLARE_MS,
+	    "slow PING, declare %u", declare);
+
+	/* A fast one can't make us trigger-happy. */
+	lm = learned(400000, 0);
+	link_thresholds(lm, &warn, &declare);
+	CHECK(warn == DEADCHECK_MIN_MS, "fast PING, warn %u", warn);
+	CHECK(declare == warn + DEADCHECK_MIN_MS,
+	    "fast PING, declare %u", declare);
+
+	/* Lots of jitter widens the slack, up to the fixed limits. */
+	lm = learned(PING_US, 400000);
+	link_thresholds(lm, &warn, &declare);
+	CHECK(warn <= DEADCHECK_WARN_MS && declare <= DEADCHECK_DECLARE_MS,
+	    "jittery PING, thresholds %u / %u", warn, declare);
+	CHECK(declare > 2 * (lm->stats.period_us / 1000),
+	    "jittery PING, declare %u", declare);
+}
+
+static void
+test_missed(void)
+{
+	struct link_monitor lm;
+	uint32_t t, period;
+
+	link_init(&lm);
+	t = feed(&lm, 0, PING_US, 0, LINK_LEARN_PINGS + 1);
+	period = lm.stats.period_us;
+
+	/* One PING goes missing. */
+	link_ping(&lm, t + 2 * PING_US, 0);
+	CHECK(lm.stats.missed == 1, "missed %u", lm.stats.missed);
+	CHECK(lm.stats.period_us == period, "gap changed the period");
+	CHECK(lm.stats.score < 100, "score %u", lm.stats.score);
+}
+
+/*
+ * Why two periods plus slack rather than 2.5 periods: on a nominal 3.7s
+ * PING (where 2.5x is 9.25s, under the 10s cap) it declares sooner,
+ * yet still rides out a single missing PING at the worst jitter seen.
+ */
+static void
+test_multiplier(void)
+{
+	static const uint32_t jitters_us[] = { 0, 100000, 250000, 500000 };
+	const struct link_monitor *lm;
+	uint32_t warn, declare, period, times, gap, next;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(jitters_us) / sizeof(jitters_us[0]); i++) {
+		lm = learned(PING_US, jitters_us[i]);
+		link_thresholds(lm, &warn, &declare);
+		period = lm->stats.period_us / 1000;
+		times = MIN(DEADCHECK_DECLARE_MS, period * 5 / 2);
+		printf("+/-%u ms jitter: declare %u ms, 2.5x %u ms\n",
+		    jitters_us[i] / 1000, declare, times);
+		CHECK(declare < times, "jitter %u: declare %u vs. 2.5x %u",
+		    jitters_us[i], declare, times);
+
+		/* One PING lost, the next as late as it gets. */
+		gap = 2 * period + 2 * jitters_us[i] / 1000;
+		CHECK(link_deadcheck(lm, gap, false, &next) != LINK_DEAD,
+		    "jitter %u: one missing PING declared at %u",
+		    jitters_us[i], gap);
+	}
+}
+
+static void
+test_detection(void)
+{
+	struct link_monitor fixed;
+	const struct link_monitor *lm;
+	uint32_t warn, declare, first, t_fixed, t_adaptive, next;
+	uint32_t died, confirm;
+
+	/* Old behaviour: fixed thresholds. */
+	link_init(&fixed);
+	t_fixed = time_to_declare(&fixed, DEADCHECK_WARN_MS - PING_US / 1000);
+	CHECK(t_fixed == DEADCHECK_DECLARE_MS, "fixed declared at %u",
+	    t_fixed);
+
+	lm = learned(PING_US, 500);
+	link_thresholds(lm, &warn, &declare);
+	first = warn - PING_US / 1000;
+	t_adaptive = time_to_declare(lm, first);
+	CHECK(t_adaptive == declare, "adaptive declared at %u, not %u",
+	    t_adaptive, declare);
+	CHECK(t_adaptive + 2000 <= t_fixed, "adaptive %u vs. fixed %u",
+	    t_adaptive, t_fixed);
+
+	/* The keyboard still PINGing keeps it alive, even late-ish. */
+	CHECK(link_deadcheck(lm, PING_US / 1000 + 100, false, &next) ==
+	    LINK_ALIVE, "late PING declared");
+
+	/*
+	 * Fast path: the keyboard dies 1s after a PING with the line in
+	 * break.  The reader sees the break after one character time, and
+	 * the deadcheck confirms it DEADCHECK_BREAK_MS later.
+	 */
+	died = 1000;
+	confirm = died + (BREAK_CHAR_US + 999) / 1000 + DEADCHECK_BREAK_MS;
+	CHECK(link_deadcheck(lm, confirm, true, &next) == LINK_DEAD,
+	    "break not declared");
+	CHECK(confirm - died < 100, "break declared after %u ms",
+	    confirm - died);
+
+	/* A glitch that's gone by the time we look is just noise. */
+	CHECK(link_deadcheck(lm, confirm, false, &next) == LINK_ALIVE,
+	    "glitch declared");
+
+	printf("time to declare a dead keyboard: fixed %u ms, "
+	    "adaptive %u ms, line break %u ms\n", t_fixed, t_adaptive,
+	    confirm - died);
+}
+
+int
+main(void)
+{
+	test_unlearned();
+	test_learned();
+	test_clamping();
+	test_missed();
+	test_multiplier();
+	test_detection();
+
+	TEST_EXIT();
+}
@@ -0,0 +1,166 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Stuck special key tracking: which held keys the firmware would
+ * release, and when, for the ways they're held in practice.
+ */
+
+/* Standard headers */
+#include <stdint.h>
+#include <stdio.h>
+
+/* Local headers */
+#include "keymap.h"
+#include "stuck_keys.h"
+#include "test.h"
+
+#define	TIMEOUT_MS		10000
+#define	KEY_A			0x61
+#define	ARROW_RIGHT_DOWN	0xe0	/* repeats */
+
+#define	BIT(c)			(1U << ((c) & 0xf))
+
+/*
+ * Feed the tracker code every period_ms from t until end, checking
+ * for expired keys as the timer would.  Returns when the first key
+ * expired (or end if none did), and the keys in *expiredp.
+ */
+static uint32_t
+run(struct stuck_keys *sk, uint32_t t, uint32_t end, int code,
+    uint32_t period_ms, uint16_t *expiredp)
+{
+	uint32_t next;
+	uint16_t expired;
+
+	for (; t < end; t += period_ms) {
+		if (code >= 0) {
+			stuck_keys_track(sk, (uint8_t)code, t);
+		}
+		expired = stuck_keys_expired(sk, t, TIMEOUT_MS, &next);
+		if (expired != 0) {
+			*expiredp = expired;
+			return t;
+		}
+		CHECK(next > 0 && next <= TIMEOUT_MS, "next %u", next);
+	}
+	*expiredp = 0;
+	return end;
+}
+
+/*
+ * SYM held for 30 seconds while typing in its layer: never released.
+ */
+static void
+test_sym_typing(void)
+{
+	struct stuck_keys sk;
+	uint16_t expired;
+	uint32_t t;
+
+	stuck_keys_init(&sk);
+	stuck_keys_track(&sk, NABU_CODE_SYM_DOWN, 0);
+	t = run(&sk, 500, 30000, KEY_A, 500, &expired);
+	CHECK(expired == 0, "SYM released at %u ms while typing", t);
+	CHECK(sk.held == BIT(NABU_CODE_SYM_DOWN), "held 0x%04x", sk.held);
+
+	/* The key-up comes in, and it's no longer tracked. */
+	stuck_keys_track(&sk, NABU_CODE_KEY_UP(NABU_CODE_SYM_DOWN), 30000);
+	CHECK(sk.held == 0, "held 0x%04x after key-up", sk.held);
+}
+
+/*
+ * SYM's key-up lost, nothing but PINGs after: released at the timeout
+ * after the last key typed.
+ */
+static void
+test_sym_idle(void)
+{
+	struct stuck_keys sk;
+	uint16_t expired;
+	uint32_t t;
+
+	stuck_keys_init(&sk);
+	stuck_keys_track(&sk, NABU_CODE_SYM_DOWN, 0);
+	stuck_keys_track(&sk, KEY_A, 2000);
+	t = run(&sk, 3700, 60000, NABU_CODE_ERR_PING, 3700, &expired);
+	CHECK(expired == BIT(NABU_CODE_SYM_DOWN), "expired 0x%04x", expired);
+	CHECK(t >= 2000 + TIMEOUT_MS && t < 2000 + TIMEOUT_MS + 3700,
+	    "SYM released at %u ms", t);
+}
+
+/*
+ * An arrow key held down repeats; released only once the repeats
+ * stop, even while other keys are being typed.
+ */
+static void
+test_arrow(void)
+{
+	struct stuck_keys sk;
+	uint16_t expired;
+	uint32_t t;
+
+	stuck_keys_init(&sk);
+	t = run(&sk, 0, 30000, ARROW_RIGHT_DOWN, 100, &expired);
+	CHECK(expired == 0, "arrow released at %u ms while repeating", t);
+
+	/* Repeats stop (key-up lost); typing doesn't keep it alive. */
+	t = run(&sk, 30000, 60000, KEY_A, 500, &expired);
+	CHECK(expired == BIT(ARROW_RIGHT_DOWN), "expired 0x%04x", expired);
+	CHECK(t >= 29900 + TIMEOUT_MS && t < 29900 + TIMEOUT_MS + 500,
+	    "arrow released at %u ms", t);
+}
+
+/*
+ * An arrow that stopped repeating and SYM held while typing: only the
+ * arrow is released, and the next check is due when SYM would be.
+ */
+static void
+test_mixed(void)
+{
+	struct stuck_keys sk;
+	uint32_t next;
+	uint16_t expired;
+
+	stuck_keys_init(&sk);
+	stuck_keys_track(&sk, ARROW_RIGHT_DOWN, 0);
+	stuck_keys_track(&sk, NABU_CODE_SYM_DOWN, 1000);
+	stuck_keys_track(&sk, KEY_A, 9000);
+	expired = stuck_keys_expired(&sk, TIMEOUT_MS, TIMEOUT_MS, &next);
+	CHECK(expired == BIT(ARROW_RIGHT_DOWN), "expired 0x%04x", expired);
+	CHECK(next == 9000, "next %u", next);
+}
+
+int
+main(void)
+{
+	test_sym_typing();
+	test_sym_idle();
+	test_arrow();
+	test_mixed();
+
+	TEST_EXIT();
+}
@@ -0,0 +1,167 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Timer service: one-shot and periodic timers that post events to
+ * the main loop.
+ *
+ * The alarms are serviced by the SDK's default alarm pool, whose
+ * interrupt is handled on Core 0.  The events word is only modified
+ * with interrupts disabled (or from the alarm interrupt itself), so
+ * the main loop never misses an event that fires while it's looking.
+ */
+
+/* Pico SDK headers */
+#include "pico/stdlib.h"
+#include "pico/time.h"
+#include "hardware/sync.h"
+
+/* Local headers */
+#include "timer_service.h"
+
+static struct timer {
+	alarm_id_t	id;		/* 0 if not armed */
+	uint32_t	period_us;	/* 0 for one-shot */
+} timers[TIMER_NEVENTS];
+
+static volatile uint32_t timer_posted;
+
+static int64_t
+timer_expired(alarm_id_t id, void *arg)
+{
+	unsigned int ev = (unsigned int)(uintptr_t)arg;
+	struct timer *t = &timers[ev];
+
+	if (t->id != id) {
+		/* Stale; it was re-armed or cancelled out from under us. */
+		return 0;
+	}
+
+	timer_posted |= TIMER_EVENT(ev);
+
+	if (t->period_us != 0) {
+		/*
+		 * Negative means relative to when this one was due, rather
+		 * than to now (no drift).
+		 */
+		return -(int64_t)t->period_us;
+	}
+	t->id = 0;
+	return 0;
+}
+
+static void
+timer_arm(unsigned int ev, uint32_t us, uint32_t period_us)
+{
+	struct timer *t = &timers[ev];
+	uint32_t save;
+	alarm_id_t id;
+
+	timer_cancel(ev);
+
+	/*
+	 * Keep the alarm from going off until we've recorded its ID,
+	 * so the callback can tell that it's current.
+	 */
+	save = save_and_disable_interrupts();
+	t->period_us = period_us;
+	id = add_alarm_in_us(us, timer_expired, (void *)(uintptr_t)ev, false);
+	if (id <= 0) {
+		/* Already due, or out of alarm slots; post it now. */
+		timer_posted |= TIMER_EVENT(ev);
+		id = 0;
+	}
+	t->id = id;
+	restore_interrupts(save);
+}
+
+void
+timer_oneshot(unsigned int ev, uint32_t us)
+{
+	timer_arm(ev, us, 0);
+}
+
+void
+timer_periodic(unsigned int ev, uint32_t period_us)
+{
+	timer_arm(ev, period_us, period_us);
+}
+
+void
+timer_cancel(unsigned int ev)
+{
+	struct timer *t = &timers[ev];
+	alarm_id_t id;
+	uint32_t save;
+
+	save = save_and_disable_interrupts();
+	id = t->id;
+	t->id = 0;
+	timer_posted &= ~TIMER_EVENT(ev);
+	restore_interrupts(save);
+
+	if (id > 0) {
+		cancel_alarm(id);
+	}
+}
+
+bool
+timer_armed_p(unsigned int ev)
+{
+	return timers[ev].id != 0;
+}
+
+bool
+timer_events_pending_p(void)
+{
+	return timer_posted != 0;
+}
+
+/*
+ * Collect (and clear) the events that have been posted.
+ */
+uint32_t
+timer_events(void)
+{
+	uint32_t save, events;
+
+	save = save_and_disable_interrupts();
+	events = timer_posted;
+	timer_posted = 0;
+	restore_interrupts(save);
+
+	return events;
+}
+
+void
+timer_service_init(void)
+{
+	for (unsigned int ev = 0; ev < TIMER_NEVENTS; ev++) {
+		timers[ev].id = 0;
+		timers[ev].period_us = 0;
+	}
+	timer_posted = 0;
+}
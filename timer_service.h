@@ -0,0 +1,52 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _TIMER_SERVICE_H_
+#define	_TIMER_SERVICE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Timers on the RP2040 hardware alarm pool, with microsecond deadlines.
+ * Each timer is identified by an event number; when it expires, the
+ * alarm callback just posts that event, and the main loop picks it up
+ * with timer_events().  No real work is done in interrupt context.
+ */
+
+#define	TIMER_NEVENTS		32
+
+#define	TIMER_EVENT(ev)		(1U << (ev))
+
+void		timer_service_init(void);
+void		timer_oneshot(unsigned int ev, uint32_t us);
+void		timer_periodic(unsigned int ev, uint32_t period_us);
+void		timer_cancel(unsigned int ev);
+bool		timer_armed_p(unsigned int ev);
+bool		timer_events_pending_p(void);
+uint32_t	timer_events(void);
+
+#endif /* _TIMER_SERVICE_H_ */
@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Jason R. Thorpe.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+# IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+# OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+# IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+# INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+# BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+# AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+#
+
+"""
+Show the adapter's counters.
+
+The counters are kept by the firmware at all times and read through the
+"counters" object in the config report, so no console cable is needed.
+With --interval, the counters are polled and the change since the last
+poll is shown next to each one.
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+import nabucfg
+
+# The firmware's count covers uptime_ms as well as the counters proper.
+COUNTERS = (
+    ('uptime_ms', 'uptime (ms)'),
+    ('rx_bytes', 'bytes received'),
+    ('rx_key', '  key codes'),
+    ('rx_joy', '  joystick bytes'),
+    ('rx_status', '  pings / RESETs / errors'),
+    ('rx_ignored', '  ignored codes'),
+    ('queue_drops', 'queue drops'),
+    ('uart_errors', 'UART errors'),
+    ('pings', 'pings'),
+    ('resets', 'RESET notifications'),
+    ('kbd_errors', 'keyboard errors'),
+    ('reboots', 'keyboard reboots'),
+    ('zombie_clears', 'zombie clears'),
+    ('reports_sent', 'reports sent'),
+    ('reports_suppressed', 'reports suppressed'),
+    ('loop_iterations', 'main loop iterations'),
+    ('stuck_releases', 'stuck keys released'),
+)
+
+
+def parse_counters(blob):
+    if len(blob) < 4:
+        raise nabucfg.ConfigError('firmware has no counters')
+    version, count = struct.unpack_from('<HH', blob)
+    count = min(count, (len(blob) - 4) // 4)
+    values = struct.unpack_from('<%uI' % count, blob, 4)
+    names = []
+    for i in range(count):
+        names.append(COUNTERS[i] if i < len(COUNTERS) else
+                     ('counter%u' % i, 'counter %u' % i))
+    return version, list(zip(names, values))
+
+
+def show(counters, last=None):
+    for i, ((name, label), value) in enumerate(counters):
+        if last is not None and i < len(last):
+            delta = (value - last[i][1]) & 0xffffffff
+            print('%-28s %10u %+10d' % (label, value, delta))
+        else:
+            print('%-28s %10u' % (label, value))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[1])
+    parser.add_argument('-i', '--interval', type=float,
+                        help='poll every this many seconds')
+    parser.add_argument('--reset', action='store_true',
+                        help='clear the counters after reading them')
+    args = parser.parse_args()
+
+    try:
+        adapter = nabucfg.Adapter()
+        last = None
+        while True:
+            version, counters = parse_counters(
+                adapter.read(nabucfg.CFG_OBJ_COUNTERS))
+            if args.reset:
+                adapter.reset(nabucfg.CFG_OBJ_COUNTERS)
+            show(counters, last)
+            if not args.interval:
+                break
+            last = counters
+            time.sleep(args.interval)
+            print()
+    except (OSError, nabucfg.ConfigError) as e:
+        sys.exit('counters: %s' % e)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Jason R. Thorpe.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+# IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+# OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+# IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+# INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+# BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+# AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+#
+
+"""
+Dump the adapter's binary event trace.
+
+The firmware has to be configured with a non-zero NABU_KBD_TRACE_MASK.
+Reading the trace freezes the ring on the adapter until the whole thing
+has been read, so the dump is consistent.  Each event is printed with
+its time relative to the newest one, and the time since the previous
+event.
+"""
+
+import argparse
+import struct
+import sys
+
+import nabucfg
+
+EVENTS = {
+    1: ('RX', 'byte'),
+    2: ('ENQUEUE', 'byte'),
+    3: ('DROP', 'byte'),
+    4: ('DEQUEUE', 'byte'),
+    5: ('KBD_REPORT', 'key'),
+    6: ('JOY_REPORT', 'joy'),
+    7: ('READY', 'itf'),
+    8: ('SUSPEND', 'wakeup'),
+    9: ('RESUME', None),
+    10: ('REBOOT', 'state'),
+    11: ('KBD_ERR', 'byte'),
+    12: ('MOUNT', 'mounted'),
+}
+
+TRACE_EV_TIME = 0
+
+REBOOT_STATES = ('IDLE', 'OFF', 'AWAIT')
+
+
+def parse_trace(blob):
+    if len(blob) < 16:
+        raise nabucfg.ConfigError('firmware has no trace '
+                                  '(configure with NABU_KBD_TRACE_MASK)')
+    version, recsize, count, last_us, lost, mask = struct.unpack_from(
+        '<BBHIII', blob)
+    recs = []
+    high = 0
+    for i in range(count):
+        delta, ev, arg = struct.unpack_from('<HBB', blob, 16 + i * recsize)
+        if ev == TRACE_EV_TIME:
+            high += delta << 16
+            continue
+        recs.append((high + delta, ev, arg))
+        high = 0
+    return last_us, lost, mask, recs
+
+
+def fmt_arg(ev, arg):
+    kind = EVENTS.get(ev, (None, 'arg'))[1]
+    if kind is None:
+        return ''
+    if kind == 'byte':
+        return '0x%02x' % arg
+    if kind == 'joy':
+        return 'stick %u data 0x%02x' % (arg >> 5, arg & 0x1f)
+    if kind == 'state' and arg < len(REBOOT_STATES):
+        return REBOOT_STATES[arg]
+    return '%s %u' % (kind, arg)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[1])
+    parser.add_argument('--reset', action='store_true',
+                        help='clear the trace after dumping it')
+    args = parser.parse_args()
+
+    try:
+        adapter = nabucfg.Adapter()
+        last_us, lost, mask, recs = parse_trace(
+            adapter.read(nabucfg.CFG_OBJ_TRACE))
+        if args.reset:
+            adapter.reset(nabucfg.CFG_OBJ_TRACE)
+        adapter.close()
+    except (OSError, nabucfg.ConfigError) as e:
+        sys.exit('trace: %s' % e)
+
+    # Work back from the newest record to get times relative to it.
+    t = 0
+    times = []
+    for delta, _, _ in reversed(recs):
+        times.append(t)
+        t -= delta
+    times.reverse()
+
+    print('# %u events, mask 0x%08x, %u missed during earlier dumps' % (
+        len(recs), mask, lost))
+    for (delta, ev, arg), t in zip(recs, times):
+        name = EVENTS.get(ev, ('EV%u' % ev, 'arg'))[0]
+        print('%12.3f ms %+10u us  %-10s %s' % (t / 1000, delta, name,
+                                                fmt_arg(ev, arg)))
+
+
+if __name__ == '__main__':
+    main()
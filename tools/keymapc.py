@@ -0,0 +1,380 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Jason R. Thorpe.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+# IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+# OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+# IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+# INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+# BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+# AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+#
+
+"""
+Compile a keymap source file into a C struct keymap initializer.
+
+Each non-blank line of the source maps one NABU code (optionally in a
+layer) to an entry; '#' starts a comment:
+
+    layout US                   label the keymap with a host layout
+    0x01        C-a             Ctrl + A, wrapped in modifier presses
+    'A'         S-a             quoted characters are NABU codes too
+    0xe0        down ARROW_RIGHT
+    0xf0        up ARROW_RIGHT
+    0xe8        down M-none     sticky modifier (Meta)
+    0xe7        hold S-BACKSLASH
+    0xf7        seq S-none, none
+    sym '1'     F1              layers: sym, tv, sym+tv
+
+Keys are TinyUSB HID_KEY_* names without the prefix (case doesn't matter).
+Modifiers are C (Ctrl), S (Shift), A (Alt), M (Meta), and G (AltGr).
+"seq" gives a literal sequence of reports, which must end with "none" or
+a "hold" report.
+
+Every sequence is checked the same way the firmware checks an uploaded
+keymap, and a cost report (reports per keystroke, and the worst-case time
+to send them at the configured report interval) is written out as well.
+"""
+
+import argparse
+import os
+import re
+import sys
+
+MODS = {
+    'C': ('M_CTRL', 0x0100),
+    'S': ('M_SHIFT', 0x0200),
+    'A': ('M_ALT', 0x0400),
+    'M': ('M_META', 0x0800),
+    'G': ('M_ALTGR', 0x8000),
+}
+MOD_ORDER = 'CSAMG'
+
+LAYERS = {
+    '': 0,
+    'sym': 1,
+    'tv': 2,
+    'sym+tv': 3,
+    'tv+sym': 3,
+}
+LAYER_NAMES = ['0', 'KEYMAP_LAYER_SYM', 'KEYMAP_LAYER_TV',
+               'KEYMAP_LAYER_SYM | KEYMAP_LAYER_TV']
+
+LAYOUTS = ['US', 'UK', 'DE', 'FR', 'JP']
+
+NEXCEPTIONS = 8
+SEQLEN = 6
+
+# Codes the reader thread never passes along as keystrokes.
+RESERVED = {0x80, 0x81} | set(range(0x90, 0x96)) | set(range(0xa0, 0xc0))
+
+HID_KEYS = set(
+    [chr(c) for c in range(ord('A'), ord('Z') + 1)] +
+    [str(d) for d in range(10)] +
+    ['F%d' % n for n in range(1, 25)] +
+    ['KEYPAD_%d' % d for d in range(10)] +
+    ['KANJI%d' % n for n in range(1, 10)] +
+    ['LANG%d' % n for n in range(1, 10)] +
+    '''NONE ENTER ESCAPE BACKSPACE TAB SPACE MINUS EQUAL BRACKET_LEFT
+    BRACKET_RIGHT BACKSLASH EUROPE_1 SEMICOLON APOSTROPHE GRAVE COMMA
+    PERIOD SLASH CAPS_LOCK PRINT_SCREEN SCROLL_LOCK PAUSE INSERT HOME
+    PAGE_UP DELETE END PAGE_DOWN ARROW_RIGHT ARROW_LEFT ARROW_DOWN
+    ARROW_UP NUM_LOCK KEYPAD_DIVIDE KEYPAD_MULTIPLY KEYPAD_SUBTRACT
+    KEYPAD_ADD KEYPAD_ENTER KEYPAD_DECIMAL EUROPE_2 APPLICATION POWER
+    KEYPAD_EQUAL EXECUTE HELP MENU SELECT STOP AGAIN UNDO CUT COPY PASTE
+    FIND MUTE VOLUME_UP VOLUME_DOWN'''.split())
+
+
+class KeymapError(Exception):
+    pass
+
+
+class Report:
+    """One report: a set of modifiers and a HID key."""
+
+    def __init__(self, mods, key, hold=False):
+        self.mods = mods        # string of MOD_ORDER letters
+        self.key = key          # HID key name
+        self.hold = hold
+
+    def nmods(self):
+        return len(self.mods)
+
+    def c_expr(self):
+        terms = [MODS[m][0] for m in MOD_ORDER if m in self.mods]
+        if self.hold:
+            terms.append('M_ENDSEQ')
+        if self.key != 'NONE' or not terms:
+            terms.append('HID_KEY_' + self.key)
+        return ' | '.join(terms)
+
+    def value(self):
+        v = 0
+        for m in self.mods:
+            v |= MODS[m][1]
+        return (v, self.key, self.hold)
+
+
+class Entry:
+    """A keymap entry: wrapped key, down/up event, or literal sequence."""
+
+    def __init__(self, kind, reports):
+        self.kind = kind        # 'wrap', 'hold', 'down', 'up', 'seq'
+        self.reports = reports
+
+    def cost(self):
+        """Number of reports sent for one keystroke."""
+        if self.kind in ('down', 'up'):
+            return 1
+        if self.kind == 'seq':
+            return len(self.reports)
+        n = self.reports[0].nmods()
+        return n + 1 if self.kind == 'hold' else 2 * n + 2
+
+
+def parse_report(text, lineno):
+    m = re.fullmatch(r'(?:((?:[CSAMG]-)+))?([A-Za-z0-9_]+)', text.strip())
+    if m is None:
+        raise KeymapError('line %d: bad report "%s"' % (lineno, text))
+    mods = ''.join((m.group(1) or '').split('-'))
+    key = m.group(2).upper()
+    if key not in HID_KEYS:
+        raise KeymapError('line %d: unknown HID key "%s"' % (lineno, key))
+    if len(set(mods)) != len(mods):
+        raise KeymapError('line %d: repeated modifier in "%s"' %
+                          (lineno, text))
+    return Report(mods, key)
+
+
+def parse_entry(text, lineno):
+    words = text.split(None, 1)
+    if words[0] in ('down', 'up', 'hold') and len(words) == 2:
+        r = parse_report(words[1], lineno)
+        if words[0] == 'hold':
+            r.hold = True
+        return Entry(words[0], [r])
+    if words[0] == 'seq' and len(words) == 2:
+        reports = []
+        for part in words[1].split(','):
+            part = part.strip()
+            hold = part.startswith('hold ')
+            r = parse_report(part[5:] if hold else part, lineno)
+            r.hold = hold
+            reports.append(r)
+        return Entry('seq', reports)
+    return Entry('wrap', [parse_report(text, lineno)])
+
+
+def parse_code(text, lineno):
+    if re.fullmatch(r"'(\\.|[^\\])'", text):
+        ch = text[1:-1]
+        if ch.startswith('\\'):
+            ch = {'\\\\': '\\', "\\'": "'"}.get(ch)
+            if ch is None:
+                raise KeymapError('line %d: bad escape %s' % (lineno, text))
+        return ord(ch)
+    try:
+        code = int(text, 0)
+    except ValueError:
+        raise KeymapError('line %d: bad NABU code "%s"' % (lineno, text))
+    if not 0 <= code <= 0xff:
+        raise KeymapError('line %d: NABU code out of range' % lineno)
+    return code
+
+
+def check_entry(code, entry, lineno):
+    if code in RESERVED:
+        raise KeymapError('line %d: code 0x%02x is not a keystroke' %
+                          (lineno, code))
+    r = entry.reports[0]
+    if entry.kind in ('down', 'up'):
+        return
+    if entry.kind == 'wrap' and r.nmods() > 2:
+        # Press, key, and release have to fit in the sequence.
+        raise KeymapError('line %d: too many modifiers (%d steps > %d)' %
+                          (lineno, entry.cost(), SEQLEN))
+    if entry.kind != 'seq':
+        return
+
+    # Literal sequences: must fit, and must terminate.
+    if len(entry.reports) > SEQLEN:
+        raise KeymapError('line %d: sequence has %d steps (max %d)' %
+                          (lineno, len(entry.reports), SEQLEN))
+    last = entry.reports[-1]
+    if not (last.hold or (last.key == 'NONE' and not last.mods)):
+        raise KeymapError('line %d: sequence must end with "none" or a '
+                          '"hold" report' % lineno)
+    for i, r in enumerate(entry.reports):
+        if r.hold and i != len(entry.reports) - 1:
+            raise KeymapError('line %d: "hold" must be the last step' %
+                              lineno)
+        if r.key == 'NONE' and not r.mods and i != len(entry.reports) - 1:
+            raise KeymapError('line %d: "none" ends the sequence early' %
+                              lineno)
+
+    # Balanced modifiers: a modifier has to be down before the key that
+    # goes with it, or the host may see the key first.
+    held = ''
+    for r in entry.reports:
+        new = [m for m in r.mods if m not in held]
+        if new and r.key != 'NONE':
+            raise KeymapError('line %d: modifier %s pressed together '
+                              'with %s' % (lineno, new[0], r.key))
+        held = r.mods
+
+
+def compile_keymap(lines):
+    layout = 'LAYOUT_CUSTOM'
+    layers = [dict() for _ in range(4)]
+    for lineno, line in enumerate(lines, 1):
+        line = re.sub(r'(^|\s)#.*$', '', line).strip()
+        if not line:
+            continue
+        words = line.split(None, 1)
+        if words[0] == 'layout':
+            if len(words) != 2 or words[1].upper() not in LAYOUTS:
+                raise KeymapError('line %d: unknown layout' % lineno)
+            layout = 'LAYOUT_' + words[1].upper()
+            continue
+        layer = 0
+        if words[0] in LAYERS and words[0]:
+            layer = LAYERS[words[0]]
+            words = words[1].split(None, 1)
+        if len(words) != 2:
+            raise KeymapError('line %d: expected "<code> <entry>"' % lineno)
+        code = parse_code(words[0], lineno)
+        entry = parse_entry(words[1], lineno)
+        check_entry(code, entry, lineno)
+        if code in layers[layer]:
+            raise KeymapError('line %d: code 0x%02x is already mapped' %
+                              (lineno, code))
+        layers[layer][code] = (entry, lineno)
+
+    # Literal sequences go in the exception list, once each.
+    exceptions = []
+    for layer in layers:
+        for entry, lineno in layer.values():
+            if entry.kind != 'seq':
+                continue
+            key = [r.value() for r in entry.reports]
+            if key not in [[r.value() for r in e] for e in exceptions]:
+                if len(exceptions) == NEXCEPTIONS:
+                    raise KeymapError('line %d: more than %d literal '
+                                      'sequences' % (lineno, NEXCEPTIONS))
+                exceptions.append(entry.reports)
+            entry.index = [[r.value() for r in e]
+                           for e in exceptions].index(key)
+    return layout, layers, exceptions
+
+
+def entry_c_expr(entry):
+    r = entry.reports[0]
+    if entry.kind == 'seq':
+        return 'M_EXCEPTION | %d' % entry.index
+    expr = r.c_expr()
+    if entry.kind == 'down':
+        return 'M_DOWN | ' + expr
+    if entry.kind == 'up':
+        return 'M_UP | ' + expr
+    return expr
+
+
+def code_comment(code):
+    if 0x20 < code < 0x7f:
+        return "'%s'" % chr(code)
+    return ''
+
+
+def emit_c(out, source, layout, layers, exceptions):
+    out.write('/* Generated by tools/keymapc.py from %s; do not edit. */\n'
+              % os.path.basename(source))
+    out.write('\n#include "tusb.h"\n\n#include "keymap.h"\n\n')
+    out.write('const struct keymap keymap_builtin = {\n\t.map = {\n')
+    for n, layer in enumerate(layers):
+        if n != 0 and not layer:
+            continue
+        out.write('\t[%s] = {\n' % LAYER_NAMES[n])
+        for code in sorted(layer):
+            entry, _ = layer[code]
+            comment = code_comment(code)
+            out.write('\t\t[0x%02x] = %s,%s\n' % (
+                code, entry_c_expr(entry),
+                ('\t/* %s */' % comment) if comment else ''))
+        out.write('\t},\n')
+    out.write('\t},\n\t.exceptions = {\n')
+    for n, reports in enumerate(exceptions):
+        exprs = [('0' if (r.key == 'NONE' and not r.mods and not r.hold)
+                  else r.c_expr()) for r in reports]
+        if exprs[-1] != '0' and len(exprs) < SEQLEN:
+            exprs.append('0')
+        out.write('\t\t[%d] = { { %s } },\n' % (n, ', '.join(exprs)))
+    out.write('\t},\n\t.layout = %s,\n};\n' % layout)
+
+
+def emit_cost(out, source, layers, interval):
+    out.write('# Keymap cost report for %s\n' % os.path.basename(source))
+    out.write('# Reports per keystroke, and the worst-case time from the '
+              'code arriving\n# to the last report being sent, at a %u ms '
+              'report interval.\n\n' % interval)
+    out.write('%-8s %-6s %-8s %s\n' % ('layer', 'code', 'reports', 'ms'))
+    costs = []
+    for n, layer in enumerate(layers):
+        for code in sorted(layer):
+            entry, _ = layer[code]
+            cost = entry.cost()
+            costs.append(cost)
+            out.write('%-8s 0x%02x   %-8u %u\n' % (
+                ['base', 'sym', 'tv', 'sym+tv'][n], code, cost,
+                cost * interval))
+    if costs:
+        out.write('\n# %u codes; mean %.2f reports (%.1f ms), '
+                  'worst %u reports (%u ms)\n' % (
+                      len(costs), sum(costs) / len(costs),
+                      sum(costs) / len(costs) * interval,
+                      max(costs), max(costs) * interval))
+    return costs
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[1])
+    parser.add_argument('source')
+    parser.add_argument('-o', '--output', required=True,
+                        help='generated C file')
+    parser.add_argument('--cost', help='write the cost report here')
+    parser.add_argument('--interval', type=int, default=10,
+                        help='report interval in ms (default 10)')
+    args = parser.parse_args()
+
+    try:
+        with open(args.source) as f:
+            layout, layers, exceptions = compile_keymap(f.readlines())
+    except (OSError, KeymapError) as e:
+        sys.exit('%s: %s' % (args.source, e))
+
+    with open(args.output, 'w') as out:
+        emit_c(out, args.source, layout, layers, exceptions)
+    if args.cost:
+        with open(args.cost, 'w') as out:
+            costs = emit_cost(out, args.source, layers, args.interval)
+        print('keymap: %u codes, worst case %u reports (%u ms)' % (
+            len(costs), max(costs, default=0),
+            max(costs, default=0) * args.interval))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Jason R. Thorpe.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+# IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+# OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+# IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+# INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+# BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+# AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+#
+
+"""
+Show the adapter's end-to-end latency histograms.
+
+The firmware has to be configured with NABU_KBD_LATENCY=ON.  For each
+source (keyboard, joystick 0, joystick 1), the time from a byte arriving
+from the keyboard to the host picking up its report is broken down into
+stages:
+
+    queue       UART RX -> dequeued by the data processing task
+    process     dequeued -> report submitted to TinyUSB
+    host        submitted -> transfer complete (the host's poll)
+    total       UART RX -> transfer complete
+
+Buckets are powers of 2 in microseconds.  A slow "queue" stage points at
+the report tick or a backlog, and a slow "host" stage at the host's
+polling.
+"""
+
+import argparse
+import struct
+import sys
+
+import nabucfg
+
+SOURCES = ('keyboard', 'joystick 0', 'joystick 1')
+STAGES = ('queue', 'process', 'host', 'total')
+
+BAR_WIDTH = 40
+
+
+def parse_hist(blob):
+    if len(blob) < 4:
+        raise nabucfg.ConfigError('firmware has no latency histograms '
+                                  '(configure with NABU_KBD_LATENCY=ON)')
+    nsrc, nstages, nbuckets = struct.unpack_from('<BBB', blob)
+    counts = struct.unpack_from('<%uI' % (nsrc * nstages * nbuckets),
+                                blob, 4)
+    hist = []
+    for src in range(nsrc):
+        hist.append([])
+        for stage in range(nstages):
+            base = (src * nstages + stage) * nbuckets
+            hist[src].append(list(counts[base:base + nbuckets]))
+    return hist
+
+
+def bucket_label(b):
+    return '<2us' if b == 0 else '>=%s' % fmt_us(1 << b)
+
+
+def fmt_us(us):
+    if us >= 1000:
+        return '%.3gms' % (us / 1000)
+    return '%uus' % us
+
+
+def percentile(buckets, p):
+    """Upper bound of the bucket holding the p'th percentile."""
+    total = sum(buckets)
+    seen = 0
+    for b, n in enumerate(buckets):
+        seen += n
+        if seen * 100 >= total * p:
+            return fmt_us(2 << b) if b < len(buckets) - 1 else 'more'
+    return '-'
+
+
+def plot(hist):
+    for src, stages in enumerate(hist):
+        name = SOURCES[src] if src < len(SOURCES) else 'source %u' % src
+        for stage, buckets in enumerate(stages):
+            total = sum(buckets)
+            if total == 0:
+                continue
+            sname = STAGES[stage] if stage < len(STAGES) else str(stage)
+            print('%s, %s: %u samples, p50 < %s, p90 < %s, p99 < %s' % (
+                name, sname, total, percentile(buckets, 50),
+                percentile(buckets, 90), percentile(buckets, 99)))
+            peak = max(buckets)
+            for b, n in enumerate(buckets):
+                if n == 0:
+                    continue
+                print('  %9s %8u %s' % (bucket_label(b), n,
+                                         '#' * max(1, n * BAR_WIDTH // peak)))
+            print()
+
+
+def emit_csv(hist):
+    print('source,stage,bucket_us,count')
+    for src, stages in enumerate(hist):
+        for stage, buckets in enumerate(stages):
+            for b, n in enumerate(buckets):
+                print('%u,%u,%u,%u' % (src, stage, 0 if b == 0 else 1 << b,
+                                       n))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[1])
+    parser.add_argument('--csv', action='store_true',
+                        help='print raw bucket counts as CSV')
+    parser.add_argument('--reset', action='store_true',
+                        help='clear the histograms after reading them')
+    args = parser.parse_args()
+
+    try:
+        adapter = nabucfg.Adapter()
+        hist = parse_hist(adapter.read(nabucfg.CFG_OBJ_LATENCY))
+        if args.reset:
+            adapter.reset(nabucfg.CFG_OBJ_LATENCY)
+        adapter.close()
+    except (OSError, nabucfg.ConfigError) as e:
+        sys.exit('latency: %s' % e)
+
+    if args.csv:
+        emit_csv(hist)
+    else:
+        plot(hist)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Jason R. Thorpe.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+# IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+# OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+# IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+# INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+# BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+# AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+#
+
+
+"""
+Show the health of the keyboard link.
+
+The firmware times the keyboard's periodic PINGs and keeps the smoothed
+period and jitter, the number of PINGs that never arrived, and the drift
+of the period since it was first learned, and rolls these up (along with
+recent UART errors) into a 0 - 100 health score.  They're read through
+the "link" object in the config report.
+"""
+
+import argparse
+import struct
+import sys
+
+import nabucfg
+
+LINK_FMT = '<BBHIIIIiIII8I'
+
+BUCKETS = ('< 250us', '< 500us', '< 1ms', '< 2ms', '< 4ms', '< 8ms',
+           '< 16ms', '>= 16ms')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[1])
+    parser.add_argument('--reset', action='store_true',
+                        help='forget the link statistics after reading them')
+    args = parser.parse_args()
+
+    try:
+        adapter = nabucfg.Adapter()
+        blob = adapter.read(nabucfg.CFG_OBJ_LINK)
+        if args.reset:
+            adapter.reset(nabucfg.CFG_OBJ_LINK)
+    except (OSError, nabucfg.ConfigError) as e:
+        sys.exit('link: %s' % e)
+
+    if len(blob) < struct.calcsize(LINK_FMT):
+        sys.exit('link: short link object (%u bytes)' % len(blob))
+    (version, score, _, intervals, missed, period, baseline, drift,
+     jitter, lo, hi, *hist) = struct.unpack_from(LINK_FMT, blob)
+
+    print('health score          %10u' % score)
+    print('PING intervals        %10u' % intervals)
+    print('missed PINGs          %10u' % missed)
+    if intervals == 0:
+        return
+    print('period (us)           %10u' % period)
+    print('  min / max           %10u / %u' % (lo, hi))
+    print('jitter (us)           %10u' % jitter)
+    if baseline:
+        print('baseline period (us)  %10u' % baseline)
+        print('drift (ppm)           %+10d' % drift)
+    else:
+        print('baseline period       (still learning)')
+    print('deviation from period:')
+    total = sum(hist)
+    for label, n in zip(BUCKETS, hist):
+        pct = 100.0 * n / total if total else 0.0
+        print('  %-8s %10u  %5.1f%%' % (label, n, pct))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Jason R. Thorpe.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+# IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+# OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+# IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+# INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+# BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+# AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+#
+
+"""
+Access the adapter's config feature report from the host.
+
+The config report (see nabu_keyboard_usb.c) is a vendor-defined feature
+report on the keyboard interface.  Read-only objects are read out by
+selecting them and then issuing GET_REPORT until a short chunk comes
+back, and reset with the RESET op.  This uses the hidapi Python module
+("pip install hidapi").
+"""
+
+import struct
+
+USB_VID = 0x4160
+USB_PID = 0x0000
+
+ITF_NUM_KBD = 0
+REPORT_ID_CONFIG = 2
+
+CONFIG_REPORT_HDR_SIZE = 4
+CONFIG_REPORT_DATA_SIZE = 32
+
+CFG_OP_SELECT = 1
+CFG_OP_WRITE = 2
+CFG_OP_COMMIT = 3
+CFG_OP_RESET = 4
+
+CFG_STATUS = {
+    0: 'OK',
+    1: 'EINVAL',
+    2: 'EBADDATA',
+    3: 'EIO',
+}
+
+CFG_OBJ_KEYMAP = 1
+CFG_OBJ_LAYOUT = 2
+CFG_OBJ_MACROS = 3
+CFG_OBJ_SETTINGS = 4
+CFG_OBJ_SOF = 5
+CFG_OBJ_LATENCY = 6
+CFG_OBJ_COUNTERS = 7
+CFG_OBJ_PROFILE = 8
+CFG_OBJ_TRACE = 9
+CFG_OBJ_LINK = 10
+
+
+class ConfigError(Exception):
+    pass
+
+
+class Adapter:
+    def __init__(self, path=None):
+        try:
+            import hid
+        except ImportError:
+            raise ConfigError('the hidapi module is needed '
+                              '("pip install hidapi")')
+        if path is None:
+            for info in hid.enumerate(USB_VID, USB_PID):
+                if info['interface_number'] == ITF_NUM_KBD:
+                    path = info['path']
+                    break
+            else:
+                raise ConfigError('no adapter found')
+        self.dev = hid.device()
+        self.dev.open_path(path)
+
+    def close(self):
+        self.dev.close()
+
+    def set(self, op, obj, offset=0, data=b''):
+        report = struct.pack('<BBBH', REPORT_ID_CONFIG, op, obj, offset)
+        report += bytes(data).ljust(CONFIG_REPORT_DATA_SIZE, b'\0')
+        self.dev.send_feature_report(report)
+
+    def get(self):
+        # hidapi hands back the report ID in the first byte.
+        report = bytes(self.dev.get_feature_report(REPORT_ID_CONFIG,
+            1 + CONFIG_REPORT_HDR_SIZE + CONFIG_REPORT_DATA_SIZE))[1:]
+        status, obj, offset = struct.unpack_from('<BBH', report)
+        return status, obj, offset, report[CONFIG_REPORT_HDR_SIZE:]
+
+    def check(self, what):
+        status = self.get()[0]
+        if status != 0:
+            raise ConfigError('%s failed: %s' % (
+                what, CFG_STATUS.get(status, str(status))))
+
+    def read(self, obj):
+        """Read out a whole object."""
+        self.set(CFG_OP_SELECT, obj)
+        status, _, offset, data = self.get()
+        if status != 0:
+            raise ConfigError('select object %u failed: %s' % (
+                obj, CFG_STATUS.get(status, str(status))))
+        # Each chunk's length is the difference from the next offset.
+        blob = b''
+        while True:
+            _, _, next_offset, next_data = self.get()
+            n = next_offset - offset
+            blob += data[:n]
+            if n < CONFIG_REPORT_DATA_SIZE:
+                return blob
+            offset, data = next_offset, next_data
+
+    def reset(self, obj):
+        self.set(CFG_OP_RESET, obj)
+        self.check('reset object %u' % obj)
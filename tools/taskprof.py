@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2022 Jason R. Thorpe.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+# IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+# OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+# IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+# INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+# BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+# AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+#
+
+"""
+Show the adapter's per-task cycle profile.
+
+The firmware has to be configured with NABU_KBD_PROFILE=ON.  For each
+main loop task, the reader on Core 1 (per byte), and the busy part of
+each main loop pass, this prints the number of calls and the min, mean
+and max cycles per call.  Times are worked out at the full system clock
+speed; while the clock governor has the clock slowed down, a cycle
+takes longer.
+"""
+
+import argparse
+import struct
+import sys
+
+import nabucfg
+
+SLOTS = ('led_task', 'kbd_deadcheck', 'hid_task', 'tud_task',
+         'reader (core 1)', 'main loop pass')
+
+
+def parse_profile(blob):
+    if len(blob) < 8:
+        raise nabucfg.ConfigError('firmware has no profile '
+                                  '(configure with NABU_KBD_PROFILE=ON)')
+    nslots, sys_hz = struct.unpack_from('<B3xI', blob)
+    slots = []
+    for i in range(nslots):
+        cycles, calls, cmin, cmax = struct.unpack_from('<QIII', blob,
+                                                       8 + i * 24)
+        slots.append((SLOTS[i] if i < len(SLOTS) else 'slot %u' % i,
+                      calls, cmin, cycles // calls if calls else 0, cmax))
+    return sys_hz, slots
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[1])
+    parser.add_argument('--reset', action='store_true',
+                        help='clear the profile after reading it')
+    args = parser.parse_args()
+
+    try:
+        adapter = nabucfg.Adapter()
+        sys_hz, slots = parse_profile(
+            adapter.read(nabucfg.CFG_OBJ_PROFILE))
+        if args.reset:
+            adapter.reset(nabucfg.CFG_OBJ_PROFILE)
+        adapter.close()
+    except (OSError, nabucfg.ConfigError) as e:
+        sys.exit('profile: %s' % e)
+
+    mhz = sys_hz / 1e6
+    print('%-16s %10s %10s %10s %10s %10s' % (
+        'task', 'calls', 'min', 'mean', 'max', 'max (us)'))
+    for name, calls, cmin, mean, cmax in slots:
+        if calls == 0:
+            print('%-16s %10u' % (name, 0))
+            continue
+        print('%-16s %10u %10u %10u %10u %10.1f' % (
+            name, calls, cmin, mean, cmax, cmax / mhz))
+    print('(cycles at %.0f MHz)' % mhz)
+
+
+if __name__ == '__main__':
+    main()
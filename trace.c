@@ -0,0 +1,180 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Binary event trace ring; see trace.h.
+ *
+ * Records are logged from both cores, so the ring is protected by a
+ * hardware spin lock.  Dumping the ring takes many GET_REPORTs, so
+ * reading from offset 0 freezes it, and reading the last of it thaws
+ * it again; events that come in while it's frozen are only counted.
+ */
+
+/* Pico SDK headers */
+#include "pico/stdlib.h"
+#include "pico/sync.h"
+
+/* Standard headers */
+#include <string.h>
+
+/* Local headers */
+#include "trace.h"
+
+#if TRACE_MASK != 0
+
+#define	TRACE_MASK_IDX		(TRACE_NRECS - 1)
+#define	TRACE_VERSION		1
+
+struct trace_rec {
+	uint16_t	delta;
+	uint8_t		ev;
+	uint8_t		arg;
+};
+
+/* What the dump starts with. */
+struct trace_hdr {
+	uint8_t		version;
+	uint8_t		recsize;
+	uint16_t	count;		/* records that follow */
+	uint32_t	last_us;	/* time of the newest record */
+	uint32_t	lost;		/* events missed while dumping */
+	uint32_t	mask;		/* TRACE_MASK */
+};
+
+static struct trace_rec trace_ring[TRACE_NRECS];
+
+static struct {
+	spin_lock_t	*lock;
+	unsigned int	head;		/* next record to write */
+	unsigned int	count;
+	uint32_t	last_us;
+	uint32_t	lost;
+	bool		frozen;
+} trace_context;
+
+void
+trace_init(void)
+{
+	trace_context.lock = spin_lock_init(spin_lock_claim_unused(true));
+	trace_context.last_us = time_us_32();
+}
+
+static void
+trace_put(unsigned int ev, uint8_t arg, uint16_t delta)
+{
+	trace_ring[trace_context.head] = (struct trace_rec) {
+		.delta	=	delta,
+		.ev	=	ev,
+		.arg	=	arg,
+	};
+	trace_context.head = (trace_context.head + 1) & TRACE_MASK_IDX;
+	if (trace_context.count < TRACE_NRECS) {
+		trace_context.count++;
+	}
+}
+
+void
+trace_log(unsigned int ev, uint8_t arg)
+{
+	uint32_t save, now, delta;
+
+	save = spin_lock_blocking(trace_context.lock);
+	if (trace_context.frozen) {
+		trace_context.lost++;
+	} else {
+		now = time_us_32();
+		delta = now - trace_context.last_us;
+		if (delta > UINT16_MAX) {
+			trace_put(TRACE_EV_TIME, 0, delta >> 16);
+		}
+		trace_put(ev, arg, delta & UINT16_MAX);
+		trace_context.last_us = now;
+	}
+	spin_unlock(trace_context.lock, save);
+}
+
+/*
+ * Read the dump: the header, then the records oldest first.
+ */
+size_t
+trace_read(size_t offset, uint8_t *buf, size_t len)
+{
+	struct trace_hdr hdr;
+	const uint8_t *rec;
+	unsigned int first;
+	size_t total, n, idx;
+	uint32_t save;
+
+	save = spin_lock_blocking(trace_context.lock);
+	if (offset == 0) {
+		trace_context.frozen = true;
+	}
+
+	hdr = (struct trace_hdr) {
+		.version	=	TRACE_VERSION,
+		.recsize	=	sizeof(struct trace_rec),
+		.count		=	trace_context.count,
+		.last_us	=	trace_context.last_us,
+		.lost		=	trace_context.lost,
+		.mask		=	TRACE_MASK,
+	};
+	total = sizeof(hdr) + trace_context.count * sizeof(struct trace_rec);
+	first = trace_context.head - trace_context.count;
+
+	for (n = 0; n < len && offset + n < total; n++) {
+		if (offset + n < sizeof(hdr)) {
+			buf[n] = ((const uint8_t *)&hdr)[offset + n];
+			continue;
+		}
+		idx = offset + n - sizeof(hdr);
+		rec = (const uint8_t *)&trace_ring[(first +
+		    idx / sizeof(struct trace_rec)) & TRACE_MASK_IDX];
+		buf[n] = rec[idx % sizeof(struct trace_rec)];
+	}
+
+	if (offset + n >= total) {
+		trace_context.frozen = false;
+	}
+	spin_unlock(trace_context.lock, save);
+
+	return n;
+}
+
+void
+trace_reset(void)
+{
+	uint32_t save;
+
+	save = spin_lock_blocking(trace_context.lock);
+	trace_context.head = 0;
+	trace_context.count = 0;
+	trace_context.lost = 0;
+	trace_context.frozen = false;
+	trace_context.last_us = time_us_32();
+	spin_unlock(trace_context.lock, save);
+}
+
+#endif /* TRACE_MASK */
@@ -0,0 +1,81 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _TRACE_H_
+#define	_TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary event trace.  Each record is 4 bytes: a 16-bit timestamp delta
+ * (microseconds since the previous record), an event, and an 8-bit
+ * argument.  A gap too long for 16 bits is preceded by a TRACE_EV_TIME
+ * record whose delta is the high 16 bits of the gap.  Records go into a
+ * fixed RAM ring, oldest overwritten first, and are dumped using the
+ * "trace" config object.
+ *
+ * Tracepoints are selected at compile time with TRACE_MASK, one bit per
+ * event; with TRACE_MASK 0 there's no trace at all.
+ */
+#ifndef TRACE_MASK
+#define	TRACE_MASK		0
+#endif
+
+#define	TRACE_NRECS		1024	/* power of 2 */
+
+#define	TRACE_EV_TIME		0	/* high bits of next record's delta */
+#define	TRACE_EV_RX		1	/* byte from keyboard; arg = byte */
+#define	TRACE_EV_ENQUEUE	2	/* byte queued; arg = byte */
+#define	TRACE_EV_DROP		3	/* queue full; arg = byte */
+#define	TRACE_EV_DEQUEUE	4	/* byte dequeued; arg = byte */
+#define	TRACE_EV_KBD_REPORT	5	/* arg = key code */
+#define	TRACE_EV_JOY_REPORT	6	/* arg = (stick << 5) | data */
+#define	TRACE_EV_READY		7	/* transfer done; arg = interface */
+#define	TRACE_EV_SUSPEND	8	/* arg = remote wakeup allowed */
+#define	TRACE_EV_RESUME		9
+#define	TRACE_EV_REBOOT		10	/* arg = KBD_REBOOT_* state */
+#define	TRACE_EV_KBD_ERR	11	/* arg = NABU_CODE_ERR_* */
+#define	TRACE_EV_MOUNT		12	/* arg = mounted */
+
+#if TRACE_MASK != 0
+void		trace_init(void);
+void		trace_log(unsigned int, uint8_t);
+size_t		trace_read(size_t, uint8_t *, size_t);
+void		trace_reset(void);
+
+#define	TRACE(ev, arg)							\
+do {									\
+	if ((TRACE_MASK) & (1U << (ev))) {				\
+		trace_log((ev), (arg));					\
+	}								\
+} while (/*CONSTCOND*/0)
+#else
+#define	trace_init()		do { } while (/*CONSTCOND*/0)
+#define	TRACE(ev, arg)		do { } while (/*CONSTCOND*/0)
+#endif /* TRACE_MASK */
+
+#endif /* _TRACE_H_ */
@@ -37,16 +37,68 @@
 
 #define	CFG_TUSB_RHPORT0_MODE	(OPT_MODE_DEVICE | OPT_MODE_FULL_SPEED)
 
+/*
+ * HID_COMPOSITE puts the keyboard and both joysticks on a single HID
+ * interface, distinguished by report ID, so the adapter only uses one
+ * interrupt endpoint.  Otherwise, each gets its own interface.
+ */
+#ifndef HID_COMPOSITE
+#define	HID_COMPOSITE	0
+#endif
+
+#if HID_COMPOSITE
+#define	CFG_TUD_HID	1	/* we have 1 interface */
+#else
 #define	CFG_TUD_HID	3	/* we have 3 interfaces */
+#endif
+
+/*
+ * This sizes the buffer used for GET_REPORT / SET_REPORT control
+ * transfers, which needs to hold a full config feature report.  The
+ * interrupt endpoints themselves are sized in usb_descriptors.c.
+ */
+#define	CFG_TUD_HID_EP_BUFSIZE	64
 
 #define	USB_VID		0x4160	/* @thorpej */
 #define	USB_PID		0x0000	/* NABU Keyboard -> USB Adapter */
 
 enum {
 	ITF_NUM_KBD	= 0,
+#if !HID_COMPOSITE
 	ITF_NUM_JOY0	= 1,
 	ITF_NUM_JOY1	= 2,
+#endif
 	ITF_NUM_TOTAL
 };
 
+/*
+ * Report IDs on the keyboard interface.  The config report is a
+ * vendor-defined feature report used to manage the adapter from the
+ * host; see config_report_get() and config_report_set().  The joystick
+ * report IDs are only used with HID_COMPOSITE.
+ */
+enum {
+	REPORT_ID_KEYBOARD	= 1,
+	REPORT_ID_CONFIG	= 2,
+	REPORT_ID_JOY0		= 3,
+	REPORT_ID_JOY1		= 4,
+};
+
+/*
+ * HID_JOY_COMPACT replaces the generic TinyUSB gamepad report (6 axes,
+ * 32 buttons, 11 bytes) with a 1-byte report that carries only what a
+ * NABU joystick has: a hat switch in the low nibble and the fire button.
+ * The remaining bits are reserved.
+ */
+#ifndef HID_JOY_COMPACT
+#define	HID_JOY_COMPACT	0
+#endif
+
+#define	JOY_REPORT_HAT_MASK	0x0f	/* GAMEPAD_HAT_* */
+#define	JOY_REPORT_FIRE		0x10
+
+#define	CONFIG_REPORT_HDR_SIZE	4
+#define	CONFIG_REPORT_DATA_SIZE	32
+#define	CONFIG_REPORT_SIZE	(CONFIG_REPORT_HDR_SIZE + CONFIG_REPORT_DATA_SIZE)
+
 #endif /* _TUSB_CONFIG_H_ */
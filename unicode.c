@@ -0,0 +1,177 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Unicode entry for characters the keymap can't type directly.
+ *
+ * Rather than storing an entry sequence for every such code, the
+ * sequence is generated on the fly, one chunk (a struct codeseq's
+ * worth) at a time, and fed to the keyboard sequencer just like a
+ * keymap sequence.  Chunks that leave a modifier held end with
+ * M_ENDSEQ instead of 0.
+ */
+
+/* TinyUSB SDK headers */
+#include "tusb.h"
+
+/* Standard headers */
+#include <string.h>
+
+/* Local headers */
+#include "unicode.h"
+
+static const char * const unicode_mode_names[UNICODE_NMODES] = {
+	[UNICODE_OFF]		=	"off",
+	[UNICODE_LINUX]		=	"Linux",
+	[UNICODE_MACOS]		=	"macOS",
+	[UNICODE_WINDOWS]	=	"Windows",
+};
+
+/* Unicode Hex Input is its own (QWERTY) layout on macOS. */
+static const uint8_t unicode_hex_keys[16] = {
+	HID_KEY_0, HID_KEY_1, HID_KEY_2, HID_KEY_3,
+	HID_KEY_4, HID_KEY_5, HID_KEY_6, HID_KEY_7,
+	HID_KEY_8, HID_KEY_9, HID_KEY_A, HID_KEY_B,
+	HID_KEY_C, HID_KEY_D, HID_KEY_E, HID_KEY_F,
+};
+
+/* Alt codes have to be typed on the keypad. */
+static const uint8_t unicode_keypad_keys[10] = {
+	HID_KEY_KEYPAD_0, HID_KEY_KEYPAD_1, HID_KEY_KEYPAD_2,
+	HID_KEY_KEYPAD_3, HID_KEY_KEYPAD_4, HID_KEY_KEYPAD_5,
+	HID_KEY_KEYPAD_6, HID_KEY_KEYPAD_7, HID_KEY_KEYPAD_8,
+	HID_KEY_KEYPAD_9,
+};
+
+const char *
+unicode_mode_name(unsigned int mode)
+{
+	return mode < UNICODE_NMODES ? unicode_mode_names[mode] : "unknown";
+}
+
+/*
+ * The code point for a NABU code that the keymap leaves unassigned.
+ * The printable ASCII codes the keyboard doesn't normally send are
+ * themselves, and the high codes that aren't joystick data are taken
+ * as ISO 8859-1.  Returns 0 if there isn't one.
+ */
+uint32_t
+unicode_codepoint(uint8_t c)
+{
+	if ((c >= 0x20 && c <= 0x7e) || c >= 0xc0) {
+		return c;
+	}
+	return 0;
+}
+
+void
+unicode_start(struct unicode_gen *g, unsigned int mode, uint32_t cp)
+{
+	unsigned int base = mode == UNICODE_WINDOWS ? 10 : 16;
+	uint8_t digits[sizeof(g->digits)];
+	int n = 0;
+
+	g->cp = cp;
+
+	/* macOS always wants 4 digits; Alt codes want a leading 0. */
+	do {
+		digits[n++] = cp % base;
+		cp /= base;
+	} while (cp != 0);
+	if (mode == UNICODE_MACOS) {
+		while (n < 4) {
+			digits[n++] = 0;
+		}
+	} else if (mode == UNICODE_WINDOWS) {
+		while (n < 3) {
+			digits[n++] = 0;
+		}
+		digits[n++] = 0;
+	}
+
+	g->mode = mode;
+	g->step = 0;
+	g->ndigits = n;
+	for (int i = 0; i < n; i++) {
+		g->digits[i] = digits[n - 1 - i];
+	}
+}
+
+/*
+ * Generate the next chunk of the entry sequence.  Returns false
+ * (and goes idle) when there's nothing left.
+ */
+bool
+unicode_next(struct unicode_gen *g, const struct keymap *km,
+    struct codeseq *seq)
+{
+	unsigned int step = g->step++;
+	uint8_t d;
+
+	if (g->cp == 0) {
+		return false;
+	}
+
+	memset(seq, 0, sizeof(*seq));
+
+	if (g->mode == UNICODE_LINUX) {
+		if (step == 0) {
+			/* Ctrl+Shift+U */
+			seq->codes[0] = M_CTRL;
+			seq->codes[1] = M_CTRL | M_SHIFT;
+			seq->codes[2] = M_CTRL | M_SHIFT | HID_KEY_U;
+			seq->codes[3] = M_CTRL | M_SHIFT;
+			seq->codes[4] = M_CTRL;
+		} else if (step <= g->ndigits) {
+			/* Type the digit however the host layout does it. */
+			d = g->digits[step - 1];
+			keymap_expand(km, 0, d < 10 ? '0' + d : 'a' + d - 10,
+			    seq);
+		} else if (step == g->ndigits + 1) {
+			seq->codes[0] = HID_KEY_SPACE;
+		} else {
+			g->cp = 0;
+			return false;
+		}
+		return true;
+	}
+
+	/* macOS and Windows: hold down Alt (Option) for the digits. */
+	if (step == 0) {
+		seq->codes[0] = M_ALT | M_ENDSEQ;
+	} else if (step <= g->ndigits) {
+		d = g->digits[step - 1];
+		seq->codes[0] = M_ALT | (g->mode == UNICODE_WINDOWS ?
+		    unicode_keypad_keys[d] : unicode_hex_keys[d]);
+		seq->codes[1] = M_ALT | M_ENDSEQ;
+	} else if (step == g->ndigits + 1) {
+		seq->codes[0] = HID_KEY_NONE;
+	} else {
+		g->cp = 0;
+		return false;
+	}
+	return true;
+}
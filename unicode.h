@@ -0,0 +1,63 @@
+/*-
+ * Copyright (c) 2022 Jason R. Thorpe.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _UNICODE_H_
+#define	_UNICODE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "keymap.h"
+
+/*
+ * Ways of getting the host to enter an arbitrary Unicode character.
+ */
+enum {
+	UNICODE_OFF	= 0,
+	UNICODE_LINUX	= 1,	/* Ctrl+Shift+U, hex digits, Space */
+	UNICODE_MACOS	= 2,	/* Option + 4 hex digits (Unicode Hex Input) */
+	UNICODE_WINDOWS	= 3,	/* Alt + keypad 0 + decimal digits */
+	UNICODE_NMODES
+};
+
+/*
+ * State for generating an entry sequence, a few reports at a time.
+ */
+struct unicode_gen {
+	uint32_t	cp;		/* code point; 0 if idle */
+	uint8_t		mode;
+	uint8_t		step;
+	uint8_t		ndigits;
+	uint8_t		digits[8];	/* most significant first */
+};
+
+const char *	unicode_mode_name(unsigned int);
+uint32_t	unicode_codepoint(uint8_t);
+void		unicode_start(struct unicode_gen *, unsigned int, uint32_t);
+bool		unicode_next(struct unicode_gen *, const struct keymap *,
+		    struct codeseq *);
+
+#endif /* _UNICODE_H_ */
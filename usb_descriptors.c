@@ -22,6 +22,7 @@
  * THE SOFTWARE.
  */
 
+#include "pico/unique_id.h"
 #include "tusb.h"
 
 //--------------------------------------------------------------------+
@@ -60,17 +61,72 @@ tud_descriptor_device_cb(void)
 // HID Report Descriptor
 //--------------------------------------------------------------------+
 
+#if HID_JOY_COMPACT
+// 1-byte NABU joystick report; see JOY_REPORT_* in tusb_config.h
+#define	TUD_HID_REPORT_DESC_JOY(...)					\
+	HID_USAGE_PAGE(HID_USAGE_PAGE_DESKTOP),				\
+	HID_USAGE(HID_USAGE_DESKTOP_GAMEPAD),				\
+	HID_COLLECTION(HID_COLLECTION_APPLICATION),			\
+		__VA_ARGS__						\
+		/* 4-bit hat switch, 1-8; 0 is centered */		\
+		HID_USAGE_PAGE(HID_USAGE_PAGE_DESKTOP),			\
+		HID_USAGE(HID_USAGE_DESKTOP_HAT_SWITCH),		\
+		HID_LOGICAL_MIN(1),					\
+		HID_LOGICAL_MAX(8),					\
+		HID_REPORT_COUNT(1),					\
+		HID_REPORT_SIZE(4),					\
+		HID_INPUT(HID_DATA | HID_VARIABLE | HID_ABSOLUTE |	\
+		    HID_NULL_STATE),					\
+		/* fire button */					\
+		HID_USAGE_PAGE(HID_USAGE_PAGE_BUTTON),			\
+		HID_USAGE_MIN(1),					\
+		HID_USAGE_MAX(1),					\
+		HID_LOGICAL_MIN(0),					\
+		HID_LOGICAL_MAX(1),					\
+		HID_REPORT_COUNT(1),					\
+		HID_REPORT_SIZE(1),					\
+		HID_INPUT(HID_DATA | HID_VARIABLE | HID_ABSOLUTE),	\
+		/* reserved */						\
+		HID_REPORT_COUNT(1),					\
+		HID_REPORT_SIZE(3),					\
+		HID_INPUT(HID_CONSTANT),				\
+	HID_COLLECTION_END
+#else
+#define	TUD_HID_REPORT_DESC_JOY(...)					\
+	TUD_HID_REPORT_DESC_GAMEPAD(__VA_ARGS__)
+#endif
+
 static uint8_t const
 desc_hid_kbd[] =
 {
-	TUD_HID_REPORT_DESC_KEYBOARD()
+	TUD_HID_REPORT_DESC_KEYBOARD(HID_REPORT_ID(REPORT_ID_KEYBOARD)),
+
+	// Vendor-defined config feature report
+	HID_USAGE_PAGE_N(HID_USAGE_PAGE_VENDOR, 2),
+	HID_USAGE(0x01),
+	HID_COLLECTION(HID_COLLECTION_APPLICATION),
+		HID_REPORT_ID(REPORT_ID_CONFIG)
+		HID_USAGE(0x02),
+		HID_LOGICAL_MIN(0x00),
+		HID_LOGICAL_MAX_N(0xff, 2),
+		HID_REPORT_SIZE(8),
+		HID_REPORT_COUNT(CONFIG_REPORT_SIZE),
+		HID_FEATURE(HID_DATA | HID_VARIABLE | HID_ABSOLUTE),
+	HID_COLLECTION_END,
+
+#if HID_COMPOSITE
+	TUD_HID_REPORT_DESC_JOY(HID_REPORT_ID(REPORT_ID_JOY0)),
+	TUD_HID_REPORT_DESC_JOY(HID_REPORT_ID(REPORT_ID_JOY1)),
+#endif
 };
 
+#if !HID_COMPOSITE
 static uint8_t const
 desc_hid_joy[] =
 {
-	TUD_HID_REPORT_DESC_GAMEPAD()
+	TUD_HID_REPORT_DESC_JOY()
 };
+#endif
 
 // Invoked when received GET HID REPORT DESCRIPTOR
 // Application return pointer to descriptor
@@ -82,9 +138,11 @@ tud_hid_descriptor_report_cb(uint8_t itf)
 	case ITF_NUM_KBD:
 		return desc_hid_kbd;
 
+#if !HID_COMPOSITE
 	case ITF_NUM_JOY0:
 	case ITF_NUM_JOY1:
 		return desc_hid_joy;
+#endif
 	}
 
 	return NULL;
@@ -95,11 +153,16 @@ tud_hid_descriptor_report_cb(uint8_t itf)
 //--------------------------------------------------------------------+
 
 #define	CONFIG_TOTAL_LEN	(TUD_CONFIG_DESC_LEN +		\
-				 (TUD_HID_DESC_LEN * 3))
+				 (TUD_HID_DESC_LEN * CFG_TUD_HID))
 
 #define	EPNUM_KBD		0x81
+#if !HID_COMPOSITE
 #define	EPNUM_JOY0		0x82
 #define	EPNUM_JOY1		0x83
+#endif
+
+// Our input reports are all small; don't waste periodic bandwidth.
+#define	HID_EP_SIZE		16
 
 static uint8_t const desc_configuration[] =
 {
@@ -113,15 +176,17 @@ static uint8_t const desc_configuration[] =
 	//     size, polling interval
 	TUD_HID_DESCRIPTOR(ITF_NUM_KBD, 4, HID_ITF_PROTOCOL_NONE,
 	    sizeof(desc_hid_kbd), EPNUM_KBD,
-	    CFG_TUD_HID_EP_BUFSIZE, 10),
+	    HID_EP_SIZE, 10),
 
+#if !HID_COMPOSITE
 	TUD_HID_DESCRIPTOR(ITF_NUM_JOY0, 5, HID_ITF_PROTOCOL_NONE,
 	    sizeof(desc_hid_joy), EPNUM_JOY0,
-	    CFG_TUD_HID_EP_BUFSIZE, 10),
+	    HID_EP_SIZE, 10),
 
 	TUD_HID_DESCRIPTOR(ITF_NUM_JOY1, 6, HID_ITF_PROTOCOL_NONE,
 	    sizeof(desc_hid_joy), EPNUM_JOY1,
-	    CFG_TUD_HID_EP_BUFSIZE, 10),
+	    HID_EP_SIZE, 10),
+#endif
 };
 
 // Invoked when received GET CONFIGURATION DESCRIPTOR
@@ -140,58 +205,78 @@ tud_descriptor_configuration_cb(uint8_t index)
 
 const char version_string[] = "v0.5";
 
+// Pico flash unique ID, as hex digits
+static char serial_string[PICO_UNIQUE_BOARD_ID_SIZE_BYTES * 2 + 1];
+
 // array of pointer to string descriptors
 static char const* string_desc_arr[] =
 {
-  (const char[]) { 0x09, 0x04 },  // 0: is supported language is English (0x0409)
+  NULL,                           // 0: is supported language (see below)
   "@thorpej",                     // 1: Manufacturer
   "NABU Keyboard Adapter",        // 2: Product
-  version_string,                 // 3: Serials, should use chip ID
+  serial_string,                  // 3: Serial number
   "Keyboard",                     // 4: Interface 1 String
   "Joystick 0",                   // 5: Interface 2 String
   "Joystick 1",                   // 6: Interface 3 String
 };
-static const unsigned int string_desc_arr_cnt =
-    sizeof(string_desc_arr)/sizeof(string_desc_arr[0]);
+#define	STRING_DESC_COUNT	\
+	(sizeof(string_desc_arr) / sizeof(string_desc_arr[0]))
 
-static uint16_t _desc_str[32];
+// Max chars per string descriptor
+#define	STRING_DESC_MAXCHARS	31
 
-// Invoked when received GET STRING DESCRIPTOR request
-// Application return pointer to descriptor, whose contents must exist long enough for transfer to complete
-uint16_t const*
-tud_descriptor_string_cb(uint8_t index, uint16_t langid)
-{
-	(void) langid;
+// UTF-16 string descriptors, built once by usb_descriptors_init()
+static uint16_t string_desc[STRING_DESC_COUNT][1 + STRING_DESC_MAXCHARS];
 
+// Build all of the string descriptors.  This needs to be called before
+// the USB stack is initialized.  Returns the serial number string.
+const char *
+usb_descriptors_init(void)
+{
 	uint8_t chr_count;
 
-	if (index == 0) {
-		memcpy(&_desc_str[1], string_desc_arr[0], 2);
-		chr_count = 1;
-	} else {
-		// Note: the 0xEE index string is a Microsoft OS 1.0 Descriptors.
-		// https://docs.microsoft.com/en-us/windows-hardware/drivers/usbcon/microsoft-defined-usb-descriptors
+	pico_get_unique_board_id_string(serial_string, sizeof(serial_string));
 
-		if (index >= string_desc_arr_cnt) {
-			return NULL;
-		}
+	// English (0x0409) is the only supported language
+	string_desc[0][1] = 0x0409;
+	string_desc[0][0] = (TUSB_DESC_STRING << 8) | (2 + 2);
 
+	for (unsigned int index = 1; index < STRING_DESC_COUNT; index++) {
 		const char* str = string_desc_arr[index];
 
 		// Cap at max char
 		chr_count = strlen(str);
-		if (chr_count > 31) {
-			chr_count = 31;
+		if (chr_count > STRING_DESC_MAXCHARS) {
+			chr_count = STRING_DESC_MAXCHARS;
 		}
 
 		// Convert ASCII string into UTF-16
 		for(uint8_t i = 0; i < chr_count; i++) {
-			_desc_str[1+i] = str[i];
+			string_desc[index][1+i] = str[i];
 		}
+
+		// first byte is length (including header), second byte is
+		// string type
+		string_desc[index][0] =
+		    (TUSB_DESC_STRING << 8) | ((2 * chr_count) + 2);
 	}
 
-	// first byte is length (including header), second byte is string type
-	_desc_str[0] = (TUSB_DESC_STRING << 8) | ((2 * chr_count) + 2);
+	return serial_string;
+}
+
+// Invoked when received GET STRING DESCRIPTOR request
+// Application return pointer to descriptor, whose contents must exist long enough for transfer to complete
+uint16_t const*
+tud_descriptor_string_cb(uint8_t index, uint16_t langid)
+{
+	(void) langid;
+
+	// Note: the 0xEE index string is a Microsoft OS 1.0 Descriptors.
+	// https://docs.microsoft.com/en-us/windows-hardware/drivers/usbcon/microsoft-defined-usb-descriptors
+
+	if (index >= STRING_DESC_COUNT) {
+		return NULL;
+	}
 
-	return _desc_str;
+	return string_desc[index];
 }